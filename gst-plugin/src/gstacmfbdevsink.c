@@ -45,6 +45,11 @@
 #define DEFAULT_ENABLE_VSYNC	TRUE
 #define DEFAULT_ENABLE_BLANK_SCREEN	FALSE
 
+/* モザイクで、この回数のリフレッシュの間タイルを描画しない sink は、
+ * 止まっているとみなして PAN の判定から外す
+ */
+#define MOSAIC_STALL_REFRESHES		30
+
 /* デバッグログ出力フラグ		*/
 #define DBG_LOG_RENDER				0
 #define DBG_LOG_RENDER_SKIP			0
@@ -65,9 +70,20 @@ gettimeofday_sec()
 	return (double)t.tv_sec + (double)t.tv_usec * 1e-6;
 }
 
+typedef struct _GstAcmFBDevMosaic GstAcmFBDevMosaic;
+
 struct _GstAcmFBDevSinkPrivate
 {
 	struct fb_dmabuf_export fb_dmabuf_exp[NUM_FB_DMABUF];
+
+	/* 参加しているモザイク表示のグループ	*/
+	GstAcmFBDevMosaic *mosaic;
+	/* モザイクの、PAN 判定の対象になっているか
+	 * (参加した時点から対象になり、EOS / FLUSH で外れる)
+	 */
+	gboolean mosaic_active;
+	/* モザイクで、最後にタイルを描画した時刻 (monotonic, usec)。未描画なら 0	*/
+	gint64 mosaic_render_time;
 	
 	/* 最後にレンダリングした、DMABUF インデックス		*/
 	int last_show_fb_dmabuf_index;
@@ -112,6 +128,7 @@ enum
 	PROP_USE_DMABUF,
 	PROP_ENABLE_VSYNC,
 	PROP_ENABLE_BLANK_SCREEN,
+	PROP_MOSAIC_GROUP,
 };
 
 #define GST_FBDEV_TEMPLATE_CAPS_RGB \
@@ -195,6 +212,7 @@ static gboolean gst_acm_fbdevsink_setcaps (GstBaseSink * bsink, GstCaps * caps);
 static gboolean gst_acm_fbdevsink_start (GstBaseSink * bsink);
 static gboolean gst_acm_fbdevsink_stop (GstBaseSink * bsink);
 static gboolean gst_acm_fbdevsink_query (GstBaseSink * sink, GstQuery * query);
+static gboolean gst_acm_fbdevsink_event (GstBaseSink * sink, GstEvent * event);
 static GstFlowReturn gst_acm_fbdevsink_chain (GstPad * pad,
 	GstObject * parent, GstBuffer * buf);
 static GstFlowReturn gst_acm_fbdevsink_preroll (GstBaseSink * bsink,
@@ -351,6 +369,377 @@ fbio_waitforvsync_failed:
 	}
 }
 
+/* モザイク表示
+ * 同じ mosaic-group の sink は、フレームバッファの DMABUF を共有し、
+ * それぞれのデコーダは、ストライドとオフセットで、別々の領域 (タイル) に
+ * デコードする。全てのタイルが揃ったインデックスに、最後に揃えた sink が
+ * 1回だけ PAN する
+ */
+typedef struct _GstAcmFBDevMosaicTile {
+	GstAcmFBDevSink *sink;
+	GstBuffer *buf;
+} GstAcmFBDevMosaicTile;
+
+struct _GstAcmFBDevMosaic {
+	/* "デバイス名:グループ名"	*/
+	gchar *key;
+	/* グループに参加している sink と、その数 (= タイル数)	*/
+	GSList *members;
+	gint num_members;
+	/* 最初のタイルを描画した時刻 (monotonic, usec)。
+	 * まだ描画していない sink の、止まっているかどうかの判定に使う
+	 */
+	gint64 start_time;
+	/* タイルを描画しない sink を、止まっているとみなすまでの時間 (usec)	*/
+	gint64 stall_usec;
+	struct fb_dmabuf_export fb_dmabuf_exp[NUM_FB_DMABUF];
+	/* インデックスごとの、描画済みのタイル	*/
+	GSList *tiles[NUM_FB_DMABUF];
+	/* 表示中、および前回表示したインデックス	*/
+	gint displaying_index;
+	gint prev_displaying_index;
+	/* PAN の ioctl を直列化する。mosaic_lock を持ったまま VSYNC を待つと、
+	 * 他のグループの sink まで止まってしまうため、グループごとのロックにする
+	 */
+	GMutex pan_lock;
+	/* インデックスが揃った順番と、PAN を終えた順番。追い越された PAN は行わない	*/
+	guint complete_seq;
+	guint panned_seq;
+	/* 最初の sink が保存した VSCREENINFO。最後の sink が元に戻す	*/
+	struct fb_var_screeninfo saved_varinfo;
+	gboolean is_changed_fb_varinfo;
+};
+
+static GMutex mosaic_lock;
+static GHashTable *mosaic_groups = NULL;
+
+static void
+mosaic_release_tiles(GstAcmFBDevMosaic *mosaic, gint index,
+	GstAcmFBDevSink *sink)
+{
+	GSList *l = mosaic->tiles[index];
+	GSList *remain = NULL;
+
+	while (l) {
+		GstAcmFBDevMosaicTile *tile = l->data;
+
+		if (NULL == sink || tile->sink == sink) {
+			gst_buffer_unref (tile->buf);
+			g_slice_free (GstAcmFBDevMosaicTile, tile);
+		}
+		else {
+			remain = g_slist_prepend (remain, tile);
+		}
+		l = g_slist_delete_link (l, l);
+	}
+	mosaic->tiles[index] = remain;
+}
+
+/* PAN 判定の対象になっている sink か。参加した時点から対象になり、
+ * EOS / FLUSH した sink と、MOSAIC_STALL_REFRESHES 回のリフレッシュの間
+ * タイルを描画していない sink は外す (最初の PAN も、全ての sink を待つ)
+ */
+static gboolean
+mosaic_is_live(GstAcmFBDevMosaic *mosaic, GstAcmFBDevSink *sink, gint64 now)
+{
+	gint64 last;
+
+	if (! sink->priv->mosaic_active) {
+		return FALSE;
+	}
+
+	last = sink->priv->mosaic_render_time;
+	if (0 == last) {
+		last = mosaic->start_time;
+	}
+
+	return (0 == last || now - last < mosaic->stall_usec);
+}
+
+/* PAN 判定の対象になっている sink の数	*/
+static guint
+mosaic_count_live_members(GstAcmFBDevMosaic *mosaic, gint64 now)
+{
+	GSList *l;
+	guint count = 0;
+
+	for (l = mosaic->members; l; l = l->next) {
+		if (mosaic_is_live (mosaic, l->data, now)) {
+			count++;
+		}
+	}
+
+	return count;
+}
+
+/* PAN 判定の対象になっている sink のタイルを数える	*/
+static guint
+mosaic_count_live_tiles(GstAcmFBDevMosaic *mosaic, gint index, gint64 now)
+{
+	GSList *l;
+	guint count = 0;
+
+	for (l = mosaic->tiles[index]; l; l = l->next) {
+		GstAcmFBDevMosaicTile *tile = l->data;
+
+		if (mosaic_is_live (mosaic, tile->sink, now)) {
+			count++;
+		}
+	}
+
+	return count;
+}
+
+/* EOS / FLUSH した sink を、PAN の判定から外す。表示中以外のタイルはデバイスに戻す。
+ * 次にタイルを描画した時に、再び判定の対象になる
+ */
+static void
+mosaic_deactivate(GstAcmFBDevSink *me)
+{
+	GstAcmFBDevMosaic *mosaic = me->priv->mosaic;
+	gint i;
+
+	if (NULL == mosaic) {
+		return;
+	}
+
+	g_mutex_lock (&mosaic_lock);
+	if (me->priv->mosaic_active) {
+		me->priv->mosaic_active = FALSE;
+		for (i = 0; i < NUM_FB_DMABUF; i++) {
+			if (i != mosaic->displaying_index
+				&& i != mosaic->prev_displaying_index) {
+				mosaic_release_tiles (mosaic, i, me);
+			}
+		}
+		GST_INFO_OBJECT (me, "deactivate mosaic %s (%u/%d tiles)", mosaic->key,
+						 mosaic_count_live_members (mosaic, g_get_monotonic_time ()),
+						 mosaic->num_members);
+	}
+	g_mutex_unlock (&mosaic_lock);
+}
+
+/* モザイクのグループに参加する。最初の sink が DMABUF を取得する。
+ * *is_first には、最初に参加したかどうかを返す
+ */
+static gboolean
+mosaic_join(GstAcmFBDevSink *me, gboolean *is_first)
+{
+	GstAcmFBDevMosaic *mosaic;
+	gchar *key;
+	gint i;
+
+	*is_first = FALSE;
+	key = g_strdup_printf ("%s:%s", me->device, me->mosaic_group);
+
+	g_mutex_lock (&mosaic_lock);
+	if (NULL == mosaic_groups) {
+		mosaic_groups = g_hash_table_new (g_str_hash, g_str_equal);
+	}
+	mosaic = g_hash_table_lookup (mosaic_groups, key);
+	if (NULL == mosaic) {
+		mosaic = g_slice_new0 (GstAcmFBDevMosaic);
+		for (i = 0; i < NUM_FB_DMABUF; i++) {
+			mosaic->fb_dmabuf_exp[i].index = i;
+			mosaic->fb_dmabuf_exp[i].flags = O_CLOEXEC;
+			if (0 != ioctl (me->fd, FBIOGET_DMABUF, &(mosaic->fb_dmabuf_exp[i]))) {
+				for (i -= 1; i >= 0; i--)
+					close (mosaic->fb_dmabuf_exp[i].fd);
+
+				g_slice_free (GstAcmFBDevMosaic, mosaic);
+				g_mutex_unlock (&mosaic_lock);
+				g_free (key);
+				return FALSE;
+			}
+			GST_INFO_OBJECT (me, "got the dma buf's fd[%d]=%d for mosaic %s",
+							 i, mosaic->fb_dmabuf_exp[i].fd, key);
+		}
+		mosaic->key = key;
+		mosaic->displaying_index = -1;
+		mosaic->prev_displaying_index = -1;
+		mosaic->stall_usec = (gint64) MOSAIC_STALL_REFRESHES * G_USEC_PER_SEC
+			/ MAX (get_disp_refresh_rate (me, &(me->varinfo)), 1);
+		g_mutex_init (&mosaic->pan_lock);
+		mosaic->saved_varinfo = me->saved_varinfo;
+		g_hash_table_insert (mosaic_groups, mosaic->key, mosaic);
+		*is_first = TRUE;
+	}
+	else {
+		g_free (key);
+	}
+	mosaic->members = g_slist_prepend (mosaic->members, me);
+	mosaic->num_members++;
+	me->priv->mosaic = mosaic;
+	me->priv->mosaic_active = TRUE;
+	me->priv->mosaic_render_time = 0;
+	GST_INFO_OBJECT (me, "join mosaic %s (%d tiles)",
+					 mosaic->key, mosaic->num_members);
+	g_mutex_unlock (&mosaic_lock);
+
+	return TRUE;
+}
+
+/* モザイクのグループから抜ける。最後の sink が DMABUF を解放し、
+ * VSCREENINFO を元に戻すよう、is_changed_fb_varinfo と saved_varinfo を引き継ぐ。
+ * *is_last には、最後に抜けたかどうかを返す
+ */
+static void
+mosaic_leave(GstAcmFBDevSink *me, gboolean *is_last)
+{
+	GstAcmFBDevMosaic *mosaic = me->priv->mosaic;
+	gint i;
+
+	*is_last = FALSE;
+	if (NULL == mosaic) {
+		return;
+	}
+	me->priv->mosaic = NULL;
+
+	g_mutex_lock (&mosaic_lock);
+	for (i = 0; i < NUM_FB_DMABUF; i++) {
+		mosaic_release_tiles (mosaic, i, me);
+	}
+	me->priv->mosaic_active = FALSE;
+	mosaic->members = g_slist_remove (mosaic->members, me);
+	mosaic->num_members--;
+	if (me->is_changed_fb_varinfo) {
+		mosaic->is_changed_fb_varinfo = TRUE;
+	}
+	me->is_changed_fb_varinfo = FALSE;
+	GST_INFO_OBJECT (me, "leave mosaic %s (%d tiles)",
+					 mosaic->key, mosaic->num_members);
+	if (0 == mosaic->num_members) {
+		g_hash_table_remove (mosaic_groups, mosaic->key);
+		for (i = NUM_FB_DMABUF - 1; i >= 0; i--) {
+			if (0 != close (mosaic->fb_dmabuf_exp[i].fd)) {
+				GST_ERROR_OBJECT (me, "Failed to close the dmabuf fd[%d]=%d",
+								  i, mosaic->fb_dmabuf_exp[i].fd);
+			}
+		}
+		me->saved_varinfo = mosaic->saved_varinfo;
+		me->is_changed_fb_varinfo = mosaic->is_changed_fb_varinfo;
+		g_mutex_clear (&mosaic->pan_lock);
+		g_free (mosaic->key);
+		g_slice_free (GstAcmFBDevMosaic, mosaic);
+		*is_last = TRUE;
+	}
+	g_mutex_unlock (&mosaic_lock);
+}
+
+/* タイルを登録し、インデックスの全タイルが揃ったら PAN する。
+ * 表示を終えたインデックスのタイルは、デバイスに戻す
+ */
+static GstFlowReturn
+mosaic_render(GstAcmFBDevSink *me, GstBuffer *buf, gint index)
+{
+	GstAcmFBDevMosaic *mosaic = me->priv->mosaic;
+	GstAcmFBDevMosaicTile *tile;
+	gboolean isComplete;
+	guint seq = 0;
+	gint64 now;
+	int vsyncArg = 0;
+	int r;
+
+	if (index < 0 || index >= NUM_FB_DMABUF) {
+		GST_ELEMENT_ERROR (me, RESOURCE, SETTINGS, (NULL),
+			("invalid dmabuf index %d", index));
+		return GST_FLOW_ERROR;
+	}
+
+	now = g_get_monotonic_time ();
+
+	g_mutex_lock (&mosaic_lock);
+
+	/* EOS / FLUSH で外れていたり、止まっていたら、PAN の判定に戻る	*/
+	me->priv->mosaic_active = TRUE;
+	me->priv->mosaic_render_time = now;
+	if (0 == mosaic->start_time) {
+		mosaic->start_time = now;
+	}
+
+	/* 同じ sink の、前回のタイルは置き換える	*/
+	mosaic_release_tiles (mosaic, index, me);
+	tile = g_slice_new (GstAcmFBDevMosaicTile);
+	tile->sink = me;
+	tile->buf = gst_buffer_ref (buf);
+	mosaic->tiles[index] = g_slist_prepend (mosaic->tiles[index], tile);
+
+#if DBG_LOG_RENDER
+	GST_INFO_OBJECT (me, "%p : mosaic index:%d, tiles:%u/%u", buf, index,
+					 mosaic_count_live_tiles (mosaic, index, now),
+					 mosaic_count_live_members (mosaic, now));
+#endif
+
+	isComplete = (index != mosaic->displaying_index
+		&& mosaic_count_live_tiles (mosaic, index, now)
+			>= mosaic_count_live_members (mosaic, now));
+	if (isComplete) {
+		seq = ++mosaic->complete_seq;
+	}
+	g_mutex_unlock (&mosaic_lock);
+
+	if (! isComplete) {
+		return GST_FLOW_OK;
+	}
+
+	/* PAN は、mosaic_lock を離してから行う	*/
+	g_mutex_lock (&mosaic->pan_lock);
+
+	/* 待っている間に、後から揃ったインデックスが表示されていたら PAN しない	*/
+	g_mutex_lock (&mosaic_lock);
+	isComplete = (seq > mosaic->panned_seq && index != mosaic->displaying_index);
+	g_mutex_unlock (&mosaic_lock);
+	if (! isComplete) {
+		g_mutex_unlock (&mosaic->pan_lock);
+		return GST_FLOW_OK;
+	}
+
+	/* パンする	*/
+	me->varinfo.yoffset = me->varinfo.yres * index;
+	r = ioctl (me->fd, FBIOPAN_DISPLAY, &(me->varinfo));
+	if (0 != r) {
+		g_mutex_unlock (&mosaic->pan_lock);
+		goto fbiopan_display_failed;
+	}
+	if (me->enable_vsync && 1.0 == GST_BASE_SINK(me)->segment.rate) {
+		r = ioctl (me->fd, FBIO_WAITFORVSYNC, &vsyncArg);
+		if (0 != r) {
+			g_mutex_unlock (&mosaic->pan_lock);
+			goto fbio_waitforvsync_failed;
+		}
+	}
+
+	g_mutex_lock (&mosaic_lock);
+
+	/* PAN が終わったら、前回 PAN が終わったインデックスのタイルを QBUF する	*/
+	if (-1 != mosaic->prev_displaying_index
+		&& index != mosaic->prev_displaying_index) {
+		mosaic_release_tiles (mosaic, mosaic->prev_displaying_index, NULL);
+	}
+	mosaic->prev_displaying_index = mosaic->displaying_index;
+	mosaic->displaying_index = index;
+	mosaic->panned_seq = seq;
+
+	g_mutex_unlock (&mosaic_lock);
+	g_mutex_unlock (&mosaic->pan_lock);
+
+	return GST_FLOW_OK;
+
+	/* ERRORS */
+fbiopan_display_failed:
+	{
+		GST_ELEMENT_ERROR (me, RESOURCE, SETTINGS, (NULL),
+			("error with ioctl(FBIOPAN_DISPLAY) %d (%s)", errno, g_strerror (errno)));
+		return GST_FLOW_ERROR;
+	}
+fbio_waitforvsync_failed:
+	{
+		GST_ELEMENT_ERROR (me, RESOURCE, SETTINGS, (NULL),
+			("error with ioctl(FBIO_WAITFORVSYNC) %d (%s)", errno, g_strerror (errno)));
+		return GST_FLOW_ERROR;
+	}
+}
+
 static void
 gst_acm_fbdevsink_class_init (GstAcmFBDevSinkClass * klass)
 {
@@ -392,6 +781,12 @@ gst_acm_fbdevsink_class_init (GstAcmFBDevSinkClass * klass)
 			"FALSE: disable, TRUE: enable",
 			DEFAULT_ENABLE_BLANK_SCREEN, G_PARAM_READWRITE));
 
+	g_object_class_install_property (gobject_class, PROP_MOSAIC_GROUP,
+		g_param_spec_string ("mosaic-group", "Mosaic group",
+			"Sinks with the same group share the dma-buf frames and flip once "
+			"all of their tiles are rendered (NULL: disable)",
+			NULL, G_PARAM_READWRITE));
+
 	gst_element_class_set_details_simple (gstelement_class,
 		"ACM fbdev video sink", "Sink/Video",
 		"A linux framebuffer videosink", "Atmark Techno, Inc.");
@@ -407,6 +802,7 @@ gst_acm_fbdevsink_class_init (GstAcmFBDevSinkClass * klass)
 	gstvs_class->start = GST_DEBUG_FUNCPTR (gst_acm_fbdevsink_start);
 	gstvs_class->stop = GST_DEBUG_FUNCPTR (gst_acm_fbdevsink_stop);
 	gstvs_class->query = GST_DEBUG_FUNCPTR (gst_acm_fbdevsink_query);
+	gstvs_class->event = GST_DEBUG_FUNCPTR (gst_acm_fbdevsink_event);
 }
 
 static void
@@ -457,6 +853,10 @@ gst_acm_fbdevsink_init (GstAcmFBDevSink * me)
 	me->use_dmabuf = DEFAULT_USE_DMABUF;
 	me->enable_vsync = DEFAULT_ENABLE_VSYNC;
 	me->enable_blank_screen = DEFAULT_ENABLE_BLANK_SCREEN;
+	me->mosaic_group = NULL;
+	me->priv->mosaic = NULL;
+	me->priv->mosaic_active = FALSE;
+	me->priv->mosaic_render_time = 0;
 
 	/* retrieve and intercept base class chain. */
 	me->priv->base_chain = GST_PAD_CHAINFUNC (GST_BASE_SINK_PAD (me));
@@ -475,6 +875,10 @@ gst_acm_fbdevsink_finalize (GObject * object)
 		g_free (me->device);
 		me->device = NULL;
 	}
+	if (me->mosaic_group) {
+		g_free (me->mosaic_group);
+		me->mosaic_group = NULL;
+	}
 
 	G_OBJECT_CLASS (parent_class)->finalize (object);
 }
@@ -484,6 +888,7 @@ gst_acm_fbdevsink_start (GstBaseSink * bsink)
 {
 	GstAcmFBDevSink *me;
 	gboolean ret = TRUE;
+	gboolean isFirstTile = TRUE;
 	gint i = 0;
 
 	me = GST_ACMFBDEVSINK (bsink);
@@ -532,7 +937,17 @@ gst_acm_fbdevsink_start (GstBaseSink * bsink)
 	me->priv->lateness_sec = (double)1.1 / get_disp_refresh_rate(me, &(me->varinfo));
 	GST_INFO_OBJECT (me, "lateness_sec: %f", me->priv->lateness_sec);
 
-	if (me->use_dmabuf) {
+	if (me->use_dmabuf && me->mosaic_group) {
+		/* DMABUF は、モザイクのグループで共有する	*/
+		if (! mosaic_join (me, &isFirstTile)) {
+			goto fbioget_dmabuf_failed;
+		}
+		me->priv->last_show_fb_dmabuf_index = -1;
+		me->priv->prev_displaying_buf = NULL;
+		me->priv->displaying_buf = NULL;
+		me->priv->prev_display_time_sec = 0;
+	}
+	else if (me->use_dmabuf) {
 		/* DMABUF FDを取得 */
 		GST_INFO_OBJECT (me, "get the dma buf's fd...");
 		for (i = 0; i < NUM_FB_DMABUF; i++) {
@@ -566,8 +981,10 @@ gst_acm_fbdevsink_start (GstBaseSink * bsink)
 		}
 		GST_INFO_OBJECT(me, "framebuffer:%p", me->framebuffer);
 	}
-	/* 初期画面はブランクスクリーン	*/
-	do_blank_screen(me);
+	/* 初期画面はブランクスクリーン (モザイクでは、他のタイルを消さない)	*/
+	if (isFirstTile) {
+		do_blank_screen(me);
+	}
 
 out:
 	return ret;
@@ -607,6 +1024,8 @@ gst_acm_fbdevsink_stop (GstBaseSink * bsink)
 {
 	GstAcmFBDevSink *me;
 	gboolean ret = TRUE;
+	gboolean isLastTile = TRUE;
+	gboolean isMosaic;
 	int r = 0;
 	gint i;
 
@@ -614,8 +1033,18 @@ gst_acm_fbdevsink_stop (GstBaseSink * bsink)
 
 	GST_INFO_OBJECT (me, "ACMFBDEVSINK STOP. (%s)", me->device);
 
+	/* 表示中のタイルを戻し、最後の sink が DMABUF を解放する。
+	 * VSCREENINFO のレストアも、最後の sink だけが行う
+	 */
+	isMosaic = (NULL != me->priv->mosaic);
+	if (isMosaic) {
+		mosaic_leave (me, &isLastTile);
+	}
+
 	/* clear screen	*/
-	do_blank_screen(me);
+	if (isLastTile) {
+		do_blank_screen(me);
+	}
 
 	/* VSCREENINFO を変更した場合は元に戻す	*/
 	if (me->is_changed_fb_varinfo) {		
@@ -627,7 +1056,7 @@ gst_acm_fbdevsink_stop (GstBaseSink * bsink)
 		me->is_changed_fb_varinfo = FALSE;
 	}
 
-	if (me->use_dmabuf) {
+	if (me->use_dmabuf && ! isMosaic) {
 		if (me->priv->prev_displaying_buf && GST_IS_BUFFER(me->priv->prev_displaying_buf)) {
 			gst_buffer_unref(me->priv->prev_displaying_buf);
 			me->priv->prev_displaying_buf = NULL;
@@ -821,10 +1250,13 @@ gst_acm_fbdevsink_query (GstBaseSink * sink, GstQuery * query)
 					goto get_index_failed;
 				}
 				if (index < NUM_FB_DMABUF) {
+					const struct fb_dmabuf_export *exp = me->priv->mosaic
+						? &(me->priv->mosaic->fb_dmabuf_exp[index])
+						: &(me->priv->fb_dmabuf_exp[index]);
+
 					gst_structure_set (structure, "fd", G_TYPE_INT,
-									   me->priv->fb_dmabuf_exp[index].fd, NULL);
-					GST_INFO_OBJECT (me, "return fd[%d]=%d",
-									 index, me->priv->fb_dmabuf_exp[index].fd);
+									   exp->fd, NULL);
+					GST_INFO_OBJECT (me, "return fd[%d]=%d", index, exp->fd);
 				}
 				else {
 					gst_structure_set (structure, "fd", G_TYPE_INT, -1, NULL);
@@ -851,6 +1283,24 @@ get_index_failed:
 	}
 }
 
+static gboolean
+gst_acm_fbdevsink_event (GstBaseSink * sink, GstEvent * event)
+{
+	GstAcmFBDevSink *me = GST_ACMFBDEVSINK (sink);
+
+	switch (GST_EVENT_TYPE (event)) {
+	case GST_EVENT_EOS:
+	case GST_EVENT_FLUSH_START:
+		/* タイルが来なくなる sink を待って、モザイク全体が止まらないようにする	*/
+		mosaic_deactivate (me);
+		break;
+	default:
+		break;
+	}
+
+	return GST_BASE_SINK_CLASS (parent_class)->event (sink, event);
+}
+
 /* get caps from subclass */
 static GstCaps *
 gst_acm_fbdevsink_getcaps (GstBaseSink * bsink, GstCaps *filter)
@@ -1166,7 +1616,11 @@ gst_acm_fbdevsink_render (GstBaseSink * bsink, GstBuffer * buf)
 
 		/* バッファからDMABUF index取得	*/
 		meta = gst_buffer_get_acm_dmabuf_meta (buf);
-		if (meta) {
+		if (meta && me->priv->mosaic) {
+			/* 全タイルが揃うまで、PAN しない	*/
+			return mosaic_render (me, buf, meta->index);
+		}
+		else if (meta) {
 			int vsyncArg = 0;
 			
 #if DBG_MEASURE_PERF_RENDER
@@ -1339,6 +1793,12 @@ gst_acm_fbdevsink_set_property (GObject * object, guint prop_id,
 	case PROP_ENABLE_BLANK_SCREEN:
 		me->enable_blank_screen = g_value_get_boolean (value);
 		break;
+	case PROP_MOSAIC_GROUP:
+		if (me->mosaic_group) {
+			g_free (me->mosaic_group);
+		}
+		me->mosaic_group = g_value_dup_string (value);
+		break;
 	default:
 		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
 		break;
@@ -1366,6 +1826,9 @@ gst_acm_fbdevsink_get_property (GObject * object, guint prop_id, GValue * value,
 	case PROP_ENABLE_BLANK_SCREEN:
 		g_value_set_boolean (value, me->enable_blank_screen);
 		break;
+	case PROP_MOSAIC_GROUP:
+		g_value_set_string (value, me->mosaic_group);
+		break;
 	default:
 		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
 		break;
@@ -81,6 +81,11 @@ struct _GstAcmFBDevSink {
 
 	gboolean enable_blank_screen;
 
+	/* モザイク表示のグループ名
+	 * NULL : モザイク表示しない
+	 */
+	gchar *mosaic_group;
+
 	/*< private >*/
 	GstAcmFBDevSinkPrivate *priv;
 };
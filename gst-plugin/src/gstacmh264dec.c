@@ -44,6 +44,11 @@
 #include <gst/video/gstvideopool.h>
 #define GST_USE_UNSTABLE_API
 #include <gst/codecparsers/gsth264parser.h>
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include "gstacmh264dec.h"
 #include "gstacmv4l2_util.h"
@@ -56,6 +61,9 @@
 /* フレームのドロップは、sink 側で行う	*/
 #define DO_FRAME_DROP				0
 
+/* QoS 情報により、デバイスへの入力前にフレームをドロップする	*/
+#define DO_QOS_FRAME_DROP			1
+
 /* フィールド構造のインタレースに対応する	*/
 #define SUPPORT_CODED_FIELD			1
 
@@ -83,12 +91,24 @@
 #define DEFAULT_FRAME_STRIDE			0
 #define DEFAULT_FRAME_X_OFFSET			0
 #define DEFAULT_FRAME_Y_OFFSET			0
+#define DEFAULT_QOS						TRUE
+#define DEFAULT_WATCHDOG_FRAMES			0
+#define DEFAULT_IDR_ONLY				FALSE
+#define DEFAULT_STATS_INTERVAL			0
+
+/* QoS で、この フレーム数分以上遅れている場合は、次の IDR ピクチャまで破棄する */
+#define QOS_SKIP_TO_IDR_FRAMES			8
+
+/* 巻き戻し再生用プールのバッファ数 (GOP の長さが分かるまでの初期値)	*/
+#define DEFAULT_REVERSE_GOP_DEPTH		30
 
 /* デコーダv4l2デバイスのドライバ名 */
 #define DRIVER_NAME			"acm-h264dec"
 
 /* select() の timeout */
 #define SELECT_TIMEOUT_MSEC			1000
+/* フレーム入力時の select() の timeout (watchdog 無効の場合) */
+#define SELECT_TIMEOUT_SEC_HANDLE_FRAME	10
 
 /* デバッグログ出力フラグ		*/
 #define DBG_LOG_INTERLACED			0
@@ -96,6 +116,64 @@
 /* 一度に刈り取る出力バッファの数 */
 #define NUM_HANDLE_OUTBUF 2
 
+/* system_frame_number を、v4l2_buffer の timestamp に入れてデバイスに渡し、
+ * デコード済みバッファの timestamp から、対応するフレームを求める。
+ * (tv_sec が 0 の場合は、フレーム番号なし)
+ */
+#define FRAME_NUMBER_TO_TIMEVAL(tv, n)	\
+	do { (tv).tv_sec = (n) + 1; (tv).tv_usec = 0; } while (0)
+#define TIMEVAL_HAS_FRAME_NUMBER(tv)	(0 != (tv).tv_sec)
+#define TIMEVAL_TO_FRAME_NUMBER(tv)		((guint32)((tv).tv_sec - 1))
+
+/* デコード時間の計測のため、QBUF した時刻を記録しておくフレーム数	*/
+#define NUM_QBUF_TIME				64
+
+/* フィールドのペアの対応を記録しておくフレーム数	*/
+#define NUM_FIELD_PAIR				64
+
+/* 統計情報 (stats プロパティ、element message で通知する)	*/
+typedef struct _GstAcmH264DecCounters {
+	/* 出力したフレーム数	*/
+	guint64 num_decoded;
+	/* 理由ごとの、ドロップしたフレーム数	*/
+	guint64 num_drop_mmco;
+	guint64 num_drop_qos;
+	guint64 num_drop_stale;
+	guint64 num_drop_resync;
+	/* 対になるフィールドが無いまま出力したフィールド数	*/
+	guint64 num_unpaired_field;
+	/* QBUF から DQBUF までの時間の最大値	*/
+	GstClockTime decode_time_peak;
+	/* 直近の 1秒間のフレームレート	*/
+	gdouble fps;
+	GstClockTime fps_start_time;
+	guint64 fps_start_decoded;
+	/* element message を通知した時刻	*/
+	GstClockTime message_time;
+	/* 出力時の状態のスナップショット。出力フォーマットやプールは、
+	 * set_format / change_resolution で解放されるので、stats プロパティからは
+	 * 直接参照せず、ストリーミングスレッドでコピーしておく
+	 */
+	gchar out_format[16];
+	guint bits_per_pixel;
+	gint out_width;
+	gint out_height;
+	gint fps_n;
+	gint fps_d;
+	guint output_queued;
+	guint num_pending;
+} GstAcmH264DecCounters;
+
+/* 統計情報のカウンタは、stats プロパティでアプリケーションのスレッドから
+ * 読まれるので、GST_OBJECT_LOCK で保護して更新する
+ */
+#define COUNTERS_INC(me, member)	\
+	do {	\
+		GST_OBJECT_LOCK (me);	\
+		(me)->priv->counters.member++;	\
+		GST_OBJECT_UNLOCK (me);	\
+	} while (0)
+
 struct _GstAcmH264DecPrivate
 {
 	/* V4L2_BUF_TYPE_VIDEO_OUTPUT 側に入力したフレーム数と、
@@ -117,14 +195,69 @@ struct _GstAcmH264DecPrivate
 	 */
 	GstBuffer* displaying_buf;
 
-#if SUPPORT_CODED_FIELD
+	/* 巻き戻し再生の際、GstVideoDecoder 側で GOP 単位にキューイングされる
+	 * 出力バッファ用のプール。フレーム毎に allocate せず、使い回す
+	 */
+	GstBufferPool* reverse_pool;
+	guint reverse_pool_size;
+	guint reverse_pool_max;
+	/* 巻き戻し再生で出力した、直前の IDR ピクチャからのフレーム数と、その最大値	*/
+	guint reverse_gop_frames;
+	guint reverse_gop_depth;
+
 	/* NALユニットパーサ	*/
 	GstH264NalParser *nalparser;
+	guint nal_length_size;
+
+	/* 次に入力するフレームの前に、SPS/PPS を挿入する	*/
+	gboolean need_spspps;
+	/* ストライドが、出力画像サイズに従っている
+	 * (ストリーム途中のサイズ変更で、追従させる)
+	 */
+	gboolean stride_follows_width;
+
+	/* デバイスが、QBUF した timestamp (フレーム番号) をデコード済みバッファに
+	 * 引き継ぐかどうか (最初の DQBUF で確認する)
+	 */
+	gboolean is_checked_frame_number;
+	gboolean has_frame_number;
+
+	/* フレームを QBUF した時刻 (system_frame_number % NUM_QBUF_TIME)	*/
+	GstClockTime qbuf_time[NUM_QBUF_TIME];
+	/* QBUF から、デコード済みバッファを取り出すまでの時間 (移動平均)	*/
+	GstClockTime decode_time;
+	/* down stream に通知したレイテンシ	*/
+	GstClockTime latency;
+
+	/* デバイスのストールから復帰後、次の IDR ピクチャまで入力を破棄している */
+	gboolean resync_waiting_idr;
+
+	/* 統計情報	*/
+	GstAcmH264DecCounters counters;
+
+#if DO_QOS_FRAME_DROP
+	/* QoS により、次の IDR ピクチャまで入力を破棄している	*/
+	gboolean qos_waiting_idr;
+	/* QoS により、フィールドのペアの最初のフィールドを破棄した	*/
+	gboolean qos_dropped_first_field;
+#endif
+
+#if SUPPORT_CODED_FIELD
 	/* progressive or interlaced ?	*/
 	gboolean is_interlaced;
-	guint nal_length_size;
-	/* フィールド構造 or フレーム構造 ?	*/
+	/* フィールド構造 or フレーム構造 ?
+	 * (最初のフレームで決定し、ストリーム途中では変更しない)
+	 */
 	gboolean is_field_structure;
+	/* 直前に入力したフィールドが、ペアの最初のフィールド	*/
+	gboolean waiting_second_field;
+	gboolean first_field_is_top;
+	guint32 first_field_frame_num;
+	guint32 first_field_number;
+	/* 2番目のフィールドのフレームに対する、最初のフィールドのフレーム番号
+	 * (system_frame_number % NUM_FIELD_PAIR)
+	 */
+	guint32 field_partner[NUM_FIELD_PAIR];
 #endif
 };
 
@@ -140,6 +273,12 @@ typedef enum
 	GST_VIDEO_CODEC_FRAME_FLAG_TOP_BOTTOM_FIELD		= (1<<26),
 	/** フレームを格納			*/
 	GST_VIDEO_CODEC_FRAME_FLAG_FRAME				= (1<<27),
+	/** トップフィールドが先		*/
+	GST_VIDEO_CODEC_FRAME_FLAG_TFF					= (1<<28),
+	/** ペアの 2番目のフィールドを格納	*/
+	GST_VIDEO_CODEC_FRAME_FLAG_SECOND_FIELD			= (1<<29),
+	/** SEI の pic_struct により、プログレッシブのフレーム	*/
+	GST_VIDEO_CODEC_FRAME_FLAG_PROGRESSIVE			= (1<<30),
 } GstVideoCodecFrameFlagsEx;
 #endif
 
@@ -161,6 +300,24 @@ enum
 	PROP_FRAME_Y_OFFSET,
 	PROP_BUF_PIC_CNT,
 	PROP_ENABLE_VIO6,
+	PROP_QOS,
+	PROP_STATS,
+	PROP_WATCHDOG_FRAMES,
+	PROP_IDR_ONLY,
+	PROP_STATS_INTERVAL,
+};
+
+/* 出力フォーマットの候補と、1画素あたりのビット数。
+ * down stream が受け付ける中で、メモリ帯域の少ないものを優先する
+ */
+static const struct {
+	const gchar *format;
+	guint bits_per_pixel;
+} out_format_rank[] = {
+	{ "NV12",	12 },
+	{ "RGB16",	16 },
+	{ "RGB",	24 },
+	{ "RGBx",	32 },
 };
 
 /* pad template caps for source and sink pads.	*/
@@ -172,12 +329,20 @@ GST_STATIC_PAD_TEMPLATE ("sink",
 		/* TSコンテナの場合、tsdemux からは直接リンクできず、h264parse を挟まなく
 		 * てはならない。この場合、stream-format = avc, alignment = au に限定
 		 * しないと SPS, PPS の解析をしてくれない。
+		 * byte-stream は、SPS, PPS がストリーム中にあるので、そのまま入力する
+		 * (GstVideoDecoder は 1 バッファを 1 フレームとして扱うので、au のみ)
 		 */
 		"video/x-h264, "
 		"stream-format = (string)avc, "
 		"alignment = (string)au, "
 		"width  = (int)[80, 1920], "
 		"height = (int)[80, 1080], "
+		"framerate = (fraction) [ 0/1, MAX ]; "
+		"video/x-h264, "
+		"stream-format = (string)byte-stream, "
+		"alignment = (string)au, "
+		"width  = (int)[80, 1920], "
+		"height = (int)[80, 1080], "
 		"framerate = (fraction) [ 0/1, MAX ] "
 	)
 );
@@ -265,17 +430,27 @@ static gboolean gst_acm_h264_dec_sink_event (GstVideoDecoder * dec,
 	GstEvent *event);
 
 static gboolean gst_acm_h264_dec_init_decoder (GstAcmH264Dec * me);
+static gboolean gst_acm_h264_dec_set_output_state (GstAcmH264Dec * me);
+static gboolean gst_acm_h264_dec_change_resolution (GstAcmH264Dec * me,
+	guint width, guint height, GstVideoCodecFrame * pending);
+static GstFlowReturn gst_acm_h264_dec_drain (GstAcmH264Dec * me,
+	GstVideoCodecFrame * pending);
 static gboolean gst_acm_h264_dec_cleanup_decoder (GstAcmH264Dec * me);
 static GstFlowReturn gst_acm_h264_dec_handle_in_frame(GstAcmH264Dec * me,
 	struct v4l2_buffer* v4l2buf_in, GstBuffer *inbuf, GstVideoCodecFrame * frame);
 static GstFlowReturn gst_acm_h264_dec_handle_out_frame(GstAcmH264Dec * me,
 	GstBuffer *v4l2buf_out, gboolean* is_eos);
+static GstH264ParserResult gst_acm_h264_dec_identify_nalu(GstAcmH264Dec *me,
+	const guint8 *data, guint offset, gsize size, GstH264NalUnit *nalu);
 
 static void gst_acm_h264_dec_set_property (GObject * object, guint prop_id,
 	const GValue * value, GParamSpec * pspec);
 static void gst_acm_h264_dec_get_property (GObject * object, guint prop_id,
 	GValue * value, GParamSpec * pspec);
 static void gst_acm_h264_dec_finalize (GObject * object);
+static GstStructure *gst_acm_h264_dec_get_stats (GstAcmH264Dec * me);
+static void gst_acm_h264_dec_update_latency (GstAcmH264Dec * me,
+	gboolean force);
 
 #define gst_acm_h264_dec_parent_class parent_class
 G_DEFINE_TYPE (GstAcmH264Dec, gst_acm_h264_dec, GST_TYPE_VIDEO_DECODER);
@@ -310,6 +485,18 @@ gst_acm_h264_dec_set_property (GObject * object, guint prop_id,
 	case PROP_FRAME_Y_OFFSET:
 		me->frame_y_offset = g_value_get_uint (value);
 		break;
+	case PROP_QOS:
+		me->qos = g_value_get_boolean (value);
+		break;
+	case PROP_WATCHDOG_FRAMES:
+		me->watchdog_frames = g_value_get_uint (value);
+		break;
+	case PROP_IDR_ONLY:
+		me->idr_only = g_value_get_boolean (value);
+		break;
+	case PROP_STATS_INTERVAL:
+		me->stats_interval = g_value_get_uint (value);
+		break;
 	default:
 		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
 		break;
@@ -341,6 +528,21 @@ gst_acm_h264_dec_get_property (GObject * object, guint prop_id,
 	case PROP_FRAME_Y_OFFSET:
 		g_value_set_uint (value, me->frame_y_offset);
 		break;
+	case PROP_QOS:
+		g_value_set_boolean (value, me->qos);
+		break;
+	case PROP_STATS:
+		g_value_take_boxed (value, gst_acm_h264_dec_get_stats (me));
+		break;
+	case PROP_WATCHDOG_FRAMES:
+		g_value_set_uint (value, me->watchdog_frames);
+		break;
+	case PROP_IDR_ONLY:
+		g_value_set_boolean (value, me->idr_only);
+		break;
+	case PROP_STATS_INTERVAL:
+		g_value_set_uint (value, me->stats_interval);
+		break;
 	default:
 		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
 		break;
@@ -394,6 +596,37 @@ gst_acm_h264_dec_class_init (GstAcmH264DecClass * klass)
 			"FALSE: disable, TRUE: enable",
 			DEFAULT_ENABLE_VIO6, G_PARAM_READWRITE));
 
+	g_object_class_install_property (gobject_class, PROP_QOS,
+		g_param_spec_boolean ("qos", "QoS",
+			"Drop late frames before decoding (non-reference pictures, "
+			"or up to the next IDR picture when far behind)",
+			DEFAULT_QOS, G_PARAM_READWRITE));
+
+	g_object_class_install_property (gobject_class, PROP_STATS,
+		g_param_spec_boxed ("stats", "Statistics",
+			"Output format, memory bandwidth, decoded fps, decode latency, "
+			"dropped frames by reason and queue occupancy",
+			GST_TYPE_STRUCTURE, G_PARAM_READABLE));
+
+	g_object_class_install_property (gobject_class, PROP_WATCHDOG_FRAMES,
+		g_param_spec_uint ("watchdog-frames", "Watchdog frames",
+			"Frame periods without progress before the device is reset and "
+			"decoding resumes at the next IDR picture (1 second if the frame "
+			"rate is unknown; 0: disable, error after 10 seconds)",
+			0, G_MAXUINT, DEFAULT_WATCHDOG_FRAMES, G_PARAM_READWRITE));
+
+	g_object_class_install_property (gobject_class, PROP_IDR_ONLY,
+		g_param_spec_boolean ("idr-only", "IDR only",
+			"Decode IDR pictures only, with minimal picture buffering "
+			"(for thumbnails; output size is negotiated through caps)",
+			DEFAULT_IDR_ONLY, G_PARAM_READWRITE));
+
+	g_object_class_install_property (gobject_class, PROP_STATS_INTERVAL,
+		g_param_spec_uint ("stats-interval", "Statistics interval",
+			"Interval in milliseconds to post the statistics as an element "
+			"message (0: disable)",
+			0, G_MAXUINT, DEFAULT_STATS_INTERVAL, G_PARAM_READWRITE));
+
 	gst_element_class_add_pad_template (element_class,
 			gst_static_pad_template_get (&src_template_factory));
 	gst_element_class_add_pad_template (element_class,
@@ -451,11 +684,20 @@ gst_acm_h264_dec_init (GstAcmH264Dec * me)
 	me->frame_x_offset = DEFAULT_FRAME_X_OFFSET;
 	me->frame_y_offset = DEFAULT_FRAME_Y_OFFSET;
 
-#if SUPPORT_CODED_FIELD
+	me->qos = DEFAULT_QOS;
+	me->watchdog_frames = DEFAULT_WATCHDOG_FRAMES;
+	me->idr_only = DEFAULT_IDR_ONLY;
+	me->stats_interval = DEFAULT_STATS_INTERVAL;
+
 	me->priv->nalparser = NULL;
-	me->priv->is_interlaced = FALSE;
 	me->priv->nal_length_size = 4;
+#if SUPPORT_CODED_FIELD
+	me->priv->is_interlaced = FALSE;
 	me->priv->is_field_structure = FALSE;
+	me->priv->waiting_second_field = FALSE;
+	me->priv->first_field_is_top = FALSE;
+	me->priv->first_field_frame_num = 0;
+	me->priv->first_field_number = 0;
 #endif
 
 	/* If the input is packetized, then the parse method will not be called. */
@@ -565,17 +807,46 @@ gst_acm_h264_dec_start (GstVideoDecoder * dec)
 	}
 
 	me->priv->displaying_buf = NULL;
+	me->priv->reverse_pool = NULL;
+	me->priv->reverse_pool_size = 0;
+	me->priv->reverse_pool_max = 0;
+	me->priv->reverse_gop_frames = 0;
+	me->priv->reverse_gop_depth = DEFAULT_REVERSE_GOP_DEPTH;
 
-#if SUPPORT_CODED_FIELD
 	me->priv->nalparser = gst_h264_nal_parser_new ();
 	if (NULL == me->priv->nalparser) {
 		GST_ERROR_OBJECT (me, "Out of memory");
 		
 		return FALSE;
 	}
-	me->priv->is_interlaced = FALSE;
 	me->priv->nal_length_size = 4;
+	me->priv->need_spspps = FALSE;
+	me->priv->stride_follows_width = FALSE;
+	me->priv->latency = GST_CLOCK_TIME_NONE;
+	me->priv->resync_waiting_idr = FALSE;
+	me->priv->is_checked_frame_number = FALSE;
+	me->priv->has_frame_number = FALSE;
+	GST_OBJECT_LOCK (me);
+	me->priv->decode_time = GST_CLOCK_TIME_NONE;
+	memset (&(me->priv->counters), 0, sizeof (GstAcmH264DecCounters));
+	me->priv->counters.decode_time_peak = GST_CLOCK_TIME_NONE;
+	me->priv->counters.fps_start_time = GST_CLOCK_TIME_NONE;
+	me->priv->counters.message_time = GST_CLOCK_TIME_NONE;
+	GST_OBJECT_UNLOCK (me);
+	for (i = 0; i < NUM_QBUF_TIME; i++) {
+		me->priv->qbuf_time[i] = GST_CLOCK_TIME_NONE;
+	}
+#if DO_QOS_FRAME_DROP
+	me->priv->qos_waiting_idr = FALSE;
+	me->priv->qos_dropped_first_field = FALSE;
+#endif
+#if SUPPORT_CODED_FIELD
+	me->priv->is_interlaced = FALSE;
 	me->priv->is_field_structure = FALSE;
+	me->priv->waiting_second_field = FALSE;
+	me->priv->first_field_is_top = FALSE;
+	me->priv->first_field_frame_num = 0;
+	me->priv->first_field_number = 0;
 #endif
 
 	return TRUE;
@@ -602,15 +873,19 @@ gst_acm_h264_dec_stop (GstVideoDecoder * dec)
 		me->priv->displaying_buf = NULL;
 	}
 
+	if (me->priv->reverse_pool) {
+		gst_buffer_pool_set_active (me->priv->reverse_pool, FALSE);
+		gst_object_unref (me->priv->reverse_pool);
+		me->priv->reverse_pool = NULL;
+	}
+
 	/* クリーンアップ処理	*/
 	gst_acm_h264_dec_cleanup_decoder (me);
 
-#if SUPPORT_CODED_FIELD
 	if (me->priv->nalparser) {
 		gst_h264_nal_parser_free (me->priv->nalparser);
 		me->priv->nalparser = NULL;
 	}
-#endif
 
 	return TRUE;
 }
@@ -640,10 +915,8 @@ gst_acm_h264_dec_analyze_codecdata(GstAcmH264Dec *me, GstBuffer * codec_data)
 		goto avcc_too_small;
     }
 
-#if SUPPORT_CODED_FIELD
 	me->priv->nal_length_size = (map.data[4] & 0x03) + 1;
     GST_INFO_OBJECT (me, "nal length size %u", me->priv->nal_length_size);
-#endif
 
 	/* get sps_num */
 	sps_num = *(unsigned char *)(map.data + counter) & 0x1f;
@@ -760,6 +1033,305 @@ avcc_too_small:
 	}
 }
 
+/* 出力フォーマットの文字列から、デバイスの出力フォーマットを設定する	*/
+static gboolean
+gst_acm_h264_dec_set_out_video_format (GstAcmH264Dec * me, const gchar *s)
+{
+	if (g_str_equal (s, "NV12")) {
+		me->out_video_fmt = GST_VIDEO_FORMAT_NV12;
+		me->output_format = GST_ACMH264DEC_OUT_FMT_YUV420;
+	}
+	else if (g_str_equal (s, "RGBx")) {
+		me->out_video_fmt = GST_VIDEO_FORMAT_RGBx;
+		me->output_format = GST_ACMH264DEC_OUT_FMT_RGB32;
+	}
+	else if (g_str_equal (s, "RGB")) {
+		me->out_video_fmt = GST_VIDEO_FORMAT_RGB;
+		me->output_format = GST_ACMH264DEC_OUT_FMT_RGB24;
+	}
+	else if (g_str_equal (s, "RGB16")) {
+		me->out_video_fmt = GST_VIDEO_FORMAT_RGB16;
+		me->output_format = GST_ACMH264DEC_OUT_FMT_RGB565;
+	}
+	else {
+		return FALSE;
+	}
+
+	g_free (me->out_video_fmt_str);
+	me->out_video_fmt_str = g_strdup (s);
+
+	return TRUE;
+}
+
+/* down stream の caps から、出力画像サイズとフォーマットを決める。
+ * サイズは、down stream が受け付ける範囲で、入力画像サイズに最も近い値に
+ * fixate する (入力画像サイズと異なる場合は、VIO6 でスケーリングする)。
+ * フォーマットは、メモリ帯域の少ない順 (out_format_rank) に選ぶ
+ */
+static void
+gst_acm_h264_dec_fixate_out_caps (GstAcmH264Dec * me)
+{
+	GstCaps *peercaps;
+	GstStructure *capsStructure;
+	const gchar *s;
+	gint i;
+	guint n;
+
+	me->out_width = me->width;
+	me->out_height = me->height;
+
+	peercaps = gst_pad_get_allowed_caps (GST_VIDEO_DECODER_SRC_PAD (me));
+	GST_INFO_OBJECT (me, "H264DEC SET FORMAT - allowed caps: %" GST_PTR_FORMAT, peercaps);
+	if (NULL == peercaps) {
+		return;
+	}
+	if (gst_caps_is_empty (peercaps)) {
+		gst_caps_unref (peercaps);
+		return;
+	}
+
+	/* down stream が受け付けるフォーマットのうち、1画素あたりのビット数が
+	 * 最も少ないものに絞り込む
+	 */
+	for (n = 0; n < G_N_ELEMENTS (out_format_rank); n++) {
+		GstCaps *fmtcaps;
+		GstCaps *intersection;
+
+		fmtcaps = gst_caps_new_simple ("video/x-raw",
+						"format", G_TYPE_STRING, out_format_rank[n].format, NULL);
+		intersection = gst_caps_intersect_full (peercaps, fmtcaps,
+						GST_CAPS_INTERSECT_FIRST);
+		gst_caps_unref (fmtcaps);
+		if (! gst_caps_is_empty (intersection)) {
+			gst_caps_unref (peercaps);
+			peercaps = intersection;
+			break;
+		}
+		gst_caps_unref (intersection);
+	}
+
+	/* 先頭の structure が、down stream の最優先	*/
+	peercaps = gst_caps_truncate (peercaps);
+	capsStructure = gst_caps_get_structure (peercaps, 0);
+	gst_structure_fixate_field_nearest_int (capsStructure, "width", me->width);
+	gst_structure_fixate_field_nearest_int (capsStructure, "height", me->height);
+	if (gst_structure_has_field (capsStructure, "format")) {
+		gst_structure_fixate_field_string (capsStructure, "format",
+										   me->out_video_fmt_str);
+	}
+
+	if (gst_structure_get_int (capsStructure, "width", &i)) {
+		GST_INFO_OBJECT (me, "H264DEC SET FORMAT - output width: %d", i);
+		me->out_width = i;
+	}
+	if (gst_structure_get_int (capsStructure, "height", &i)) {
+		GST_INFO_OBJECT (me, "H264DEC SET FORMAT - output height: %d", i);
+		me->out_height = i;
+	}
+	if ((s = gst_structure_get_string (capsStructure, "format"))) {
+		GST_INFO_OBJECT (me, "H264DEC SET FORMAT - output format: %s", s);
+		if (! gst_acm_h264_dec_set_out_video_format (me, s)) {
+			GST_WARNING_OBJECT (me, "unsupported output format: %s", s);
+		}
+	}
+
+	/* VIO6 が無効の場合、デバイスは縮小できずに、デコードしたサイズで出力するので、
+	 * caps もデコードしたサイズにする (down stream が受け付けなければ、
+	 * ネゴシエーションに失敗する)
+	 */
+	if (! me->enable_vio6
+		&& (me->out_width != me->width || me->out_height != me->height)) {
+		GST_WARNING_OBJECT (me, "scaling to %d x %d needs VIO6 enabled, "
+							"output %d x %d", me->out_width, me->out_height,
+							me->width, me->height);
+		me->out_width = me->width;
+		me->out_height = me->height;
+	}
+
+	gst_caps_unref (peercaps);
+}
+
+/* デバイスに設定する中間バッファのピクチャ数
+ * (IDR ピクチャのみのデコードでは、参照ピクチャが不要なので最小にする)
+ */
+static guint32
+gst_acm_h264_dec_get_buffering_pic_cnt (GstAcmH264Dec * me)
+{
+	if (me->idr_only) {
+		return GST_ACMH264DEC_BUF_PIC_CNT_MIN;
+	}
+
+	return me->buffering_pic_cnt;
+}
+
+/* down stream にレイテンシを通知する。
+ * 最小値は、デコード時間の計測値 (計測前は、デバイス内でバッファリング
+ * されるピクチャ数と、入力バッファ数から見積もる)、最大値は、さらに
+ * 出力バッファ数分のフレームを保持できる時間とする。
+ * force でなければ、通知済みの値から 1 フレーム以上変わった場合のみ通知する
+ */
+static void
+gst_acm_h264_dec_update_latency (GstAcmH264Dec * me, gboolean force)
+{
+	GstClockTime frame_duration;
+	GstClockTime min_latency;
+	GstClockTime max_latency;
+	guint num_out;
+
+	if (NULL == me->input_state || me->input_state->info.fps_n <= 0) {
+		return;
+	}
+	frame_duration = gst_util_uint64_scale (GST_SECOND,
+		me->input_state->info.fps_d, me->input_state->info.fps_n);
+
+	if (GST_CLOCK_TIME_IS_VALID (me->priv->decode_time)) {
+		min_latency = me->priv->decode_time;
+	}
+	else {
+		min_latency = frame_duration
+			* (gst_acm_h264_dec_get_buffering_pic_cnt (me)
+			   + DEFAULT_NUM_BUFFERS_IN);
+	}
+	num_out = me->priv->using_fb_dmabuf
+		? me->priv->num_fb_dmabuf : DEFAULT_NUM_BUFFERS_OUT;
+	max_latency = min_latency + frame_duration * num_out;
+
+	if (! force && GST_CLOCK_TIME_IS_VALID (me->priv->latency)
+		&& ABS (GST_CLOCK_DIFF (me->priv->latency, min_latency))
+			< (GstClockTimeDiff) frame_duration) {
+		return;
+	}
+
+	GST_INFO_OBJECT (me, "latency min:%" GST_TIME_FORMAT
+					 ", max:%" GST_TIME_FORMAT,
+					 GST_TIME_ARGS (min_latency), GST_TIME_ARGS (max_latency));
+	me->priv->latency = min_latency;
+	gst_video_decoder_set_latency (GST_VIDEO_DECODER (me),
+								   min_latency, max_latency);
+}
+
+/* 出力フォーマットと、出力画像による DDR への書き込み帯域、
+ * デコードの統計情報 (フレームレート、デコード時間、ドロップ数、キューの状態)
+ */
+static GstStructure *
+gst_acm_h264_dec_get_stats (GstAcmH264Dec * me)
+{
+	GstAcmH264DecCounters counters;
+	GstClockTime decodeTime;
+	gint inOutFrameCount;
+	guint64 bytes_per_frame;
+	guint64 bandwidth = 0;
+
+	/* アプリケーションのスレッドから呼ばれるので、ストリーミングスレッドが
+	 * 保存したスナップショットを、ロックしてコピーするだけにする
+	 * (ストリームロックを取ると、select() の待ちの間ブロックしてしまう)
+	 */
+	GST_OBJECT_LOCK (me);
+	counters = me->priv->counters;
+	decodeTime = me->priv->decode_time;
+	inOutFrameCount = me->priv->in_out_frame_count;
+	GST_OBJECT_UNLOCK (me);
+
+	bytes_per_frame = (guint64) counters.out_width * counters.out_height
+		* counters.bits_per_pixel / 8;
+	if (counters.fps_d > 0) {
+		bandwidth = gst_util_uint64_scale (bytes_per_frame,
+						counters.fps_n, counters.fps_d);
+	}
+
+	return gst_structure_new ("GstAcmH264DecStats",
+			"output-format", G_TYPE_STRING, counters.out_format,
+			"bits-per-pixel", G_TYPE_UINT, counters.bits_per_pixel,
+			"bytes-per-frame", G_TYPE_UINT64, bytes_per_frame,
+			"bandwidth", G_TYPE_UINT64, bandwidth,
+			"decoded-frames", G_TYPE_UINT64, counters.num_decoded,
+			"fps", G_TYPE_DOUBLE, counters.fps,
+			"decode-latency", G_TYPE_UINT64, decodeTime,
+			"decode-latency-peak", G_TYPE_UINT64, counters.decode_time_peak,
+			"dropped-mmco", G_TYPE_UINT64, counters.num_drop_mmco,
+			"dropped-qos", G_TYPE_UINT64, counters.num_drop_qos,
+			"dropped-stale", G_TYPE_UINT64, counters.num_drop_stale,
+			"dropped-resync", G_TYPE_UINT64, counters.num_drop_resync,
+			"unpaired-fields", G_TYPE_UINT64, counters.num_unpaired_field,
+			"frames-in-device", G_TYPE_INT, inOutFrameCount,
+			"output-queued", G_TYPE_UINT, counters.output_queued,
+			"pending-frames", G_TYPE_UINT, counters.num_pending,
+			NULL);
+}
+
+/* フレームの出力ごとに、フレームレートを更新し、stats-interval ごとに
+ * 統計情報を element message で通知する
+ */
+static void
+gst_acm_h264_dec_count_output (GstAcmH264Dec * me)
+{
+	GstAcmH264DecCounters *counters = &(me->priv->counters);
+	GstClockTime now = gst_util_get_timestamp ();
+	gboolean doPost = FALSE;
+	guint bitsPerPixel = 0;
+	GList *frames;
+	guint numPending;
+	guint n;
+
+	/* stats プロパティ用に、出力の状態を保存する	*/
+	for (n = 0; n < G_N_ELEMENTS (out_format_rank); n++) {
+		if (me->out_video_fmt_str
+			&& g_str_equal (me->out_video_fmt_str, out_format_rank[n].format)) {
+			bitsPerPixel = out_format_rank[n].bits_per_pixel;
+			break;
+		}
+	}
+	frames = gst_video_decoder_get_frames (GST_VIDEO_DECODER (me));
+	numPending = g_list_length (frames);
+	g_list_free_full (frames, (GDestroyNotify) gst_video_codec_frame_unref);
+
+	GST_OBJECT_LOCK (me);
+	counters->num_decoded++;
+
+	g_strlcpy (counters->out_format,
+		(me->out_video_fmt_str ? me->out_video_fmt_str : ""),
+		sizeof (counters->out_format));
+	counters->bits_per_pixel = bitsPerPixel;
+	counters->out_width = me->out_width;
+	counters->out_height = me->out_height;
+	if (me->output_state) {
+		counters->fps_n = me->output_state->info.fps_n;
+		counters->fps_d = me->output_state->info.fps_d;
+	}
+	counters->output_queued = (me->pool_out ? me->pool_out->num_queued : 0);
+	counters->num_pending = numPending;
+
+	if (! GST_CLOCK_TIME_IS_VALID (counters->fps_start_time)) {
+		counters->fps_start_time = now;
+		counters->fps_start_decoded = counters->num_decoded;
+	}
+	else if (now - counters->fps_start_time >= GST_SECOND) {
+		counters->fps = (gdouble) (counters->num_decoded
+				- counters->fps_start_decoded) * GST_SECOND
+			/ (now - counters->fps_start_time);
+		counters->fps_start_time = now;
+		counters->fps_start_decoded = counters->num_decoded;
+	}
+
+	if (me->stats_interval > 0) {
+		if (! GST_CLOCK_TIME_IS_VALID (counters->message_time)) {
+			counters->message_time = now;
+		}
+		else if (now - counters->message_time
+				 >= me->stats_interval * GST_MSECOND) {
+			counters->message_time = now;
+			doPost = TRUE;
+		}
+	}
+	GST_OBJECT_UNLOCK (me);
+
+	if (doPost) {
+		gst_element_post_message (GST_ELEMENT (me),
+			gst_message_new_element (GST_OBJECT (me),
+				gst_acm_h264_dec_get_stats (me)));
+	}
+}
+
 static gboolean
 gst_acm_h264_dec_set_format (GstVideoDecoder * dec, GstVideoCodecState * state)
 {
@@ -768,9 +1340,9 @@ gst_acm_h264_dec_set_format (GstVideoDecoder * dec, GstVideoCodecState * state)
 	GstVideoInfo *vinfo;
 	GstStructure *structure = NULL;
 	const gchar *alignment = NULL;
+	const gchar *streamFormat = NULL;
 	gint screen_width = 0;
 	gint screen_height = 0;
-	GstCaps *peercaps;
 
 	vinfo = &(state->info);
 
@@ -785,71 +1357,48 @@ gst_acm_h264_dec_set_format (GstVideoDecoder * dec, GstVideoCodecState * state)
 	}
 	me->input_state = gst_video_codec_state_ref (state);
 
+	/* デコーダ初期化済みであれば、ストリーム途中のフォーマット変更。
+	 * デバイスのセッションは維持し、必要な場合のみ CAPTURE 側を作り直す
+	 */
+	if (NULL != me->pool_out) {
+		if (vinfo->fps_d > 0) {
+			me->frame_rate = vinfo->fps_n / vinfo->fps_d;
+		}
+		if (state->codec_data) {
+			gst_acm_h264_dec_analyze_codecdata(me, state->codec_data);
+			/* 新しい SPS/PPS を、次に入力するフレームの前に挿入する	*/
+			me->priv->need_spspps = TRUE;
+		}
+		if (vinfo->width != me->width || vinfo->height != me->height) {
+			if (! gst_acm_h264_dec_change_resolution (me,
+						vinfo->width, vinfo->height, NULL)) {
+				ret = FALSE;
+			}
+		}
+		/* frame rate が変わった場合のため	*/
+		gst_acm_h264_dec_update_latency (me, TRUE);
+		goto out;
+	}
+
 	/* video info */
 	structure = gst_caps_get_structure (state->caps, 0);
 	alignment = gst_structure_get_string (structure, "alignment");
-	GST_INFO_OBJECT (me, "H264DEC SET FORMAT - alignment: %s",
+	streamFormat = gst_structure_get_string (structure, "stream-format");
+	GST_INFO_OBJECT (me, "H264DEC SET FORMAT - stream-format: %s, alignment: %s",
+					 (NULL == streamFormat ? "null" : streamFormat),
 					 (NULL == alignment ? "null" : alignment));
-	if (NULL != alignment) {
-		if (g_str_equal(alignment, "au")) {
-			me->input_format = GST_ACMH264DEC_IN_FMT_MP4;
-		}
-		else if (g_str_equal(alignment, "nal")) {
-			me->input_format = GST_ACMH264DEC_IN_FMT_ES;
-		}
+	/* スタートコードで区切られているかどうかは、stream-format で決まる	*/
+	if (NULL != streamFormat && g_str_equal(streamFormat, "byte-stream")) {
+		me->input_format = GST_ACMH264DEC_IN_FMT_ES;
 	}
 	else {
 		me->input_format = GST_ACMH264DEC_IN_FMT_MP4;
 	}
 
-	peercaps = gst_pad_get_allowed_caps (GST_VIDEO_DECODER_SRC_PAD (me));
-	GST_INFO_OBJECT (me, "H264DEC SET FORMAT - allowed caps: %" GST_PTR_FORMAT, peercaps);
-	if (peercaps && gst_caps_get_size (peercaps) > 0) {
-		GstStructure *capsStructure = gst_caps_get_structure (peercaps, 0);
-		const gchar *s;
-		gint i;
-
-		if (gst_structure_get_int (capsStructure, "width", &i)) {
-			GST_INFO_OBJECT (me, "H264DEC SET FORMAT - output width: %d", i);
-			me->out_width = i;
-		}
-
-		if (gst_structure_get_int (capsStructure, "height", &i)) {
-			GST_INFO_OBJECT (me, "H264DEC SET FORMAT - output height: %d", i);
-			me->out_height = i;
-		}
-
-		if ((s = gst_structure_get_string (capsStructure, "format"))) {
-			GST_INFO_OBJECT (me, "H264DEC SET FORMAT - output format: %s", s);
-			me->out_video_fmt_str = g_strdup (s);
-
-			if (g_str_equal (s, "NV12")) {
-				me->out_video_fmt = GST_VIDEO_FORMAT_NV12;
-				me->output_format = GST_ACMH264DEC_OUT_FMT_YUV420;
-			}
-			else if (g_str_equal (s, "RGBx")) {
-				me->out_video_fmt = GST_VIDEO_FORMAT_RGBx;
-				me->output_format = GST_ACMH264DEC_OUT_FMT_RGB32;
-			}
-			else if (g_str_equal (s, "RGB")) {
-				me->out_video_fmt = GST_VIDEO_FORMAT_RGB;
-				me->output_format = GST_ACMH264DEC_OUT_FMT_RGB24;
-			}
-			else if (g_str_equal (s, "RGB16")) {
-				me->out_video_fmt = GST_VIDEO_FORMAT_RGB16;
-				me->output_format = GST_ACMH264DEC_OUT_FMT_RGB565;
-			}
-		}
-	}
-
 	me->width = vinfo->width;
 	me->height = vinfo->height;
-	if (DEFAULT_OUT_WIDTH == me->out_width) {
-		me->out_width = me->width;
-	}
-	if (DEFAULT_OUT_HEIGHT == me->out_height) {
-		me->out_height = me->height;
-	}
+	/* 出力画像サイズ、フォーマットを down stream と決める	*/
+	gst_acm_h264_dec_fixate_out_caps (me);
 	me->frame_rate = vinfo->fps_n / vinfo->fps_d;
 
 	/* analyze codecdata */
@@ -897,6 +1446,7 @@ gst_acm_h264_dec_set_format (GstVideoDecoder * dec, GstVideoCodecState * state)
 	GST_INFO_OBJECT (me, "screen info %d x %d", screen_width, screen_height);
 
 	/* ストライド、オフセットの境界チェック	*/
+	me->priv->stride_follows_width = (DEFAULT_FRAME_STRIDE == me->frame_stride);
 	if (DEFAULT_FRAME_STRIDE == me->frame_stride) {
 		me->frame_stride = me->out_width;
 	}
@@ -921,29 +1471,35 @@ gst_acm_h264_dec_set_format (GstVideoDecoder * dec, GstVideoCodecState * state)
 	 * and Negotiate with downstream elements.
 	 */
 	g_assert (me->output_state == NULL);
-	me->output_state = gst_video_decoder_set_output_state (GST_VIDEO_DECODER (me),
-		me->out_video_fmt, me->out_width, me->out_height, me->input_state);
-	if (G_UNLIKELY (me->output_state->caps == NULL))
-		me->output_state->caps = gst_video_info_to_caps (&(me->output_state->info));
-#if 1
-	structure = gst_caps_get_structure (me->output_state->caps, 0);
-	gst_structure_set (structure,
-					   "stride", G_TYPE_INT, me->frame_stride,
-					   "x-offset", G_TYPE_INT, me->frame_x_offset,
-					   "y-offset", G_TYPE_INT, me->frame_y_offset,
-					   NULL);
+#if SUPPORT_CODED_FIELD
+	if (me->priv->is_interlaced) {
+		/* フィールド構造かどうかで、出力のフレームレートが変わるので、
+		 * 最初のフレームを解析してからネゴシエーションする
+		 */
+		GST_INFO_OBJECT (me, "interlaced - negotiate at the first frame");
+	}
+	else if (GST_ACMH264DEC_IN_FMT_ES == me->input_format
+			 && NULL == state->codec_data) {
+		/* byte-stream は、最初のフレームの SPS でインターレースかどうかを
+		 * 判断してからネゴシエーションする
+		 */
+		GST_INFO_OBJECT (me, "byte-stream - negotiate at the first frame");
+	}
+	else
 #endif
-	GST_INFO_OBJECT (me,
-		"H264DEC OUT FORMAT - info: fmt:%" GST_FOURCC_FORMAT ", %d x %d, %d/%d",
-		GST_FOURCC_ARGS (me->input_format),
-		me->output_state->info.width, me->output_state->info.height,
-		me->output_state->info.fps_n, me->output_state->info.fps_d);
-	GST_INFO_OBJECT (me, "H264DEC OUT FORMAT - caps: %" GST_PTR_FORMAT,
-					 me->output_state->caps);
-	GST_INFO_OBJECT (me, "H264DEC OUT FORMAT - codec_data: %p",
-					 me->output_state->codec_data);
-	if (! gst_video_decoder_negotiate (GST_VIDEO_DECODER (me))) {
-		goto negotiate_failed;
+	{
+		if (! gst_acm_h264_dec_set_output_state (me)) {
+			goto negotiate_failed;
+		}
+		GST_INFO_OBJECT (me,
+			"H264DEC OUT FORMAT - info: fmt:%" GST_FOURCC_FORMAT ", %d x %d, %d/%d",
+			GST_FOURCC_ARGS (me->input_format),
+			me->output_state->info.width, me->output_state->info.height,
+			me->output_state->info.fps_n, me->output_state->info.fps_d);
+		GST_INFO_OBJECT (me, "H264DEC OUT FORMAT - caps: %" GST_PTR_FORMAT,
+						 me->output_state->caps);
+		GST_INFO_OBJECT (me, "H264DEC OUT FORMAT - codec_data: %p",
+						 me->output_state->codec_data);
 	}
 
 	{
@@ -1001,6 +1557,8 @@ gst_acm_h264_dec_set_format (GstVideoDecoder * dec, GstVideoCodecState * state)
 		goto init_failed;
 	}
 
+	gst_acm_h264_dec_update_latency (me, TRUE);
+
 out:
 	return ret;
 
@@ -1021,89 +1579,609 @@ init_failed:
 	}
 }
 
-/*
- * Optional. Allows subclass (decoder) to perform post-seek semantics reset.
+/* 両方のキューを STREAMOFF して、デバイスに入力済みのデータを破棄する。
+ * CAPTURE 側のバッファは回収して、再度 enqueue し、ストリームを再開する
  */
 static gboolean
-gst_acm_h264_dec_reset (GstVideoDecoder * dec, gboolean hard)
+gst_acm_h264_dec_flush_device (GstAcmH264Dec * me)
 {
-	GstAcmH264Dec *me = GST_ACMH264DEC (dec);
+	enum v4l2_buf_type type;
+	int r;
+	gint i;
 
-	GST_INFO_OBJECT (me, "H264DEC RESET %s", hard ? "hard" : "soft");
+	GST_INFO_OBJECT (me, "H264DEC FLUSH DEVICE");
 
-	return TRUE;
-}
+	type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+	r = gst_acm_v4l2_ioctl (me->video_fd, VIDIOC_STREAMOFF, &type);
+	if (r < 0) {
+		goto stop_failed;
+	}
+	type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	r = gst_acm_v4l2_ioctl (me->video_fd, VIDIOC_STREAMOFF, &type);
+	if (r < 0) {
+		goto stop_failed;
+	}
 
-/*
- * Optional. Called to request subclass to dispatch any pending remaining data 
- * (e.g. at EOS).
- */
-static GstFlowReturn
-gst_acm_h264_dec_finish (GstVideoDecoder * dec)
-{
-	GstAcmH264Dec *me = GST_ACMH264DEC (dec);
+	/* OUTPUT 側のバッファは全て空いたので、先頭から使い直す	*/
+	for (i = 0; i < DEFAULT_NUM_BUFFERS_IN; i++) {
+		memset(&(me->priv->input_vbuffer[i]), 0, sizeof(struct v4l2_buffer));
+		me->priv->input_vbuffer[i].index = i;
+		me->priv->input_vbuffer[i].type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+		me->priv->input_vbuffer[i].memory = V4L2_MEMORY_USERPTR;
+	}
+	me->num_inbuf_acquired = 0;
+	me->priv->in_out_frame_count = 0;
+#if SUPPORT_CODED_FIELD
+	me->priv->waiting_second_field = FALSE;
+#endif
+#if DO_QOS_FRAME_DROP
+	me->priv->qos_dropped_first_field = FALSE;
+#endif
 
-	GST_INFO_OBJECT (me, "H264DEC FINISH");
+	/* CAPTURE 側のバッファを回収して、再度 QBUF	*/
+	if (GST_FLOW_OK != gst_acm_v4l2_buffer_pool_requeue_all (me->pool_out)) {
+		GST_ELEMENT_ERROR (me, STREAM, DECODE, (NULL),
+			("could not queue buffer. %d (%s)", errno, g_strerror (errno)));
+		return FALSE;
+	}
 
-	/* do nothing	*/
+	type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	r = gst_acm_v4l2_ioctl (me->video_fd, VIDIOC_STREAMON, &type);
+	if (r < 0) {
+		goto start_failed;
+	}
+	type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+	r = gst_acm_v4l2_ioctl (me->video_fd, VIDIOC_STREAMON, &type);
+	if (r < 0) {
+		goto start_failed;
+	}
 
-	return GST_FLOW_OK;
-}
+	/* 次に入力するフレームの前に、SPS/PPS を挿入し直す	*/
+	if (me->spspps_size > 0) {
+		me->priv->need_spspps = TRUE;
+	}
 
-static GstFlowReturn
-gst_acm_h264_dec_parse (GstVideoDecoder *dec, GstVideoCodecFrame *frame,
-					   GstAdapter *adapter, gboolean at_eos)
-{
-	GstAcmH264Dec *me = GST_ACMH264DEC (dec);
-	
-	GST_INFO_OBJECT (me, "H264DEC PARSE at_eos:%d", at_eos);
-	
-	return GST_FLOW_OK;
-}
+	return TRUE;
+
+	/* ERRORS */
+stop_failed:
+	{
+		GST_ELEMENT_ERROR (me, STREAM, DECODE, (NULL),
+			("error with STREAMOFF %d (%s)", errno, g_strerror (errno)));
+		return FALSE;
+	}
+start_failed:
+	{
+		GST_ELEMENT_ERROR (me, STREAM, DECODE, (NULL),
+			("error with STREAMON %d (%s)", errno, g_strerror (errno)));
+		return FALSE;
+	}
+}
+
+/*
+ * Optional. Allows subclass (decoder) to perform post-seek semantics reset.
+ */
+static gboolean
+gst_acm_h264_dec_reset (GstVideoDecoder * dec, gboolean hard)
+{
+	GstAcmH264Dec *me = GST_ACMH264DEC (dec);
+
+	GST_INFO_OBJECT (me, "H264DEC RESET %s", hard ? "hard" : "soft");
+
+	me->priv->resync_waiting_idr = FALSE;
+#if DO_QOS_FRAME_DROP
+	/* フラッシュ後は、QoS の IDR 待ちも解除する	*/
+	me->priv->qos_waiting_idr = FALSE;
+	me->priv->qos_dropped_first_field = FALSE;
+#endif
+
+	/* Seek の際は、古い GOP の残りをデコードせずに、デバイスをフラッシュする	*/
+	if (hard && NULL != me->pool_out) {
+		return gst_acm_h264_dec_flush_device (me);
+	}
+
+	return TRUE;
+}
+
+/*
+ * Optional. Called to request subclass to dispatch any pending remaining data 
+ * (e.g. at EOS).
+ */
+static GstFlowReturn
+gst_acm_h264_dec_finish (GstVideoDecoder * dec)
+{
+	GstAcmH264Dec *me = GST_ACMH264DEC (dec);
+
+	GST_INFO_OBJECT (me, "H264DEC FINISH");
+
+	/* do nothing	*/
+
+	return GST_FLOW_OK;
+}
+
+static GstFlowReturn
+gst_acm_h264_dec_parse (GstVideoDecoder *dec, GstVideoCodecFrame *frame,
+					   GstAdapter *adapter, gboolean at_eos)
+{
+	GstAcmH264Dec *me = GST_ACMH264DEC (dec);
+	
+	GST_INFO_OBJECT (me, "H264DEC PARSE at_eos:%d", at_eos);
+	
+	return GST_FLOW_OK;
+}
+
+/* フレーム内の NAL ユニットの位置	*/
+typedef struct _GstAcmH264NalPos {
+	/* スタートコード (ES)、またはサイズ情報 (avc) の位置	*/
+	gsize sc_offset;
+	/* NAL ユニット (ヘッダを含む) の位置とサイズ	*/
+	gsize offset;
+	gsize size;
+	guint8 type;
+	guint8 ref_idc;
+} GstAcmH264NalPos;
+
+/* スライスヘッダ読み出し用のビットリーダ
+ * (emulation prevention byte を除去しながら読む)
+ */
+typedef struct _GstAcmH264BitReader {
+	const guint8 *data;
+	gsize size;
+	gsize byte;
+	guint bit;
+	/* 直前に連続する 0x00 の数	*/
+	guint zeros;
+} GstAcmH264BitReader;
+
+#define IS_START_CODE(p)	(0x00 == (p)[0] && 0x00 == (p)[1] && 0x01 == (p)[2])
+
+/* スタートコード (0x000001) の位置を返す。見つからない場合は size を返す。
+ * 0x00 を含まない 16 バイトのブロックは、SIMD でまとめて読み飛ばす
+ */
+static gsize
+gst_acm_h264_dec_find_start_code(const guint8 *data, gsize size)
+{
+	gsize i = 0;
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+	const uint8x16_t zero = vdupq_n_u8 (0);
+
+	/* ブロック内の全ての位置で、3バイト読めるようにする	*/
+	while (i + 16 + 2 <= size) {
+		uint64x2_t eq = vreinterpretq_u64_u8 (
+							vceqq_u8 (vld1q_u8 (data + i), zero));
+
+		if (0 != (vgetq_lane_u64 (eq, 0) | vgetq_lane_u64 (eq, 1))) {
+			gsize j;
+
+			for (j = i; j < i + 16; j++) {
+				if (IS_START_CODE (data + j)) {
+					return j;
+				}
+			}
+		}
+		i += 16;
+	}
+#elif defined(__SSE2__)
+	const __m128i zero = _mm_setzero_si128 ();
+
+	while (i + 16 + 2 <= size) {
+		guint mask = _mm_movemask_epi8 (_mm_cmpeq_epi8 (
+			_mm_loadu_si128 ((const __m128i *) (data + i)), zero));
+
+		while (0 != mask) {
+			gsize j = i + __builtin_ctz (mask);
+
+			if (IS_START_CODE (data + j)) {
+				return j;
+			}
+			mask &= mask - 1;
+		}
+		i += 16;
+	}
+#endif
+
+	/* 残りは、3バイト目が 0x01 より大きければ、3バイト進める	*/
+	while (i + 2 < size) {
+		if (data[i + 2] > 0x01) {
+			i += 3;
+		}
+		else if (0x00 != data[i + 1]) {
+			i += 2;
+		}
+		else if (0x00 != data[i] || 0x01 != data[i + 2]) {
+			i++;
+		}
+		else {
+			return i;
+		}
+	}
+
+	return size;
+}
+
+/* 次の NAL ユニットを取り出す。
+ * ES の場合はスタートコード、avc の場合はサイズ情報で区切る。
+ * *offset は、次の NAL ユニットの探索位置に進める
+ */
+static gboolean
+gst_acm_h264_dec_next_nal(GstAcmH264Dec *me, const guint8 *data, gsize size,
+	gsize *offset, GstAcmH264NalPos *pos)
+{
+	if (GST_ACMH264DEC_IN_FMT_ES == me->input_format) {
+		gsize end;
+
+		if (*offset + 3 > size) {
+			return FALSE;
+		}
+		pos->sc_offset = *offset
+			+ gst_acm_h264_dec_find_start_code (data + *offset, size - *offset);
+		if (pos->sc_offset + 3 >= size) {
+			return FALSE;
+		}
+		pos->offset = pos->sc_offset + 3;
+		end = pos->offset
+			+ gst_acm_h264_dec_find_start_code (data + pos->offset,
+												size - pos->offset);
+		if (end < size) {
+			/* 次の 4バイトのスタートコードの先頭の 0x00 は含めない	*/
+			while (end > pos->offset && 0x00 == data[end - 1]) {
+				end--;
+			}
+		}
+		pos->size = end - pos->offset;
+	}
+	else {
+		const guint nl = me->priv->nal_length_size;
+		guint32 len = 0;
+		guint i;
+
+		if (*offset + nl >= size) {
+			return FALSE;
+		}
+		for (i = 0; i < nl; i++) {
+			len = (len << 8) | data[*offset + i];
+		}
+		pos->sc_offset = *offset;
+		pos->offset = *offset + nl;
+		pos->size = MIN (len, size - pos->offset);
+	}
+	*offset = pos->offset + pos->size;
+
+	if (0 == pos->size) {
+		pos->type = 0;
+		pos->ref_idc = 0;
+	}
+	else {
+		pos->type = data[pos->offset] & 0x1f;
+		pos->ref_idc = (data[pos->offset] >> 5) & 0x03;
+	}
+
+	return TRUE;
+}
+
+/* SPS/PPS を NAL パーサに登録する (ES の場合は、ストリーム中にある)	*/
+static void
+gst_acm_h264_dec_parse_param_set(GstAcmH264Dec *me, const guint8 *data,
+	const GstAcmH264NalPos *pos)
+{
+	GstH264NalUnit nalu;
+	GstH264ParserResult parse_res;
+	GstH264SPS sps;
+	GstH264PPS pps;
+
+	parse_res = gst_acm_h264_dec_identify_nalu (me, data, pos->sc_offset,
+					pos->offset + pos->size, &nalu);
+	if (GST_H264_PARSER_OK != parse_res
+		&& GST_H264_PARSER_NO_NAL_END != parse_res) {
+		return;
+	}
+
+	if (GST_H264_NAL_SPS == nalu.type) {
+		parse_res = gst_h264_parser_parse_sps (me->priv->nalparser,
+						&nalu, &sps, FALSE);
+	}
+	else {
+		parse_res = gst_h264_parser_parse_pps (me->priv->nalparser,
+						&nalu, &pps);
+	}
+	if (GST_H264_PARSER_OK != parse_res) {
+		GST_WARNING_OBJECT (me, "failed to parse SPS/PPS (type:%u)", nalu.type);
+	}
+}
+
+static gboolean
+gst_acm_h264_dec_read_bits(GstAcmH264BitReader *br, guint n, guint32 *val)
+{
+	*val = 0;
+	while (n-- > 0) {
+		if (0 == br->bit) {
+			if (br->byte >= br->size) {
+				return FALSE;
+			}
+			/* emulation prevention byte (0x000003) を読み飛ばす	*/
+			if (br->zeros >= 2 && 0x03 == br->data[br->byte]) {
+				br->byte++;
+				br->zeros = 0;
+				if (br->byte >= br->size) {
+					return FALSE;
+				}
+			}
+		}
+		*val = (*val << 1) | ((br->data[br->byte] >> (7 - br->bit)) & 0x01);
+		if (8 == ++br->bit) {
+			br->zeros = (0x00 == br->data[br->byte]) ? br->zeros + 1 : 0;
+			br->bit = 0;
+			br->byte++;
+		}
+	}
+
+	return TRUE;
+}
+
+static gboolean
+gst_acm_h264_dec_read_ue(GstAcmH264BitReader *br, guint32 *val)
+{
+	guint32 bit = 0;
+	guint zeros = 0;
+
+	do {
+		if (! gst_acm_h264_dec_read_bits (br, 1, &bit)) {
+			return FALSE;
+		}
+	} while (0 == bit && ++zeros < 32);
+	if (zeros >= 32) {
+		return FALSE;
+	}
+	if (! gst_acm_h264_dec_read_bits (br, zeros, val)) {
+		return FALSE;
+	}
+	*val += (1U << zeros) - 1;
+
+	return TRUE;
+}
+
+static gboolean
+gst_acm_h264_dec_read_se(GstAcmH264BitReader *br, gint32 *val)
+{
+	guint32 ue;
+
+	if (! gst_acm_h264_dec_read_ue (br, &ue)) {
+		return FALSE;
+	}
+	*val = (ue & 0x01) ? (gint32) ((ue + 1) / 2) : -(gint32) (ue / 2);
+
+	return TRUE;
+}
+
+/* ピクチャの先頭のスライスヘッダから読み出した、フィールドの情報	*/
+typedef struct _GstAcmH264SliceField {
+	guint32 frame_num;
+	gboolean field_pic;
+	gboolean bottom_field;
+	gint32 delta_poc_bottom;
+} GstAcmH264SliceField;
+
+/* スライスヘッダの先頭から、フィールドの情報までを読み出す。
+ * (ヘッダ全体を解析する gst_h264_parser_parse_slice_hdr() は使わない)
+ * ピクチャの先頭のスライスでない場合は、FALSE を返す
+ */
+static gboolean
+gst_acm_h264_dec_peek_slice_field(GstAcmH264Dec *me, const guint8 *data,
+	const GstAcmH264NalPos *pos, GstAcmH264SliceField *field)
+{
+	GstAcmH264BitReader br = { data + pos->offset + 1, pos->size - 1, 0, 0, 0 };
+	GstH264PPS *pps;
+	GstH264SPS *sps;
+	guint32 val;
+
+	memset (field, 0, sizeof (GstAcmH264SliceField));
+
+	if (pos->size < 2) {
+		return FALSE;
+	}
+
+	/* first_mb_in_slice	*/
+	if (! gst_acm_h264_dec_read_ue (&br, &val) || 0 != val) {
+		return FALSE;
+	}
+	/* slice_type	*/
+	if (! gst_acm_h264_dec_read_ue (&br, &val)) {
+		return FALSE;
+	}
+	/* pic_parameter_set_id	*/
+	if (! gst_acm_h264_dec_read_ue (&br, &val)
+		|| val >= GST_H264_MAX_PPS_COUNT) {
+		return FALSE;
+	}
+	pps = &(me->priv->nalparser->pps[val]);
+	if (! pps->valid || NULL == pps->sequence) {
+		return FALSE;
+	}
+	sps = pps->sequence;
+
+	if (sps->separate_colour_plane_flag) {
+		/* colour_plane_id	*/
+		if (! gst_acm_h264_dec_read_bits (&br, 2, &val)) {
+			return FALSE;
+		}
+	}
+	/* frame_num	*/
+	if (! gst_acm_h264_dec_read_bits (&br,
+			sps->log2_max_frame_num_minus4 + 4, &val)) {
+		return FALSE;
+	}
+	field->frame_num = val;
+	if (! sps->frame_mbs_only_flag) {
+		if (! gst_acm_h264_dec_read_bits (&br, 1, &val)) {
+			return FALSE;
+		}
+		field->field_pic = val;
+		if (field->field_pic) {
+			if (! gst_acm_h264_dec_read_bits (&br, 1, &val)) {
+				return FALSE;
+			}
+			field->bottom_field = val;
+		}
+	}
+
+	/* フレームの場合、フィールドの順序は delta_pic_order_cnt_bottom で決まる	*/
+	if (GST_H264_NAL_SLICE_IDR == pos->type) {
+		/* idr_pic_id	*/
+		if (! gst_acm_h264_dec_read_ue (&br, &val)) {
+			return TRUE;
+		}
+	}
+	if (0 == sps->pic_order_cnt_type) {
+		/* pic_order_cnt_lsb	*/
+		if (! gst_acm_h264_dec_read_bits (&br,
+				sps->log2_max_pic_order_cnt_lsb_minus4 + 4, &val)) {
+			return TRUE;
+		}
+		if (pps->pic_order_present_flag && ! field->field_pic) {
+			gst_acm_h264_dec_read_se (&br, &(field->delta_poc_bottom));
+		}
+	}
+
+	return TRUE;
+}
+
+/* SEI の pic_timing から、pic_struct を読み出す。
+ * SEI は、ピクチャのスライスより前にあるので、最後に解析した SPS を参照する。
+ * pic_struct が無い場合は、FALSE を返す
+ */
+static gboolean
+gst_acm_h264_dec_peek_sei_pic_struct(GstAcmH264Dec *me, const guint8 *data,
+	const GstAcmH264NalPos *pos, guint32 *pic_struct)
+{
+	GstAcmH264BitReader br = { data + pos->offset + 1, pos->size - 1, 0, 0, 0 };
+	GstH264SPS *sps = me->priv->nalparser->last_sps;
+	GstH264VUIParams *vui;
+	GstH264HRDParams *hrd = NULL;
+	guint32 payloadType;
+	guint32 payloadSize;
+	guint32 val;
+	guint32 i;
+
+	if (pos->size < 2 || NULL == sps || ! sps->valid
+		|| ! sps->vui_parameters_present_flag) {
+		return FALSE;
+	}
+	vui = &(sps->vui_parameters);
+	if (! vui->pic_struct_present_flag) {
+		return FALSE;
+	}
+	if (vui->nal_hrd_parameters_present_flag) {
+		hrd = &(vui->nal_hrd_parameters);
+	}
+	else if (vui->vcl_hrd_parameters_present_flag) {
+		hrd = &(vui->vcl_hrd_parameters);
+	}
+
+	/* 末尾の rbsp_trailing_bits の手前まで、SEI メッセージを順に読む	*/
+	while (br.byte + 1 < br.size) {
+		payloadType = 0;
+		do {
+			if (! gst_acm_h264_dec_read_bits (&br, 8, &val)) {
+				return FALSE;
+			}
+			payloadType += val;
+		} while (0xff == val);
+		payloadSize = 0;
+		do {
+			if (! gst_acm_h264_dec_read_bits (&br, 8, &val)) {
+				return FALSE;
+			}
+			payloadSize += val;
+		} while (0xff == val);
+
+		/* pic_timing	*/
+		if (1 == payloadType) {
+			if (hrd) {
+				/* cpb_removal_delay, dpb_output_delay	*/
+				if (! gst_acm_h264_dec_read_bits (&br,
+						hrd->cpb_removal_delay_length_minus1 + 1, &val)
+					|| ! gst_acm_h264_dec_read_bits (&br,
+						hrd->dpb_output_delay_length_minus1 + 1, &val)) {
+					return FALSE;
+				}
+			}
+			return gst_acm_h264_dec_read_bits (&br, 4, pic_struct);
+		}
+		for (i = 0; i < payloadSize; i++) {
+			if (! gst_acm_h264_dec_read_bits (&br, 8, &val)) {
+				return FALSE;
+			}
+		}
+	}
+
+	return FALSE;
+}
 
 static gboolean
 gst_acm_h264_dec_parse_nal(GstAcmH264Dec *me, GstVideoCodecFrame * frame)
 {
 	GstMapInfo map_parse;
-	GstH264ParserResult parse_res;
-	GstH264NalUnit nalu;
-	const guint nl = me->priv->nal_length_size;
+	GstAcmH264NalPos pos;
+	GstAcmH264SliceField field;
+	gsize offset = 0;
 	gboolean isFoundSlice = FALSE;
-	GstH264SliceHdr slice;
+	gboolean isFoundPicture = FALSE;
+	gboolean hasPicStruct = FALSE;
+	guint32 picStruct = 0;
+	guint32 frameNum = 0;
 	gboolean isFrame = FALSE;
 	gboolean hasTopField = FALSE;
 	gboolean hasBottomField = FALSE;
+	gboolean isTopFirst = TRUE;
 
 	gst_buffer_map (frame->input_buffer, &map_parse, GST_MAP_READ);
 
-	parse_res = gst_h264_parser_identify_nalu_avc (me->priv->nalparser,
-					map_parse.data, 0, map_parse.size, nl, &nalu);
-
-	while (parse_res == GST_H264_PARSER_OK) {
+	while (gst_acm_h264_dec_next_nal (me, map_parse.data, map_parse.size,
+			&offset, &pos)) {
 #if DBG_LOG_INTERLACED
-		GST_INFO_OBJECT (me, "processing nal of type %u, offset %d, size %u",
-						 nalu.type, nalu.offset, nalu.size);
+		GST_INFO_OBJECT (me, "processing nal of type %u, offset %"
+						 G_GSIZE_FORMAT ", size %" G_GSIZE_FORMAT,
+						 pos.type, pos.offset, pos.size);
 #endif
-		switch (nalu.type) {
+		switch (pos.type) {
+		case GST_H264_NAL_SPS:
+		case GST_H264_NAL_PPS:
+			gst_acm_h264_dec_parse_param_set (me, map_parse.data, &pos);
+			break;
+		case GST_H264_NAL_SEI:
+			if (! hasPicStruct && ! isFoundSlice) {
+				hasPicStruct = gst_acm_h264_dec_peek_sei_pic_struct (me,
+									map_parse.data, &pos, &picStruct);
+			}
+			break;
 		case GST_H264_NAL_SLICE:
 		case GST_H264_NAL_SLICE_DPA:
-		case GST_H264_NAL_SLICE_DPB:
-		case GST_H264_NAL_SLICE_DPC:
 		case GST_H264_NAL_SLICE_IDR:
-			parse_res = gst_h264_parser_parse_slice_hdr (
-							me->priv->nalparser, &nalu, &slice, FALSE, FALSE);
-			if (GST_H264_PARSER_OK == parse_res) {
+			/* ピクチャの先頭のスライスのみ、ヘッダを読む	*/
+			if (gst_acm_h264_dec_peek_slice_field (me, map_parse.data, &pos,
+					&field)) {
 #if DBG_LOG_INTERLACED
-				GST_INFO_OBJECT (me, "slice type: %u, frame_num: %d",
-								 slice.type, slice.frame_num);
-				GST_INFO_OBJECT (me, "field_pic_flag: %d, bottom_field_flag: %d",
-								  slice.field_pic_flag, slice.bottom_field_flag);
+				GST_INFO_OBJECT (me, "field_pic_flag: %d, bottom_field_flag: %d,"
+								 " frame_num: %u", field.field_pic,
+								 field.bottom_field, field.frame_num);
 #endif
-				if (0 == slice.field_pic_flag) {
+				/* 最初のピクチャで、フィールドの順序を決める	*/
+				if (! isFoundPicture) {
+					if (field.field_pic) {
+						isTopFirst = ! field.bottom_field;
+					}
+					else {
+						isTopFirst = (field.delta_poc_bottom >= 0);
+					}
+					frameNum = field.frame_num;
+					isFoundPicture = TRUE;
+				}
+				if (! field.field_pic) {
 					isFrame = TRUE;
 				}
 				else {
-					if (slice.bottom_field_flag) {
+					if (field.bottom_field) {
 						hasBottomField = TRUE;
 					}
 					else {
@@ -1113,13 +2191,13 @@ gst_acm_h264_dec_parse_nal(GstAcmH264Dec *me, GstVideoCodecFrame * frame)
 			}
 			isFoundSlice = TRUE;
 			break;
+		case GST_H264_NAL_SLICE_DPB:
+		case GST_H264_NAL_SLICE_DPC:
+			isFoundSlice = TRUE;
+			break;
 		default:
 			break;
 		}
-		
-		parse_res = gst_h264_parser_identify_nalu_avc (me->priv->nalparser,
-						map_parse.data, nalu.offset + nalu.size, map_parse.size,
-						nl, &nalu);
 	}
 	
 	if (! isFoundSlice) {
@@ -1132,6 +2210,33 @@ gst_acm_h264_dec_parse_nal(GstAcmH264Dec *me, GstVideoCodecFrame * frame)
 		GST_INFO_OBJECT (me, "FRAME_FLAG_FRAME");
 #endif
 		GST_VIDEO_CODEC_FRAME_FLAG_SET(frame, GST_VIDEO_CODEC_FRAME_FLAG_FRAME);
+
+		/* フレームの場合、SEI の pic_struct があれば、プログレッシブかどうかと
+		 * フィールドの順序は、それに従う (無い場合は delta_pic_order_cnt_bottom)
+		 */
+		if (hasPicStruct) {
+#if DBG_LOG_INTERLACED
+			GST_INFO_OBJECT (me, "pic_struct: %u", picStruct);
+#endif
+			switch (picStruct) {
+			case 3:		/* top, bottom	*/
+			case 5:		/* top, bottom, top repeated	*/
+				isTopFirst = TRUE;
+				break;
+			case 4:		/* bottom, top	*/
+			case 6:		/* bottom, top, bottom repeated	*/
+				isTopFirst = FALSE;
+				break;
+			case 0:		/* frame	*/
+			case 7:		/* frame doubling	*/
+			case 8:		/* frame tripling	*/
+				GST_VIDEO_CODEC_FRAME_FLAG_SET(frame,
+					GST_VIDEO_CODEC_FRAME_FLAG_PROGRESSIVE);
+				break;
+			default:
+				break;
+			}
+		}
 	}
 	if (hasTopField && hasBottomField) {
 #if DBG_LOG_INTERLACED
@@ -1148,47 +2253,750 @@ gst_acm_h264_dec_parse_nal(GstAcmH264Dec *me, GstVideoCodecFrame * frame)
 			GST_VIDEO_CODEC_FRAME_FLAG_SET(frame,
 				GST_VIDEO_CODEC_FRAME_FLAG_TOP_FIELD);
 		}
-		if (hasBottomField) {
-#if DBG_LOG_INTERLACED
-			GST_INFO_OBJECT (me, "FRAME_FLAG_BOTTOM_FIELD");
-#endif
-			GST_VIDEO_CODEC_FRAME_FLAG_SET(frame,
-				GST_VIDEO_CODEC_FRAME_FLAG_BOTTOM_FIELD);
+		if (hasBottomField) {
+#if DBG_LOG_INTERLACED
+			GST_INFO_OBJECT (me, "FRAME_FLAG_BOTTOM_FIELD");
+#endif
+			GST_VIDEO_CODEC_FRAME_FLAG_SET(frame,
+				GST_VIDEO_CODEC_FRAME_FLAG_BOTTOM_FIELD);
+		}
+	}
+
+	if (isTopFirst) {
+		GST_VIDEO_CODEC_FRAME_FLAG_SET(frame, GST_VIDEO_CODEC_FRAME_FLAG_TFF);
+	}
+
+	/* フィールドのペアを記録する。逆のパリティで frame_num が同じフィールドを
+	 * ペアとし、2番目のフィールドに印を付けて、最初のフィールドの
+	 * フレーム番号を記録しておく
+	 */
+	if (hasTopField != hasBottomField) {
+		if (me->priv->waiting_second_field
+			&& me->priv->first_field_is_top != hasTopField
+			&& me->priv->first_field_frame_num == frameNum) {
+			GST_VIDEO_CODEC_FRAME_FLAG_SET(frame,
+				GST_VIDEO_CODEC_FRAME_FLAG_SECOND_FIELD);
+			me->priv->field_partner[frame->system_frame_number % NUM_FIELD_PAIR]
+				= me->priv->first_field_number;
+			me->priv->waiting_second_field = FALSE;
+		}
+		else {
+			me->priv->waiting_second_field = TRUE;
+			me->priv->first_field_is_top = hasTopField;
+			me->priv->first_field_frame_num = frameNum;
+			me->priv->first_field_number = frame->system_frame_number;
+		}
+	}
+	else {
+		me->priv->waiting_second_field = FALSE;
+	}
+
+	gst_buffer_unmap (frame->input_buffer, &map_parse);
+	
+	return isFoundSlice;
+}
+
+/* フィールド単位で入力したフレームかどうか	*/
+static gboolean
+gst_acm_h264_dec_is_single_field(GstVideoCodecFrame * frame)
+{
+	return GST_VIDEO_CODEC_FRAME_FLAG_IS_SET(frame,
+				GST_VIDEO_CODEC_FRAME_FLAG_TOP_FIELD)
+		|| GST_VIDEO_CODEC_FRAME_FLAG_IS_SET(frame,
+				GST_VIDEO_CODEC_FRAME_FLAG_BOTTOM_FIELD);
+}
+
+/* first のフィールドと対になる、2番目のフィールドのフレームを探す。
+ * 見つかった場合は、ref して返す
+ */
+static GstVideoCodecFrame *
+gst_acm_h264_dec_find_second_field(GstAcmH264Dec * me,
+	GstVideoCodecFrame * first)
+{
+	GstVideoCodecFrame *second = NULL;
+	GList *frames;
+	GList *l;
+
+	frames = gst_video_decoder_get_frames (GST_VIDEO_DECODER (me));
+	for (l = frames; l; l = l->next) {
+		GstVideoCodecFrame *frame = l->data;
+
+		/* 入力順に並んでいる	*/
+		if (frame->system_frame_number <= first->system_frame_number) {
+			continue;
+		}
+		if (GST_VIDEO_CODEC_FRAME_FLAG_IS_SET(frame,
+				GST_VIDEO_CODEC_FRAME_FLAG_SECOND_FIELD)
+			&& first->system_frame_number == me->priv->field_partner[
+					frame->system_frame_number % NUM_FIELD_PAIR]) {
+			second = gst_video_codec_frame_ref (frame);
+			break;
+		}
+	}
+	g_list_free_full (frames, (GDestroyNotify) gst_video_codec_frame_unref);
+
+	return second;
+}
+
+/* デバイスは、フィールドのペア (2入力) に対して 1 フレームを出力するので、
+ * 最初のフィールドのタイムスタンプを、2番目のフィールドのフレームに移して
+ * 1 フレームにまとめる。最初のフィールドのフレームは、出力せずに解放する。
+ * frame には、ペアのどちらのフィールドを指定してもよい。
+ * まとめた (出力する) フレームを返す
+ */
+static GstVideoCodecFrame *
+gst_acm_h264_dec_merge_field_pair(GstAcmH264Dec * me,
+	GstVideoCodecFrame * frame)
+{
+	GstVideoCodecFrame *first = NULL;
+	GstVideoCodecFrame *second = NULL;
+
+	/* ペアは、入力時に解析したパリティと frame_num で記録してある
+	 * (QoS などで、間のフレームが破棄されている場合がある)
+	 */
+	if (GST_VIDEO_CODEC_FRAME_FLAG_IS_SET(frame,
+			GST_VIDEO_CODEC_FRAME_FLAG_SECOND_FIELD)) {
+		first = gst_video_decoder_get_frame (GST_VIDEO_DECODER (me),
+					me->priv->field_partner[
+						frame->system_frame_number % NUM_FIELD_PAIR]);
+		second = frame;
+	}
+	else {
+		first = frame;
+		second = gst_acm_h264_dec_find_second_field (me, frame);
+	}
+	/* 参照は、GstVideoDecoder のフレームリストが保持している	*/
+	if (first && first != frame) {
+		gst_video_codec_frame_unref (first);
+	}
+	if (second && second != frame) {
+		gst_video_codec_frame_unref (second);
+	}
+
+	if (NULL == first || NULL == second) {
+		/* 対になるフィールドが無いので、そのまま出力する	*/
+		GST_WARNING_OBJECT(me, "unpaired field (%u)",
+						   frame->system_frame_number);
+		COUNTERS_INC (me, num_unpaired_field);
+		return frame;
+	}
+
+#if DBG_LOG_INTERLACED
+	GST_INFO_OBJECT(me, "merge field pair (%u, %u)",
+					first->system_frame_number, second->system_frame_number);
+#endif
+	/* タイムスタンプは最初のフィールド、duration は 2 フィールド分	*/
+	second->pts = first->pts;
+	second->dts = first->dts;
+	GST_BUFFER_PTS(second->input_buffer) = GST_BUFFER_PTS(first->input_buffer);
+	GST_BUFFER_DTS(second->input_buffer) = GST_BUFFER_DTS(first->input_buffer);
+	if (GST_CLOCK_TIME_IS_VALID (first->duration)) {
+		if (GST_CLOCK_TIME_IS_VALID (second->duration)) {
+			second->duration += first->duration;
+		}
+		else {
+			second->duration = first->duration * 2;
+		}
+	}
+	if (GST_VIDEO_CODEC_FRAME_FLAG_IS_SET(first,
+			GST_VIDEO_CODEC_FRAME_FLAG_TOP_FIELD)) {
+		GST_VIDEO_CODEC_FRAME_FLAG_SET(second, GST_VIDEO_CODEC_FRAME_FLAG_TFF);
+	}
+	else {
+		GST_VIDEO_CODEC_FRAME_FLAG_UNSET(second, GST_VIDEO_CODEC_FRAME_FLAG_TFF);
+	}
+	if (GST_VIDEO_CODEC_FRAME_IS_SYNC_POINT (first)) {
+		GST_VIDEO_CODEC_FRAME_SET_SYNC_POINT (second);
+	}
+
+	/* output_buffer が無いので、push されずに解放される (QoS のドロップ数には数えない) */
+	GST_VIDEO_CODEC_FRAME_SET_DECODE_ONLY (first);
+	gst_video_decoder_finish_frame (GST_VIDEO_DECODER (me), first);
+	me->priv->in_out_frame_count--;
+
+	return second;
+}
+
+/* インタレースのフラグを、出力バッファに設定する	*/
+static void
+gst_acm_h264_dec_set_field_flags(GstAcmH264Dec * me,
+	GstVideoCodecFrame * frame)
+{
+	GstBuffer *outbuf = frame->output_buffer;
+
+	/* プールのバッファは再利用されるので、毎回設定しなおす	*/
+	if (GST_VIDEO_CODEC_FRAME_FLAG_IS_SET(frame,
+			GST_VIDEO_CODEC_FRAME_FLAG_PROGRESSIVE)) {
+		GST_BUFFER_FLAG_UNSET (outbuf, GST_VIDEO_BUFFER_FLAG_INTERLACED);
+		GST_BUFFER_FLAG_UNSET (outbuf, GST_VIDEO_BUFFER_FLAG_TFF);
+		return;
+	}
+
+	GST_BUFFER_FLAG_SET (outbuf, GST_VIDEO_BUFFER_FLAG_INTERLACED);
+	if (GST_VIDEO_CODEC_FRAME_FLAG_IS_SET(frame,
+			GST_VIDEO_CODEC_FRAME_FLAG_TFF)) {
+		GST_BUFFER_FLAG_SET (outbuf, GST_VIDEO_BUFFER_FLAG_TFF);
+	}
+	else {
+		GST_BUFFER_FLAG_UNSET (outbuf, GST_VIDEO_BUFFER_FLAG_TFF);
+	}
+}
+
+static GstH264ParserResult
+gst_acm_h264_dec_identify_nalu(GstAcmH264Dec *me, const guint8 *data,
+	guint offset, gsize size, GstH264NalUnit *nalu)
+{
+	if (GST_ACMH264DEC_IN_FMT_ES == me->input_format) {
+		return gst_h264_parser_identify_nalu (me->priv->nalparser,
+					data, offset, size, nalu);
+	}
+
+	return gst_h264_parser_identify_nalu_avc (me->priv->nalparser,
+				data, offset, size, me->priv->nal_length_size, nalu);
+}
+
+/* フレーム内の NAL ユニットのヘッダから、参照ピクチャかどうか、
+ * IDR ピクチャかどうかを調べる
+ */
+static void
+gst_acm_h264_dec_peek_nal_ref(GstAcmH264Dec *me, GstBuffer *inbuf,
+	gboolean *is_ref, gboolean *is_idr)
+{
+	GstMapInfo map;
+	GstAcmH264NalPos pos;
+	gsize offset = 0;
+
+	*is_ref = FALSE;
+	*is_idr = FALSE;
+
+	/* 読めない場合は、参照フレームとして扱い、破棄しない	*/
+	if (! gst_buffer_map (inbuf, &map, GST_MAP_READ)) {
+		GST_WARNING_OBJECT (me, "failed to map input buffer");
+		*is_ref = TRUE;
+		return;
+	}
+
+	while (gst_acm_h264_dec_next_nal (me, map.data, map.size, &offset, &pos)) {
+		switch (pos.type) {
+		case GST_H264_NAL_SLICE_IDR:
+			*is_idr = TRUE;
+			/* fall through */
+		case GST_H264_NAL_SLICE:
+		case GST_H264_NAL_SLICE_DPA:
+		case GST_H264_NAL_SLICE_DPB:
+		case GST_H264_NAL_SLICE_DPC:
+			if (0 != pos.ref_idc) {
+				*is_ref = TRUE;
+			}
+			break;
+		default:
+			break;
+		}
+	}
+
+	gst_buffer_unmap (inbuf, &map);
+}
+
+/* フレーム内に SPS があれば、その画像サイズを取得する	*/
+static gboolean
+gst_acm_h264_dec_peek_sps_size(GstAcmH264Dec *me, GstBuffer *inbuf,
+	guint *width, guint *height)
+{
+	GstMapInfo map;
+	GstAcmH264NalPos pos;
+	gsize offset = 0;
+	GstH264ParserResult parse_res;
+	GstH264NalUnit nalu;
+	GstH264SPS sps;
+	gboolean found = FALSE;
+
+	gst_buffer_map (inbuf, &map, GST_MAP_READ);
+
+	while (gst_acm_h264_dec_next_nal (me, map.data, map.size, &offset, &pos)) {
+		if (GST_H264_NAL_SPS == pos.type) {
+			parse_res = gst_acm_h264_dec_identify_nalu (me, map.data,
+							pos.sc_offset, pos.offset + pos.size, &nalu);
+			if ((GST_H264_PARSER_OK == parse_res
+				 || GST_H264_PARSER_NO_NAL_END == parse_res)
+				&& GST_H264_PARSER_OK == gst_h264_parser_parse_sps (
+					me->priv->nalparser, &nalu, &sps, TRUE)) {
+				if (sps.frame_cropping_flag) {
+					*width = sps.crop_rect_width;
+					*height = sps.crop_rect_height;
+				}
+				else {
+					*width = sps.width;
+					*height = sps.height;
+				}
+				found = TRUE;
+			}
+			break;
+		}
+		/* SPS は、スライスより前にある	*/
+		if (GST_H264_NAL_SLICE <= pos.type
+			&& GST_H264_NAL_SLICE_IDR >= pos.type) {
+			break;
+		}
+	}
+
+	gst_buffer_unmap (inbuf, &map);
+
+	return found;
+}
+
+#if SUPPORT_CODED_FIELD
+/* byte-stream では codec_data が無いので、フレーム内の SPS の
+ * frame_mbs_only_flag から、インターレースかどうかを判断する。
+ * SPS が無い場合は FALSE を返す
+ */
+static gboolean
+gst_acm_h264_dec_peek_sps_interlaced(GstAcmH264Dec *me, GstBuffer *inbuf,
+	gboolean *is_interlaced)
+{
+	GstMapInfo map;
+	GstAcmH264NalPos pos;
+	gsize offset = 0;
+	GstH264ParserResult parse_res;
+	GstH264NalUnit nalu;
+	GstH264SPS sps;
+	gboolean found = FALSE;
+
+	if (! gst_buffer_map (inbuf, &map, GST_MAP_READ)) {
+		return FALSE;
+	}
+
+	while (gst_acm_h264_dec_next_nal (me, map.data, map.size, &offset, &pos)) {
+		if (GST_H264_NAL_SPS == pos.type) {
+			parse_res = gst_acm_h264_dec_identify_nalu (me, map.data,
+							pos.sc_offset, pos.offset + pos.size, &nalu);
+			if ((GST_H264_PARSER_OK == parse_res
+				 || GST_H264_PARSER_NO_NAL_END == parse_res)
+				&& GST_H264_PARSER_OK == gst_h264_parser_parse_sps (
+					me->priv->nalparser, &nalu, &sps, TRUE)) {
+				*is_interlaced = (0 == sps.frame_mbs_only_flag);
+				found = TRUE;
+			}
+			break;
+		}
+		/* SPS は、スライスより前にある	*/
+		if (GST_H264_NAL_SLICE <= pos.type
+			&& GST_H264_NAL_SLICE_IDR >= pos.type) {
+			break;
+		}
+	}
+
+	gst_buffer_unmap (inbuf, &map);
+
+	return found;
+}
+#endif
+
+/* SPS/PPS をフレームの先頭に挿入する	*/
+static gboolean
+gst_acm_h264_dec_prepend_spspps(GstAcmH264Dec *me, GstVideoCodecFrame * frame)
+{
+	GstMapInfo spspps_map;
+	GstMemory *spspps_mem;
+
+	/* SPS/PPS の挿入 */
+	GST_INFO_OBJECT(me, "insert SPS/PPS to frame");
+
+	spspps_mem = gst_allocator_alloc(NULL, me->spspps_size, NULL);
+	if (NULL == spspps_mem) {
+		GST_ELEMENT_ERROR(me, STREAM, DECODE, (NULL),
+			("no mem with gst_allocator_alloc()"));
+		return FALSE;
+	}
+	gst_memory_map(spspps_mem, &spspps_map, GST_MAP_WRITE);
+	memcpy(spspps_map.data, me->spspps, me->spspps_size);
+	gst_memory_unmap(spspps_mem, &spspps_map);
+
+	frame->input_buffer = gst_buffer_make_writable(frame->input_buffer);
+	gst_buffer_prepend_memory(frame->input_buffer, spspps_mem);
+
+	return TRUE;
+}
+
+#if DO_QOS_FRAME_DROP
+/* down stream からの QoS 情報により、遅れているフレームを、デバイスへ
+ * 入力する前にドロップする。ドロップした場合は TRUE を返す。
+ * フィールドのペアは、最初のフィールドで判断して、2つまとめてドロップする
+ */
+static gboolean
+gst_acm_h264_dec_qos_drop_frame(GstAcmH264Dec *me, GstVideoCodecFrame * frame)
+{
+	GstClockTimeDiff deadline;
+	GstClockTime frame_duration;
+	gboolean is_ref = FALSE;
+	gboolean is_idr = FALSE;
+
+	if (! me->qos) {
+		return FALSE;
+	}
+
+#if SUPPORT_CODED_FIELD
+	/* ペアの片方のフィールドだけを、デバイスに入力しない	*/
+	if (GST_VIDEO_CODEC_FRAME_FLAG_IS_SET(frame,
+			GST_VIDEO_CODEC_FRAME_FLAG_SECOND_FIELD)) {
+		if (me->priv->qos_dropped_first_field) {
+			me->priv->qos_dropped_first_field = FALSE;
+			goto drop;
+		}
+		return FALSE;
+	}
+	me->priv->qos_dropped_first_field = FALSE;
+#endif
+
+	/* フレームレートが分からない場合は、遅れを判断できない	*/
+	if (NULL == me->input_state || me->input_state->info.fps_n <= 0
+		|| me->input_state->info.fps_d <= 0) {
+		return FALSE;
+	}
+	frame_duration = gst_util_uint64_scale (GST_SECOND,
+		me->input_state->info.fps_d, me->input_state->info.fps_n);
+
+	deadline = gst_video_decoder_get_max_decode_time (
+					GST_VIDEO_DECODER (me), frame);
+	if (deadline >= 0 && ! me->priv->qos_waiting_idr) {
+		return FALSE;
+	}
+
+	gst_acm_h264_dec_peek_nal_ref(me, frame->input_buffer, &is_ref, &is_idr);
+
+	if (me->priv->qos_waiting_idr) {
+		if (! is_idr) {
+			goto drop;
+		}
+		GST_INFO_OBJECT (me, "QoS - resume decoding at IDR (%u)",
+						 frame->system_frame_number);
+		me->priv->qos_waiting_idr = FALSE;
+		return FALSE;
+	}
+
+	if (! is_idr && -deadline > (GstClockTimeDiff)
+			(frame_duration * QOS_SKIP_TO_IDR_FRAMES)) {
+		GST_WARNING_OBJECT (me,
+			"QoS - %f s past deadline, skip to next IDR",
+			(double) -deadline / GST_SECOND);
+		me->priv->qos_waiting_idr = TRUE;
+		goto drop;
+	}
+
+	if (! is_ref) {
+		goto drop;
+	}
+
+	return FALSE;
+
+drop:
+	GST_INFO_OBJECT (me, "QoS - drop frame before decoding (%u)",
+					 frame->system_frame_number);
+#if SUPPORT_CODED_FIELD
+	if (gst_acm_h264_dec_is_single_field(frame)
+		&& ! GST_VIDEO_CODEC_FRAME_FLAG_IS_SET(frame,
+				GST_VIDEO_CODEC_FRAME_FLAG_SECOND_FIELD)) {
+		me->priv->qos_dropped_first_field = TRUE;
+	}
+#endif
+	gst_video_decoder_drop_frame (GST_VIDEO_DECODER (me), frame);
+	COUNTERS_INC (me, num_drop_qos);
+	return TRUE;
+}
+#endif
+
+/* デバイスが、デコード済みバッファの timestamp に、QBUF したフレーム番号を
+ * 引き継いでいるかどうかを、最初の DQBUF で確認する。
+ * V4L2_BUF_FLAG_TIMESTAMP_COPY が無い場合は、timestamp が未処理のフレームの
+ * 番号に一致し、tv_usec が 0 のままであれば、引き継いでいると判断する
+ * (monotonic clock の時刻を返すデバイスでは、一致しない)
+ */
+static void
+gst_acm_h264_dec_check_frame_number(GstAcmH264Dec *me,
+	const struct v4l2_buffer *vbuffer)
+{
+	GstVideoCodecFrame *frame;
+
+	if (me->priv->is_checked_frame_number) {
+		return;
+	}
+
+#ifdef V4L2_BUF_FLAG_TIMESTAMP_COPY
+	if (V4L2_BUF_FLAG_TIMESTAMP_COPY
+		== (vbuffer->flags & V4L2_BUF_FLAG_TIMESTAMP_MASK)) {
+		me->priv->has_frame_number = TRUE;
+	}
+	else
+#endif
+	{
+		/* フレーム番号なしで入力したデータ (tv_sec が 0) では判断しない	*/
+		if (! TIMEVAL_HAS_FRAME_NUMBER (vbuffer->timestamp)) {
+			return;
+		}
+		if (0 == vbuffer->timestamp.tv_usec) {
+			frame = gst_video_decoder_get_frame (GST_VIDEO_DECODER (me),
+						TIMEVAL_TO_FRAME_NUMBER (vbuffer->timestamp));
+			if (frame) {
+				me->priv->has_frame_number = TRUE;
+				gst_video_codec_frame_unref (frame);
+			}
+		}
+	}
+	me->priv->is_checked_frame_number = TRUE;
+
+	GST_INFO_OBJECT (me, "device %s frame number in timestamp",
+		me->priv->has_frame_number ? "copies" : "does not copy");
+}
+
+/* デコード済みバッファに対応するフレームを求める。
+ * デバイスが timestamp (フレーム番号) を引き継いでいない場合は、
+ * 最も古いフレームとする。*is_matched には、フレーム番号で対応付けたか
+ * どうかを返す (この場合に NULL を返したら、既に破棄したフレーム)
+ */
+static GstVideoCodecFrame *
+gst_acm_h264_dec_get_out_frame(GstAcmH264Dec *me, GstBuffer *v4l2buf_out,
+	gboolean *is_matched)
+{
+	GstAcmV4l2Meta *meta;
+	GstVideoCodecFrame *frame = NULL;
+
+	*is_matched = FALSE;
+
+	meta = GST_ACM_V4L2_META_GET (v4l2buf_out);
+	if (meta) {
+		gst_acm_h264_dec_check_frame_number (me, &(meta->vbuffer));
+	}
+	if (meta && me->priv->has_frame_number
+		&& TIMEVAL_HAS_FRAME_NUMBER (meta->vbuffer.timestamp)) {
+		frame = gst_video_decoder_get_frame (GST_VIDEO_DECODER (me),
+					TIMEVAL_TO_FRAME_NUMBER (meta->vbuffer.timestamp));
+		/* フレーム番号は正しいので、NULL の場合は既に破棄したフレーム	*/
+		*is_matched = TRUE;
+		if (NULL == frame) {
+			return NULL;
+		}
+	}
+	if (NULL == frame) {
+		frame = gst_video_decoder_get_oldest_frame (GST_VIDEO_DECODER (me));
+	}
+	/* 参照は、GstVideoDecoder のフレームリストが保持している	*/
+	if (frame) {
+		gst_video_codec_frame_unref (frame);
+	}
+
+	return frame;
+}
+
+/* MMCO により出力されなかったピクチャのフレームを破棄する	*/
+static void
+gst_acm_h264_dec_drop_unoutput_frame(GstAcmH264Dec *me, GstBuffer *v4l2buf_out)
+{
+	GstVideoCodecFrame *frame;
+	gboolean isMatched;
+
+	frame = gst_acm_h264_dec_get_out_frame(me, v4l2buf_out, &isMatched);
+	if (frame && isMatched) {
+		GST_INFO_OBJECT (me, "drop frame not output (%u)",
+						 frame->system_frame_number);
+		gst_video_decoder_drop_frame (GST_VIDEO_DECODER (me), frame);
+		COUNTERS_INC (me, num_drop_mmco);
+	}
+}
+
+/* フレーム番号で対応付けた出力より十分古いフレームは、もうデバイスから
+ * 出力されない (壊れたストリームなど) ので、破棄して、未処理のフレームが
+ * 増え続けないようにする
+ */
+static void
+gst_acm_h264_dec_drop_stale_frames(GstAcmH264Dec *me, guint32 frame_number)
+{
+	GList *frames;
+	GList *l;
+	const guint32 depth = (gst_acm_h264_dec_get_buffering_pic_cnt (me)
+						   + DEFAULT_NUM_BUFFERS_IN) * 2;
+
+	frames = gst_video_decoder_get_frames (GST_VIDEO_DECODER (me));
+	for (l = frames; l; l = l->next) {
+		GstVideoCodecFrame *frame = l->data;
+
+		/* 入力順に並んでいる	*/
+		if (frame->system_frame_number + depth >= frame_number) {
+			break;
+		}
+		GST_WARNING_OBJECT (me, "drop stale frame (%u), output is at %u",
+							frame->system_frame_number, frame_number);
+		gst_video_decoder_drop_frame (GST_VIDEO_DECODER (me), frame);
+		me->priv->in_out_frame_count--;
+		COUNTERS_INC (me, num_drop_stale);
+	}
+	g_list_free_full (frames, (GDestroyNotify) gst_video_codec_frame_unref);
+}
+
+/* QBUF してから、デコード済みバッファを取り出すまでの時間を計測し、
+ * レイテンシを更新する
+ */
+static void
+gst_acm_h264_dec_measure_decode_time(GstAcmH264Dec *me, guint32 frame_number)
+{
+	GstClockTime qbufTime = me->priv->qbuf_time[frame_number % NUM_QBUF_TIME];
+	GstClockTime now = gst_util_get_timestamp ();
+
+	if (! GST_CLOCK_TIME_IS_VALID (qbufTime) || qbufTime > now) {
+		return;
+	}
+	GST_OBJECT_LOCK (me);
+	if (! GST_CLOCK_TIME_IS_VALID (me->priv->counters.decode_time_peak)
+		|| now - qbufTime > me->priv->counters.decode_time_peak) {
+		me->priv->counters.decode_time_peak = now - qbufTime;
+	}
+	if (GST_CLOCK_TIME_IS_VALID (me->priv->decode_time)) {
+		me->priv->decode_time = (me->priv->decode_time * 7 + (now - qbufTime)) / 8;
+	}
+	else {
+		me->priv->decode_time = now - qbufTime;
+	}
+	GST_OBJECT_UNLOCK (me);
+
+	gst_acm_h264_dec_update_latency (me, FALSE);
+}
+
+/* watchdog により、デバイスのストールと判断するまでの時間。
+ * フレームレートが分からない場合は、固定の SELECT_TIMEOUT_MSEC とする
+ */
+static GstClockTime
+gst_acm_h264_dec_watchdog_timeout(GstAcmH264Dec *me)
+{
+	GstClockTime frame_duration;
+
+	if (NULL == me->input_state || me->input_state->info.fps_n <= 0
+		|| me->input_state->info.fps_d <= 0) {
+		return SELECT_TIMEOUT_MSEC * GST_MSECOND;
+	}
+
+	frame_duration = gst_util_uint64_scale (GST_SECOND,
+		me->input_state->info.fps_d, me->input_state->info.fps_n);
+
+	return frame_duration * me->watchdog_frames;
+}
+
+/* デバイスのストールから復帰する。
+ * デバイスをリセットし、デバイス内にあったフレーム (keep 以外) を破棄して、
+ * 次の IDR ピクチャから、デコードを再開する
+ */
+static gboolean
+gst_acm_h264_dec_recover_stall(GstAcmH264Dec *me, GstVideoCodecFrame * keep)
+{
+	GList *frames;
+	GList *l;
+	guint numDropped = 0;
+	GstClockTime gapStart = GST_CLOCK_TIME_NONE;
+	GstClockTime gapEnd = GST_CLOCK_TIME_NONE;
+
+	GST_WARNING_OBJECT (me, "device stalled - reset and wait for IDR");
+
+	if (! gst_acm_h264_dec_flush_device (me)) {
+		return FALSE;
+	}
+
+	/* デバイス内にあったフレームは、出力されないので破棄する	*/
+	frames = gst_video_decoder_get_frames (GST_VIDEO_DECODER (me));
+	for (l = frames; l; l = l->next) {
+		GstVideoCodecFrame *frame = l->data;
+
+		if (frame == keep) {
+			continue;
+		}
+		if (! GST_CLOCK_TIME_IS_VALID (gapStart)) {
+			gapStart = frame->dts;
 		}
+		gapEnd = frame->dts;
+		gst_video_decoder_drop_frame (GST_VIDEO_DECODER (me), frame);
+		numDropped++;
+		COUNTERS_INC (me, num_drop_resync);
 	}
+	g_list_free_full (frames, (GDestroyNotify) gst_video_codec_frame_unref);
 
-	/* フィールド構造であれば frame rate を半分にして down stream に伝える	*/
-	if ( (hasTopField && ! hasBottomField) || (! hasTopField && hasBottomField) ) {
-		if (! me->priv->is_field_structure) {
-			GstVideoCodecState *oldOutputState = me->output_state;
-			GST_WARNING_OBJECT (me, "do change frame rate");
+	me->priv->resync_waiting_idr = TRUE;
 
-			oldOutputState->info.fps_d *= 2;
-			me->output_state = gst_video_decoder_set_output_state (
-				GST_VIDEO_DECODER (me), me->out_video_fmt,
-				me->out_width, me->out_height, oldOutputState);
+	GST_ELEMENT_WARNING (me, STREAM, DECODE, (NULL),
+		("decoder stalled, %u frames lost (%" GST_TIME_FORMAT " - %"
+		 GST_TIME_FORMAT "), resuming at next IDR picture",
+		 numDropped, GST_TIME_ARGS (gapStart), GST_TIME_ARGS (gapEnd)));
+
+	return TRUE;
+}
 
-			gst_video_codec_state_unref (oldOutputState);
+/* デバイスのストールからの復帰後は、次の IDR ピクチャまで入力を破棄する。
+ * 破棄した場合は TRUE を返す
+ */
+static gboolean
+gst_acm_h264_dec_resync_drop_frame(GstAcmH264Dec *me, GstVideoCodecFrame * frame)
+{
+	gboolean is_ref = FALSE;
+	gboolean is_idr = FALSE;
 
-			if (! gst_video_decoder_negotiate (GST_VIDEO_DECODER (me))) {
-				goto negotiate_failed;
-			}
+	if (! me->priv->resync_waiting_idr) {
+		return FALSE;
+	}
 
-			me->priv->is_field_structure = TRUE;
-		}
+	gst_acm_h264_dec_peek_nal_ref(me, frame->input_buffer, &is_ref, &is_idr);
+	if (is_idr) {
+		GST_INFO_OBJECT (me, "resume decoding at IDR (%u)",
+						 frame->system_frame_number);
+		me->priv->resync_waiting_idr = FALSE;
+		return FALSE;
 	}
 
-	gst_buffer_unmap (frame->input_buffer, &map_parse);
-	
+	GST_DEBUG_OBJECT (me, "drop frame until IDR (%u)",
+					  frame->system_frame_number);
+	gst_video_decoder_drop_frame (GST_VIDEO_DECODER (me), frame);
+	COUNTERS_INC (me, num_drop_resync);
 	return TRUE;
+}
 
-	/* ERRORS */
-negotiate_failed:
-	{
-		GST_ELEMENT_ERROR (me, CORE, NEGOTIATION, (NULL),
-			("failed src caps negotiate"));
+/* IDR ピクチャのみのデコードでは、IDR 以外のフレームはデバイスに入力しない。
+ * QoS のドロップではないので、DECODE_ONLY として出力せずに解放する。
+ * 破棄した場合は TRUE を返す
+ */
+static gboolean
+gst_acm_h264_dec_idr_only_skip_frame(GstAcmH264Dec *me,
+	GstVideoCodecFrame * frame)
+{
+	gboolean is_ref = FALSE;
+	gboolean is_idr = FALSE;
+#if SUPPORT_CODED_FIELD
+	GstVideoCodecFrame *first;
+#endif
+
+	if (! me->idr_only) {
+		return FALSE;
+	}
+
+#if SUPPORT_CODED_FIELD
+	/* フィールド構造の IDR ピクチャの 2番目のフィールドは、IDR の NAL では
+	 * ないが、最初のフィールドを入力している (未処理のフレームに残っている)
+	 * 場合は、対になるフィールドとして入力する
+	 */
+	if (GST_VIDEO_CODEC_FRAME_FLAG_IS_SET(frame,
+			GST_VIDEO_CODEC_FRAME_FLAG_SECOND_FIELD)) {
+		first = gst_video_decoder_get_frame (GST_VIDEO_DECODER (me),
+					me->priv->field_partner[
+						frame->system_frame_number % NUM_FIELD_PAIR]);
+		if (first) {
+			gst_video_codec_frame_unref (first);
+			return FALSE;
+		}
+	}
+#endif
+
+	gst_acm_h264_dec_peek_nal_ref(me, frame->input_buffer, &is_ref, &is_idr);
+	if (is_idr) {
 		return FALSE;
 	}
+
+	GST_LOG_OBJECT (me, "skip non-IDR frame (%u)", frame->system_frame_number);
+	GST_VIDEO_CODEC_FRAME_SET_DECODE_ONLY (frame);
+	gst_video_decoder_finish_frame (GST_VIDEO_DECODER (me), frame);
+	return TRUE;
 }
 
 static struct v4l2_buffer *get_v4l2buf_in(GstAcmH264Dec *me)
@@ -1219,8 +3027,44 @@ gst_acm_h264_dec_handle_frame (GstVideoDecoder * dec,
 	gboolean handled_inframe = FALSE;
 
 #if SUPPORT_CODED_FIELD
+	/* codec_data の無い byte-stream は、最初のフレームの SPS で判断する	*/
+	if (NULL == me->output_state && ! me->priv->is_interlaced
+		&& GST_ACMH264DEC_IN_FMT_ES == me->input_format) {
+		gboolean isInterlaced = FALSE;
+
+		if (gst_acm_h264_dec_peek_sps_interlaced(me, frame->input_buffer,
+				&isInterlaced) && isInterlaced) {
+			GST_INFO_OBJECT (me, "SPS - INTERLACED SEQUENCE");
+			me->priv->is_interlaced = TRUE;
+		}
+	}
+
 	if (me->priv->is_interlaced) {
 		gst_acm_h264_dec_parse_nal(me, frame);
+
+		/* フィールド構造かどうかを最初のフレームで決めてから、
+		 * down stream とネゴシエーションする (set_format では保留している)
+		 */
+		if (NULL == me->output_state) {
+			me->priv->is_field_structure =
+				gst_acm_h264_dec_is_single_field(frame);
+			GST_INFO_OBJECT (me, "%s structure",
+				me->priv->is_field_structure ? "field" : "frame");
+			if (! gst_acm_h264_dec_set_output_state (me)) {
+				GST_ELEMENT_ERROR (me, CORE, NEGOTIATION, (NULL),
+					("failed src caps negotiate"));
+				ret = GST_FLOW_NOT_NEGOTIATED;
+				goto out;
+			}
+		}
+	}
+	else if (NULL == me->output_state) {
+		if (! gst_acm_h264_dec_set_output_state (me)) {
+			GST_ELEMENT_ERROR (me, CORE, NEGOTIATION, (NULL),
+				("failed src caps negotiate"));
+			ret = GST_FLOW_NOT_NEGOTIATED;
+			goto out;
+		}
 	}
 #endif
 
@@ -1228,48 +3072,66 @@ gst_acm_h264_dec_handle_frame (GstVideoDecoder * dec,
 	if (! me->is_handled_1stframe) {
 		if (0 == me->spspps_size) {
 			GST_INFO_OBJECT(me, "could not insert SPS/PPS to frame");
+		}
+		else if (! gst_acm_h264_dec_prepend_spspps(me, frame)) {
+			ret = GST_FLOW_ERROR;
+			goto out;
+		}
 
-			v4l2buf_in = get_v4l2buf_in(me);
+		/* 初回の入力		*/
+		v4l2buf_in = get_v4l2buf_in(me);
 
-			ret = gst_acm_h264_dec_handle_in_frame(me, v4l2buf_in, frame->input_buffer, frame);
-			if (GST_FLOW_OK != ret) {
-				goto handle_in_failed;
-			}
-			me->priv->in_out_frame_count++;
+		ret = gst_acm_h264_dec_handle_in_frame(me, v4l2buf_in, frame->input_buffer, frame);
+		if (GST_FLOW_OK != ret) {
+			goto handle_in_failed;
 		}
-		else {
-			GstMapInfo spspps_map;
-			GstMemory *spspps_mem;
+		me->priv->in_out_frame_count++;
+		me->priv->need_spspps = FALSE;
+
+		me->is_handled_1stframe = TRUE;
+		goto out;
+	}
 
-			/* SPS/PPS の挿入 */
-			GST_INFO_OBJECT(me, "insert SPS/PPS to frame");
+	/* ストリーム途中の SPS による画像サイズの変更	*/
+	if (GST_VIDEO_CODEC_FRAME_IS_SYNC_POINT (frame)) {
+		guint width = 0;
+		guint height = 0;
 
-			spspps_mem = gst_allocator_alloc(NULL, me->spspps_size, NULL);
-			if (NULL == spspps_mem) {
-				GST_ELEMENT_ERROR(me, STREAM, DECODE, (NULL),
-					("no mem with gst_allocator_alloc()"));
+		if (gst_acm_h264_dec_peek_sps_size(me, frame->input_buffer,
+				&width, &height)
+			&& (width != me->width || height != me->height)) {
+			if (! gst_acm_h264_dec_change_resolution (me, width, height, frame)) {
 				ret = GST_FLOW_ERROR;
+				goto out;
 			}
-			gst_memory_map(spspps_mem, &spspps_map, GST_MAP_WRITE);
-			memcpy(spspps_map.data, me->spspps, me->spspps_size);
-			gst_memory_unmap(spspps_mem, &spspps_map);
-
-			frame->input_buffer = gst_buffer_make_writable(frame->input_buffer);
-			gst_buffer_prepend_memory(frame->input_buffer, spspps_mem);
+		}
+	}
 
-			/* 初回の入力		*/
-			v4l2buf_in = get_v4l2buf_in(me);
+	/* IDR ピクチャのみのデコード	*/
+	if (gst_acm_h264_dec_idr_only_skip_frame(me, frame)) {
+		goto out;
+	}
 
-			ret = gst_acm_h264_dec_handle_in_frame(me, v4l2buf_in, frame->input_buffer, frame);
-			if (GST_FLOW_OK != ret) {
-				goto handle_in_failed;
-			}
-			me->priv->in_out_frame_count++;
-		}
+	/* デバイスのストールから復帰した後は、IDR ピクチャから入力する	*/
+	if (gst_acm_h264_dec_resync_drop_frame(me, frame)) {
+		goto out;
+	}
 
-		me->is_handled_1stframe = TRUE;
+#if DO_QOS_FRAME_DROP
+	/* 間に合わないフレームは、デバイスに入力しない	*/
+	if (gst_acm_h264_dec_qos_drop_frame(me, frame)) {
 		goto out;
 	}
+#endif
+
+	/* ストリーム途中で codec_data が変わった場合は、SPS/PPS を挿入する	*/
+	if (me->priv->need_spspps && me->spspps_size > 0) {
+		if (! gst_acm_h264_dec_prepend_spspps(me, frame)) {
+			ret = GST_FLOW_ERROR;
+			goto out;
+		}
+		me->priv->need_spspps = FALSE;
+	}
 
 
 	if (me->num_inbuf_acquired < DEFAULT_NUM_BUFFERS_IN) {
@@ -1287,8 +3149,13 @@ gst_acm_h264_dec_handle_frame (GstVideoDecoder * dec,
 		FD_ZERO(&write_fds);
 		FD_SET(me->video_fd, &read_fds);
 		FD_SET(me->video_fd, &write_fds);
-		tv.tv_sec = 10;
-		tv.tv_usec = 0;
+		if (me->watchdog_frames > 0) {
+			GST_TIME_TO_TIMEVAL (gst_acm_h264_dec_watchdog_timeout(me), tv);
+		}
+		else {
+			tv.tv_sec = SELECT_TIMEOUT_SEC_HANDLE_FRAME;
+			tv.tv_usec = 0;
+		}
 		r = select(me->video_fd +1, &read_fds, &write_fds, NULL, &tv);
 
 		if (r == -1 && (errno == EINTR || errno == EAGAIN)) {
@@ -1342,6 +3209,7 @@ gst_acm_h264_dec_handle_frame (GstVideoDecoder * dec,
 				 */
 				if (0 == bytesused) {
 					GST_WARNING_OBJECT(me, "drop frame by bytesused(0)");
+					gst_acm_h264_dec_drop_unoutput_frame(me, v4l2buf_out);
 					gst_acm_v4l2_buffer_pool_qbuf(me->pool_out,
 						v4l2buf_out, gst_buffer_get_size(v4l2buf_out));
 					continue;
@@ -1380,20 +3248,285 @@ select_timeout:
 						  me->pool_out->num_buffers,
 						  me->pool_out->num_allocated,
 						  me->pool_out->num_queued);
-
-		gst_acm_v4l2_buffer_pool_log_buf_status(me->pool_out);
-		
-		log_buf_status_of_input(me);
-
+
+		gst_acm_v4l2_buffer_pool_log_buf_status(me->pool_out);
+		
+		log_buf_status_of_input(me);
+
+		if (me->watchdog_frames > 0) {
+			if (! gst_acm_h264_dec_recover_stall(me, frame)) {
+				ret = GST_FLOW_ERROR;
+				goto out;
+			}
+
+			/* 入力中のフレームが IDR ピクチャであれば、ここから再開する	*/
+			if (gst_acm_h264_dec_resync_drop_frame(me, frame)) {
+				goto out;
+			}
+			if (me->priv->need_spspps && me->spspps_size > 0) {
+				if (! gst_acm_h264_dec_prepend_spspps(me, frame)) {
+					ret = GST_FLOW_ERROR;
+					goto out;
+				}
+				me->priv->need_spspps = FALSE;
+			}
+			v4l2buf_in = get_v4l2buf_in(me);
+			ret = gst_acm_h264_dec_handle_in_frame(me, v4l2buf_in,
+					frame->input_buffer, frame);
+			if (GST_FLOW_OK != ret) {
+				goto handle_in_failed;
+			}
+			goto out;
+		}
+
+		GST_ELEMENT_ERROR (me, STREAM, DECODE, (NULL),
+			("timeout with select()"));
+		ret = GST_FLOW_ERROR;
+		goto out;
+	}
+dqbuf_failed:
+	{
+		GST_ELEMENT_ERROR (me, STREAM, DECODE, (NULL),
+			("could not dequeue buffer. %d (%s)", errno, g_strerror (errno)));
+		ret = GST_FLOW_ERROR;
+		goto out;
+	}
+handle_in_failed:
+	{
+		GST_ELEMENT_ERROR (me, STREAM, DECODE, (NULL),
+			("failed handle in"));
+		ret = GST_FLOW_ERROR;
+		goto out;
+	}
+handle_out_failed:
+	{
+		if (GST_FLOW_NOT_LINKED == ret || GST_FLOW_FLUSHING == ret) {
+			GST_WARNING_OBJECT (me, "failed handle out - not link or flushing");
+			goto out;
+		}
+
+		GST_ELEMENT_ERROR (me, STREAM, DECODE, (NULL),
+			("failed handle out"));
+		ret = GST_FLOW_ERROR;
+		goto out;
+	}
+}
+
+/* EOS の NAL を enqueue して、デバイス側に溜まっているデータを取り出し、
+ * down stream へ流す。
+ * pending には、まだデバイスへ入力していないフレームを指定する (NULL 可)。
+ * このフレームまで取り出したら、終了する
+ */
+static GstFlowReturn
+gst_acm_h264_dec_drain (GstAcmH264Dec * me, GstVideoCodecFrame * pending)
+{
+	GstFlowReturn ret = GST_FLOW_OK;
+	GstBuffer* eosBuffer = NULL;
+	int r = 0;
+	fd_set read_fds;
+	fd_set write_fds;
+	struct timeval tv;
+	gboolean isEOS = FALSE;
+	GstVideoCodecFrame *frame = NULL;
+	GstMapInfo map;
+	GstBuffer *v4l2buf_out = NULL;
+	struct v4l2_buffer* v4l2buf_in = NULL;
+	guint32 bytesused = 0;
+
+	/* EOS の際は、0x00, 0x00, 0x00, 0x01, 0x0B を enqueue する */
+	GST_INFO_OBJECT(me, "Enqueue EOS buffer.");
+	
+	eosBuffer = gst_buffer_new_allocate(NULL, 5, NULL);
+	gst_buffer_map (eosBuffer, &map, GST_MAP_READ);
+	
+	map.data[0] = 0x00;
+	map.data[1] = 0x00;
+	map.data[2] = 0x00;
+	map.data[3] = 0x01;
+	map.data[4] = 0x0B;
+	
+	gst_buffer_unmap (eosBuffer, &map);
+	
+	do {
+		FD_ZERO(&write_fds);
+		FD_SET(me->video_fd, &write_fds);
+		tv.tv_sec = 0;
+		tv.tv_usec = SELECT_TIMEOUT_MSEC * 1000;
+		r = select(me->video_fd + 1, NULL, &write_fds, NULL, &tv);
+		GST_DEBUG_OBJECT(me, "After select for write. r=%d", r);
+	} while (r == -1 && (errno == EINTR || errno == EAGAIN));
+	if (r > 0 /* && FD_ISSET(me->video_fd, &write_fds) */) {
+		v4l2buf_in = &(me->priv->input_vbuffer[0]);
+		memset (v4l2buf_in, 0x00, sizeof (struct v4l2_buffer));
+		v4l2buf_in->type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+		v4l2buf_in->memory = V4L2_MEMORY_USERPTR;
+		r = gst_acm_v4l2_ioctl (me->video_fd, VIDIOC_DQBUF, v4l2buf_in);
+		if (r < 0) {
+			goto dqbuf_failed;
+		}
+
+		ret = gst_acm_h264_dec_handle_in_frame(me, v4l2buf_in, eosBuffer, NULL);
+		
+		if (GST_FLOW_OK != ret) {
+			goto handle_in_failed;
+		}
+	}
+	else if (r < 0) {
+		goto select_failed;
+	}
+	else if (0 == r) {
+		/* timeoutしたらエラー	*/
+		GST_INFO_OBJECT(me, "select() eos buf timeout");
+		goto select_timeout;
+	}
+
+	/* デバイス側に溜まっているデータを取り出して、down stream へ流す	*/
+	GST_INFO_OBJECT(me, "in_out_frame_count : %d",
+					me->priv->in_out_frame_count);
+	while (NULL != (frame = gst_video_decoder_get_oldest_frame(
+								GST_VIDEO_DECODER (me)))) {
+		gst_video_codec_frame_unref(frame);
+		if (frame == pending) {
+			break;
+		}
+
+		do {
+			do {
+				FD_ZERO(&read_fds);
+				FD_SET(me->video_fd, &read_fds);
+				tv.tv_sec = 0;
+				tv.tv_usec = SELECT_TIMEOUT_MSEC * 1000;
+				r = select(me->video_fd + 1, &read_fds, NULL, NULL, &tv);
+				GST_DEBUG_OBJECT(me, "After select for read. r=%d", r);
+			} while (r == -1 && (errno == EINTR || errno == EAGAIN));
+			if (r < 0) {
+				goto select_failed;
+			}
+			else if (0 == r) {
+				/* timeoutしたらエラー	*/
+				GST_INFO_OBJECT(me, "select() for output is timeout");
+				goto select_timeout;
+			}
+
+			/* dequeue buffer	*/
+			ret = gst_acm_v4l2_buffer_pool_dqbuf_ex (me->pool_out,
+					&v4l2buf_out, &bytesused);
+			if (GST_FLOW_OK != ret) {
+				if (GST_FLOW_DQBUF_EAGAIN == ret) {
+//					GST_WARNING_OBJECT (me, "DQBUF_EAGAIN after EOS");
+					ret = GST_FLOW_OK;
+					break;
+				}
+				
+				GST_ERROR_OBJECT (me, "gst_acm_v4l2_buffer_pool_dqbuf() returns %s",
+								  gst_flow_get_name (ret));
+				goto dqbuf_failed;
+			}
+
+			/* H.264のMMCO(Memory Management Control Operation)の機能で、
+			 * DPB(Decoded Picture Buffer)から削除される場合がある。
+			 * この際、出力不可フラグが設定され、bytesused がゼロになる。
+			 * この出力は、down stream に流さず、無視する。
+			 */
+			if (0 == bytesused) {
+				GST_WARNING_OBJECT(me, "drop frame(3) by bytesused(0) at %d",
+					frame->system_frame_number);
+				gst_acm_h264_dec_drop_unoutput_frame(me, v4l2buf_out);
+				gst_acm_v4l2_buffer_pool_qbuf(me->pool_out,
+					v4l2buf_out, gst_buffer_get_size(v4l2buf_out));
+				
+				continue;
+			}
+
+			me->priv->in_out_frame_count--;
+			ret = gst_acm_h264_dec_handle_out_frame(me, v4l2buf_out, &isEOS);
+			if (GST_FLOW_OK != ret) {
+				goto handle_out_failed;
+			}
+			if (isEOS) {
+				break;
+			}
+		} while (FALSE);
+	}
+
+	/* Seek した場合に、m2mデバイス側にデコード済みデータが残ってしまい、
+	 * これを取り出しきらないと、クリーンアップ時、VIDIOC_STREAMOFF が 
+	 * timeout でエラーしてしまう。
+	 */
+	GST_INFO_OBJECT(me, "in_out_frame_count : %d",
+					me->priv->in_out_frame_count);
+	while (
+		   me->priv->in_out_frame_count > 0
+		   ) {
+		do {
+			FD_ZERO(&read_fds);
+			FD_SET(me->video_fd, &read_fds);
+			tv.tv_sec = 0;
+			tv.tv_usec = SELECT_TIMEOUT_MSEC * 1000;
+			r = select(me->video_fd + 1, &read_fds, NULL, NULL, &tv);
+			GST_DEBUG_OBJECT(me, "After select for read(EOS). r=%d", r);
+		} while (r == -1 && (errno == EINTR || errno == EAGAIN));
+		if (r > 0 /* && FD_ISSET(me->video_fd, &read_fds) */) {
+			ret = gst_acm_v4l2_buffer_pool_dqbuf (me->pool_out, &v4l2buf_out);
+			if (GST_FLOW_OK != ret) {
+				goto dqbuf_failed;
+			}
+			ret = gst_acm_v4l2_buffer_pool_qbuf(me->pool_out, v4l2buf_out,
+					gst_buffer_get_size(v4l2buf_out));
+			if (GST_FLOW_OK != ret) {
+				goto qbuf_failed;
+			}
+			me->priv->in_out_frame_count--;
+		}
+		else if (r < 0) {
+			goto select_failed;
+		}
+		else if (0 == r) {
+			/* timeoutしたらエラー	*/
+			GST_INFO_OBJECT(me, "select() out timeout");
+			goto select_timeout;
+		}
+	}
+
+out:
+	if(eosBuffer)
+		gst_buffer_unref(eosBuffer);
+	return ret;
+	
+	/* ERRORS */
+select_failed:
+	{
+		GST_ELEMENT_ERROR (me, STREAM, DECODE, (NULL),
+			("error with select() %d (%s)", errno, g_strerror (errno)));
+		ret = GST_FLOW_ERROR;
+		goto out;
+	}
+select_timeout:
+	{
+		GST_ERROR_OBJECT (me, "pool_out - buffers:%d, allocated:%d, queued:%d",
+						  me->pool_out->num_buffers,
+						  me->pool_out->num_allocated,
+						  me->pool_out->num_queued);
+		if (me->watchdog_frames > 0) {
+			/* 取り出せなかったフレームは破棄して、続行する	*/
+			ret = gst_acm_h264_dec_recover_stall(me, pending)
+				? GST_FLOW_OK : GST_FLOW_ERROR;
+			goto out;
+		}
 		GST_ELEMENT_ERROR (me, STREAM, DECODE, (NULL),
 			("timeout with select()"));
 		ret = GST_FLOW_ERROR;
 		goto out;
 	}
-dqbuf_failed:
+handle_out_failed:
 	{
+		if (GST_FLOW_NOT_LINKED == ret || GST_FLOW_FLUSHING == ret) {
+			GST_WARNING_OBJECT (me, "failed handle out - not link or flushing");
+			goto out;
+		}
+
 		GST_ELEMENT_ERROR (me, STREAM, DECODE, (NULL),
-			("could not dequeue buffer. %d (%s)", errno, g_strerror (errno)));
+			("failed handle out"));
 		ret = GST_FLOW_ERROR;
 		goto out;
 	}
@@ -1404,15 +3537,17 @@ handle_in_failed:
 		ret = GST_FLOW_ERROR;
 		goto out;
 	}
-handle_out_failed:
+qbuf_failed:
 	{
-		if (GST_FLOW_NOT_LINKED == ret || GST_FLOW_FLUSHING == ret) {
-			GST_WARNING_OBJECT (me, "failed handle out - not link or flushing");
-			goto out;
-		}
-
 		GST_ELEMENT_ERROR (me, STREAM, DECODE, (NULL),
-			("failed handle out"));
+			("could not queue buffer. %d (%s)", errno, g_strerror (errno)));
+		ret = GST_FLOW_ERROR;
+	   goto out;
+	}
+dqbuf_failed:
+	{
+		GST_ELEMENT_ERROR (me, STREAM, DECODE, (NULL),
+			("could not dequeue buffer. %d (%s)", errno, g_strerror (errno)));
 		ret = GST_FLOW_ERROR;
 		goto out;
 	}
@@ -1423,7 +3558,6 @@ gst_acm_h264_dec_sink_event (GstVideoDecoder * dec, GstEvent *event)
 {
 	GstAcmH264Dec *me = GST_ACMH264DEC (dec);
 	gboolean ret = FALSE;
-	GstBuffer* eosBuffer = NULL;
 
 	GST_DEBUG_OBJECT (me, "RECEIVED EVENT (%d)", GST_EVENT_TYPE(event));
 	switch (GST_EVENT_TYPE(event)) {
@@ -1440,167 +3574,15 @@ gst_acm_h264_dec_sink_event (GstVideoDecoder * dec, GstEvent *event)
 	}
 	case GST_EVENT_EOS:
 	{
-		int r = 0;
-		fd_set read_fds;
-		fd_set write_fds;
-		struct timeval tv;
-		gboolean isEOS = FALSE;
-		GstVideoCodecFrame *frame = NULL;
-		GstMapInfo map;
-		GstBuffer *v4l2buf_out = NULL;
-		struct v4l2_buffer* v4l2buf_in = NULL;
-		guint32 bytesused = 0;
+		GstFlowReturn flowRet;
 
 		GST_INFO_OBJECT (me, "H264DEC received GST_EVENT_EOS");
 
-		/* EOS の際は、0x00, 0x00, 0x00, 0x01, 0x0B を enqueue する */
-		GST_INFO_OBJECT(me, "Enqueue EOS buffer.");
-		
-		eosBuffer = gst_buffer_new_allocate(NULL, 5, NULL);
-		gst_buffer_map (eosBuffer, &map, GST_MAP_READ);
-		
-		map.data[0] = 0x00;
-		map.data[1] = 0x00;
-		map.data[2] = 0x00;
-		map.data[3] = 0x01;
-		map.data[4] = 0x0B;
-		
-		gst_buffer_unmap (eosBuffer, &map);
-		
-		do {
-			FD_ZERO(&write_fds);
-			FD_SET(me->video_fd, &write_fds);
-			tv.tv_sec = 0;
-			tv.tv_usec = SELECT_TIMEOUT_MSEC * 1000;
-			r = select(me->video_fd + 1, NULL, &write_fds, NULL, &tv);
-			GST_DEBUG_OBJECT(me, "After select for write. r=%d", r);
-		} while (r == -1 && (errno == EINTR || errno == EAGAIN));
-		if (r > 0 /* && FD_ISSET(me->video_fd, &write_fds) */) {
-			v4l2buf_in = &(me->priv->input_vbuffer[0]);
-			memset (v4l2buf_in, 0x00, sizeof (struct v4l2_buffer));
-			v4l2buf_in->type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
-			v4l2buf_in->memory = V4L2_MEMORY_USERPTR;
-			r = gst_acm_v4l2_ioctl (me->video_fd, VIDIOC_DQBUF, v4l2buf_in);
-			if (r < 0) {
-				goto dqbuf_failed;
-			}
-
-			ret = gst_acm_h264_dec_handle_in_frame(me, v4l2buf_in, eosBuffer, NULL);
-			
-			if (GST_FLOW_OK != ret) {
-				goto handle_in_failed;
-			}
-		}
-		else if (r < 0) {
-			goto select_failed;
-		}
-		else if (0 == r) {
-			/* timeoutしたらエラー	*/
-			GST_INFO_OBJECT(me, "select() eos buf timeout");
-			goto select_timeout;
-		}
-
-		/* デバイス側に溜まっているデータを取り出して、down stream へ流す	*/
-		GST_INFO_OBJECT(me, "in_out_frame_count : %d",
-						me->priv->in_out_frame_count);
-		while (NULL != (frame = gst_video_decoder_get_oldest_frame(
-									GST_VIDEO_DECODER (me)))) {
-			gst_video_codec_frame_unref(frame);
-
-			do {
-				do {
-					FD_ZERO(&read_fds);
-					FD_SET(me->video_fd, &read_fds);
-					tv.tv_sec = 0;
-					tv.tv_usec = SELECT_TIMEOUT_MSEC * 1000;
-					r = select(me->video_fd + 1, &read_fds, NULL, NULL, &tv);
-					GST_DEBUG_OBJECT(me, "After select for read. r=%d", r);
-				} while (r == -1 && (errno == EINTR || errno == EAGAIN));
-				if (r < 0) {
-					goto select_failed;
-				}
-				else if (0 == r) {
-					/* timeoutしたらエラー	*/
-					GST_INFO_OBJECT(me, "select() for output is timeout");
-					goto select_timeout;
-				}
-
-				/* dequeue buffer	*/
-				ret = gst_acm_v4l2_buffer_pool_dqbuf_ex (me->pool_out,
-						&v4l2buf_out, &bytesused);
-				if (GST_FLOW_OK != ret) {
-					if (GST_FLOW_DQBUF_EAGAIN == ret) {
-//						GST_WARNING_OBJECT (me, "DQBUF_EAGAIN after EOS");
-						break;
-					}
-					
-					GST_ERROR_OBJECT (me, "gst_acm_v4l2_buffer_pool_dqbuf() returns %s",
-									  gst_flow_get_name (ret));
-					goto dqbuf_failed;
-				}
-
-				/* H.264のMMCO(Memory Management Control Operation)の機能で、
-				 * DPB(Decoded Picture Buffer)から削除される場合がある。
-				 * この際、出力不可フラグが設定され、bytesused がゼロになる。
-				 * この出力は、down stream に流さず、無視する。
-				 */
-				if (0 == bytesused) {
-					GST_WARNING_OBJECT(me, "drop frame(3) by bytesused(0) at %d",
-						frame->system_frame_number);
-					gst_acm_v4l2_buffer_pool_qbuf(me->pool_out,
-						v4l2buf_out, gst_buffer_get_size(v4l2buf_out));
-					
-					continue;
-				}
-
-				me->priv->in_out_frame_count--;
-				ret = gst_acm_h264_dec_handle_out_frame(me, v4l2buf_out, &isEOS);
-				if (GST_FLOW_OK != ret) {
-					goto handle_out_failed;
-				}
-				if (isEOS) {
-					break;
-				}
-			} while (FALSE);
-		}
-
-		/* Seek した場合に、m2mデバイス側にデコード済みデータが残ってしまい、
-		 * これを取り出しきらないと、クリーンアップ時、VIDIOC_STREAMOFF が 
-		 * timeout でエラーしてしまう。
-		 */
-		GST_INFO_OBJECT(me, "in_out_frame_count : %d",
-						me->priv->in_out_frame_count);
-		while (
-			   me->priv->in_out_frame_count > 0
-			   ) {
-			do {
-				FD_ZERO(&read_fds);
-				FD_SET(me->video_fd, &read_fds);
-				tv.tv_sec = 0;
-				tv.tv_usec = SELECT_TIMEOUT_MSEC * 1000;
-				r = select(me->video_fd + 1, &read_fds, NULL, NULL, &tv);
-				GST_DEBUG_OBJECT(me, "After select for read(EOS). r=%d", r);
-			} while (r == -1 && (errno == EINTR || errno == EAGAIN));
-			if (r > 0 /* && FD_ISSET(me->video_fd, &read_fds) */) {
-				ret = gst_acm_v4l2_buffer_pool_dqbuf (me->pool_out, &v4l2buf_out);
-				if (GST_FLOW_OK != ret) {
-					goto dqbuf_failed;
-				}
-				ret = gst_acm_v4l2_buffer_pool_qbuf(me->pool_out, v4l2buf_out,
-						gst_buffer_get_size(v4l2buf_out));
-				if (GST_FLOW_OK != ret) {
-					goto qbuf_failed;
-				}
-				me->priv->in_out_frame_count--;
-			}
-			else if (r < 0) {
-				goto select_failed;
-			}
-			else if (0 == r) {
-				/* timeoutしたらエラー	*/
-				GST_INFO_OBJECT(me, "select() out timeout");
-				goto select_timeout;
-			}
+		flowRet = gst_acm_h264_dec_drain (me, NULL);
+		if (GST_FLOW_ERROR == flowRet) {
+			gst_event_unref (event);
+			ret = FALSE;
+			break;
 		}
 
 		ret = GST_VIDEO_DECODER_CLASS (parent_class)->sink_event(dec, event);
@@ -1617,61 +3599,154 @@ gst_acm_h264_dec_sink_event (GstVideoDecoder * dec, GstEvent *event)
 		break;
 	}
 	
-out:
-	if(eosBuffer)
-		gst_buffer_unref(eosBuffer);
 	return ret;
-	
-select_failed:
-	{
-		GST_ELEMENT_ERROR (me, STREAM, DECODE, (NULL),
-			("error with select() %d (%s)", errno, g_strerror (errno)));
-		ret = FALSE;
-		goto out;
+}
+
+/* 出力フォーマットから、出力バッファサイズ、ストライド、オフセットを求める	*/
+static void
+gst_acm_h264_dec_get_out_geometry (GstAcmH264Dec * me, guint *out_frame_size,
+	guint *bytesperline, guint *offset)
+{
+	GstVideoInfo info;
+
+	/* ストライド、オフセット
+	 * (YUV420 の bytesperline / offset は、ドライバの仕様で 2 バイト単位)
+	 */
+	switch (me->output_format) {
+	case GST_ACMH264DEC_OUT_FMT_YUV420:
+		*bytesperline = me->frame_stride * 2;
+		*offset = (me->frame_y_offset * *bytesperline) + (me->frame_x_offset * 2);
+		break;
+	case GST_ACMH264DEC_OUT_FMT_RGB32:
+		*bytesperline = me->frame_stride * 4;
+		*offset = (me->frame_y_offset * *bytesperline) + (me->frame_x_offset * 4);
+		break;
+	case GST_ACMH264DEC_OUT_FMT_RGB24:
+		*bytesperline = me->frame_stride * 3;
+		*offset = (me->frame_y_offset * *bytesperline) + (me->frame_x_offset * 3);
+		break;
+	case GST_ACMH264DEC_OUT_FMT_RGB565:
+		*bytesperline = me->frame_stride * 2;
+		*offset = (me->frame_y_offset * *bytesperline) + (me->frame_x_offset * 2);
+		break;
+	default:
+		g_assert_not_reached ();
+		break;
 	}
-select_timeout:
-	{
-		GST_ERROR_OBJECT (me, "pool_out - buffers:%d, allocated:%d, queued:%d",
-						  me->pool_out->num_buffers,
-						  me->pool_out->num_allocated,
-						  me->pool_out->num_queued);
+
+	/* 出力バッファサイズ
+	 * ストライド幅と、y_offset を含めた行数で、出力フォーマットの
+	 * フレームサイズを求める (x_offset はストライド幅に含まれる)。
+	 * NV12 は stride * rows * 3 / 2 になる。
+	 * 画像サイズが変わった場合は、CAPTURE 側のプールごと作り直す
+	 */
+	gst_video_info_init (&info);
+	gst_video_info_set_format (&info, me->out_video_fmt,
+		me->frame_stride, me->frame_y_offset + me->out_height);
+	*out_frame_size = GST_VIDEO_INFO_SIZE (&info);
+}
+
+/* Set format for capture (decoder output)
+ * ドライバが、より大きい sizeimage を返した場合は、out_frame_size を
+ * その値で更新する
+ */
+static gboolean
+gst_acm_h264_dec_set_capture_format (GstAcmH264Dec * me,
+	guint bytesperline, guint offset, guint *out_frame_size)
+{
+	struct v4l2_format fmt;
+	int r;
+
+	memset (&fmt, 0, sizeof (struct v4l2_format));
+	fmt.type			= V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	fmt.fmt.pix.width	= me->out_width;
+	fmt.fmt.pix.height	= me->out_height;
+	fmt.fmt.pix.pixelformat = me->output_format;
+	fmt.fmt.pix.field	= V4L2_FIELD_NONE;
+	fmt.fmt.pix.bytesperline = bytesperline;
+	fmt.fmt.pix.priv	= offset;
+
+	r = gst_acm_v4l2_ioctl(me->video_fd, VIDIOC_S_FMT, &fmt);
+	if (r < 0) {
 		GST_ELEMENT_ERROR (me, STREAM, DECODE, (NULL),
-			("timeout with select()"));
-		ret = FALSE;
-		goto out;
+			("Failed to set decoder init param.(%s)", g_strerror (errno)));
+		return FALSE;
 	}
-handle_out_failed:
-	{
-		if (GST_FLOW_NOT_LINKED == ret || GST_FLOW_FLUSHING == ret) {
-			GST_WARNING_OBJECT (me, "failed handle out - not link or flushing");
-			goto out;
-		}
 
-		GST_ELEMENT_ERROR (me, STREAM, DECODE, (NULL),
-			("failed handle out"));
-		ret = FALSE;
-		goto out;
+	/* ドライバが必要とするバッファサイズ	*/
+	memset (&fmt, 0, sizeof (struct v4l2_format));
+	fmt.type			= V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	r = gst_acm_v4l2_ioctl(me->video_fd, VIDIOC_G_FMT, &fmt);
+	if (r < 0) {
+		GST_WARNING_OBJECT (me, "Failed G_FMT (%s)", g_strerror (errno));
 	}
-handle_in_failed:
-	{
-		GST_ELEMENT_ERROR (me, STREAM, DECODE, (NULL),
-			("failed handle in"));
-		ret = FALSE;
-		goto out;
+	else if (fmt.fmt.pix.sizeimage > *out_frame_size) {
+		GST_INFO_OBJECT (me, "sizeimage from driver:%u (calculated:%u)",
+						 fmt.fmt.pix.sizeimage, *out_frame_size);
+		*out_frame_size = fmt.fmt.pix.sizeimage;
 	}
-qbuf_failed:
-	{
-		GST_ELEMENT_ERROR (me, STREAM, DECODE, (NULL),
-			("could not queue buffer. %d (%s)", errno, g_strerror (errno)));
-		ret = FALSE;
-	   goto out;
+
+	return TRUE;
+}
+
+/* CAPTURE 側のバッファプールを生成して、activate する	*/
+static gboolean
+gst_acm_h264_dec_setup_pool_out (GstAcmH264Dec * me, guint out_frame_size)
+{
+	GstCaps *srcCaps;
+	GstAcmV4l2InitParam v4l2InitParam;
+	gint i = 0;
+
+	if (NULL == me->pool_out) {
+		memset(&v4l2InitParam, 0, sizeof(GstAcmV4l2InitParam));
+		if (me->priv->using_fb_dmabuf) {
+			v4l2InitParam.video_fd = me->video_fd;
+			v4l2InitParam.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+			v4l2InitParam.mode = GST_ACM_V4L2_IO_DMABUF;
+			v4l2InitParam.sizeimage = out_frame_size;
+			v4l2InitParam.init_num_buffers = DEFAULT_NUM_BUFFERS_OUT_DMABUF;
+			
+			v4l2InitParam.num_fb_dmabuf = me->priv->num_fb_dmabuf;
+			for (i = 0; i < me->priv->num_fb_dmabuf; i++) {
+				v4l2InitParam.fb_dmabuf_index[i] = me->priv->fb_dmabuf_index[i];
+				v4l2InitParam.fb_dmabuf_fd[i] = me->priv->fb_dmabuf_fd[i];
+			}
+		}
+		else {
+			v4l2InitParam.video_fd = me->video_fd;
+			v4l2InitParam.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+			v4l2InitParam.mode = GST_ACM_V4L2_IO_MMAP;
+			v4l2InitParam.sizeimage = out_frame_size;
+			v4l2InitParam.init_num_buffers = DEFAULT_NUM_BUFFERS_OUT;
+		}
+		srcCaps = gst_caps_from_string ("video/x-raw");
+		me->pool_out = gst_acm_v4l2_buffer_pool_new(&v4l2InitParam, srcCaps);
+		gst_caps_unref(srcCaps);
+		if (! me->pool_out) {
+			goto buffer_pool_new_failed;
+		}
+		if (1 == me->pool_out->num_buffers) {
+			/* バッファが 1つしか確保できない場合は動作しない */
+			goto buffer_pool_new_failed;
+		}
 	}
-dqbuf_failed:
+	
+	/* and activate */
+	gst_buffer_pool_set_active (GST_BUFFER_POOL_CAST(me->pool_out), TRUE);
+
+	GST_INFO_OBJECT (me, "pool_out - buffers:%d, allocated:%d, queued:%d",
+					  me->pool_out->num_buffers,
+					  me->pool_out->num_allocated,
+					  me->pool_out->num_queued);
+
+	return TRUE;
+
+	/* ERRORS */
+buffer_pool_new_failed:
 	{
 		GST_ELEMENT_ERROR (me, STREAM, DECODE, (NULL),
-			("could not dequeue buffer. %d (%s)", errno, g_strerror (errno)));
-		ret = FALSE;
-		goto out;
+			("Could not map buffers from device '%s'", me->videodev));
+		return FALSE;
 	}
 }
 
@@ -1681,69 +3756,26 @@ gst_acm_h264_dec_init_decoder (GstAcmH264Dec * me)
 	gboolean ret = TRUE;
 	enum v4l2_buf_type type;
 	int r;
-	GstCaps *srcCaps;
-	GstAcmV4l2InitParam v4l2InitParam;
 	struct v4l2_format fmt;
 	struct v4l2_control ctrl;
 	gint i = 0;
 	guint bytesperline = 0;
 	guint offset = 0;
+	guint out_frame_size = 0;
 
 	GST_INFO_OBJECT (me, "H264DEC INITIALIZE ACM DECODER...");
 
-	/* 入力バッファサイズ	*/
-	guint in_frame_size = me->width * me->height * 3;
-	/* 出力バッファサイズ
-	 * 再生途中で表示画像サイズを変えられる事を考慮し、出力画像サイズではなく、
-	 * 入力画像の画素数を元に計算する
+	/* 出力バッファサイズ、ストライド、オフセット
+	 * (入力側は USERPTR で、up stream のバッファをそのまま enqueue するので、
+	 * バッファの確保は行わない)
 	 */
-	guint out_frame_size = 0;
-	switch (me->output_format) {
-	case GST_ACMH264DEC_OUT_FMT_YUV420:
-		out_frame_size = me->width * me->height * 2;
-		break;
-	case GST_ACMH264DEC_OUT_FMT_RGB32:
-		out_frame_size = me->width * me->height * 4;
-		break;
-	case GST_ACMH264DEC_OUT_FMT_RGB24:
-		out_frame_size = me->width * me->height * 3;
-		break;
-	case GST_ACMH264DEC_OUT_FMT_RGB565:
-		out_frame_size = me->width * me->height * 2;
-		break;
-	default:
-		g_assert_not_reached ();
-		break;
-	}
-	GST_INFO_OBJECT (me, "in_frame_size:%u, out_frame_size:%u",
-					 in_frame_size, out_frame_size);
-
-	/* ストライド、オフセット	*/
-	switch (me->output_format) {
-	case GST_ACMH264DEC_OUT_FMT_YUV420:
-		bytesperline = me->frame_stride * 2;
-		offset = (me->frame_y_offset * bytesperline) + (me->frame_x_offset * 2);
-		break;
-	case GST_ACMH264DEC_OUT_FMT_RGB32:
-		bytesperline = me->frame_stride * 4;
-		offset = (me->frame_y_offset * bytesperline) + (me->frame_x_offset * 4);
-		break;
-	case GST_ACMH264DEC_OUT_FMT_RGB24:
-		bytesperline = me->frame_stride * 3;
-		offset = (me->frame_y_offset * bytesperline) + (me->frame_x_offset * 3);
-		break;
-	case GST_ACMH264DEC_OUT_FMT_RGB565:
-		bytesperline = me->frame_stride * 2;
-		offset = (me->frame_y_offset * bytesperline) + (me->frame_x_offset * 2);
-		break;
-	default:
-		g_assert_not_reached ();
-		break;
-	}
+	gst_acm_h264_dec_get_out_geometry (me, &out_frame_size, &bytesperline, &offset);
+	GST_INFO_OBJECT (me, "out_frame_size:%u", out_frame_size);
 
 	/* デコード初期化パラメータセット		*/
 	GST_INFO_OBJECT (me, "H264DEC INIT PARAM:");
-	GST_INFO_OBJECT (me, " buffering_pic_cnt:%u", me->buffering_pic_cnt);
+	GST_INFO_OBJECT (me, " buffering_pic_cnt:%u",
+					 gst_acm_h264_dec_get_buffering_pic_cnt (me));
 	GST_INFO_OBJECT (me, " enable_vio6:%u", me->enable_vio6);
 	GST_INFO_OBJECT (me, " frame_rate:%u", me->frame_rate);
 	GST_INFO_OBJECT (me, " x_pic_size:%u", me->width);
@@ -1761,7 +3793,7 @@ gst_acm_h264_dec_init_decoder (GstAcmH264Dec * me)
 					 GST_FOURCC_ARGS (me->output_format));
 	/* buffering_pic_cnt */
 	ctrl.id = V4L2_CID_NR_BUFFERING_PICS;
-	ctrl.value = me->buffering_pic_cnt;
+	ctrl.value = gst_acm_h264_dec_get_buffering_pic_cnt (me);
 	r = gst_acm_v4l2_ioctl(me->video_fd, VIDIOC_S_CTRL, &ctrl);
 	if (r < 0) {
 		goto set_init_param_failed;
@@ -1796,17 +3828,10 @@ gst_acm_h264_dec_init_decoder (GstAcmH264Dec * me)
 	}
 
 	/* Set format for capture (decoder output) */
-	fmt.type			= V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	fmt.fmt.pix.width	= me->out_width;
-	fmt.fmt.pix.height	= me->out_height;
-	fmt.fmt.pix.pixelformat = me->output_format;
-	fmt.fmt.pix.field	= V4L2_FIELD_NONE;
-	fmt.fmt.pix.bytesperline = bytesperline;
-	fmt.fmt.pix.priv	= offset;
-
-	r = gst_acm_v4l2_ioctl(me->video_fd, VIDIOC_S_FMT, &fmt);
-	if (r < 0) {
-		goto set_init_param_failed;
+	if (! gst_acm_h264_dec_set_capture_format (me, bytesperline, offset,
+			&out_frame_size)) {
+		ret = FALSE;
+		goto out;
 	}
 
 	/* バッファプールのセットアップ	*/
@@ -1854,48 +3879,11 @@ gst_acm_h264_dec_init_decoder (GstAcmH264Dec * me)
 		}
 	}
 	
-	if (NULL == me->pool_out) {
-		memset(&v4l2InitParam, 0, sizeof(GstAcmV4l2InitParam));
-		if (me->priv->using_fb_dmabuf) {
-			v4l2InitParam.video_fd = me->video_fd;
-			v4l2InitParam.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-			v4l2InitParam.mode = GST_ACM_V4L2_IO_DMABUF;
-			v4l2InitParam.sizeimage = out_frame_size;
-			v4l2InitParam.init_num_buffers = DEFAULT_NUM_BUFFERS_OUT_DMABUF;
-			
-			v4l2InitParam.num_fb_dmabuf = me->priv->num_fb_dmabuf;
-			for (i = 0; i < me->priv->num_fb_dmabuf; i++) {
-				v4l2InitParam.fb_dmabuf_index[i] = me->priv->fb_dmabuf_index[i];
-				v4l2InitParam.fb_dmabuf_fd[i] = me->priv->fb_dmabuf_fd[i];
-			}
-		}
-		else {
-			v4l2InitParam.video_fd = me->video_fd;
-			v4l2InitParam.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-			v4l2InitParam.mode = GST_ACM_V4L2_IO_MMAP;
-			v4l2InitParam.sizeimage = out_frame_size;
-			v4l2InitParam.init_num_buffers = DEFAULT_NUM_BUFFERS_OUT;
-		}
-		srcCaps = gst_caps_from_string ("video/x-raw");
-		me->pool_out = gst_acm_v4l2_buffer_pool_new(&v4l2InitParam, srcCaps);
-		gst_caps_unref(srcCaps);
-		if (! me->pool_out) {
-			goto buffer_pool_new_failed;
-		}
-		if (1 == me->pool_out->num_buffers) {
-			/* バッファが 1つしか確保できない場合は動作しない */
-			goto buffer_pool_new_failed;
-		}
+	if (! gst_acm_h264_dec_setup_pool_out (me, out_frame_size)) {
+		ret = FALSE;
+		goto out;
 	}
 	
-	/* and activate */
-	gst_buffer_pool_set_active (GST_BUFFER_POOL_CAST(me->pool_out), TRUE);
-
-	GST_INFO_OBJECT (me, "pool_out - buffers:%d, allocated:%d, queued:%d",
-					  me->pool_out->num_buffers,
-					  me->pool_out->num_allocated,
-					  me->pool_out->num_queued);
-	
 	/* STREAMON */
 	GST_INFO_OBJECT (me, "H264DEC STREAMON");
 	type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
@@ -1938,19 +3926,140 @@ querybuf_failed:
 		ret = FALSE;
 		goto out;
 	}
-buffer_pool_new_failed:
+start_failed:
 	{
 		GST_ELEMENT_ERROR (me, STREAM, DECODE, (NULL),
-			("Could not map buffers from device '%s'", me->videodev));
+			("error with STREAMON %d (%s)", errno, g_strerror (errno)));
 		ret = FALSE;
 		goto out;
 	}
+}
+
+/* down stream へ出力するフォーマットを設定して、ネゴシエーションする	*/
+static gboolean
+gst_acm_h264_dec_set_output_state (GstAcmH264Dec * me)
+{
+	GstVideoCodecState *oldOutputState = me->output_state;
+	GstStructure *structure;
+
+	me->output_state = gst_video_decoder_set_output_state (GST_VIDEO_DECODER (me),
+		me->out_video_fmt, me->out_width, me->out_height, me->input_state);
+	if (oldOutputState) {
+		gst_video_codec_state_unref (oldOutputState);
+	}
+#if SUPPORT_CODED_FIELD
+	if (me->priv->is_interlaced) {
+		/* フレーム構造 (MBAFF を含む) では、プログレッシブのフレームも
+		 * 混在するので、インタレースかどうかはバッファのフラグで示す
+		 */
+		me->output_state->info.interlace_mode =
+			GST_VIDEO_INTERLACE_MODE_MIXED;
+		/* フィールド構造では、入力の 2 フィールドを 1 フレームにして出力する
+		 * (up stream の frame rate は、フィールド単位のバッファ数)
+		 */
+		if (me->priv->is_field_structure) {
+			me->output_state->info.fps_d *= 2;
+		}
+	}
+#endif
+	if (G_UNLIKELY (me->output_state->caps == NULL))
+		me->output_state->caps = gst_video_info_to_caps (&(me->output_state->info));
+	structure = gst_caps_get_structure (me->output_state->caps, 0);
+	gst_structure_set (structure,
+					   "stride", G_TYPE_INT, me->frame_stride,
+					   "x-offset", G_TYPE_INT, me->frame_x_offset,
+					   "y-offset", G_TYPE_INT, me->frame_y_offset,
+					   NULL);
+
+	return gst_video_decoder_negotiate (GST_VIDEO_DECODER (me));
+}
+
+/* ストリーム途中で画像サイズが変わった場合、デバイス側に溜まっている
+ * フレームを出力した後、CAPTURE 側だけを新しいサイズで作り直す。
+ * OUTPUT 側のキューと、デバイスのセッションは維持する
+ */
+static gboolean
+gst_acm_h264_dec_change_resolution (GstAcmH264Dec * me,
+	guint width, guint height, GstVideoCodecFrame * pending)
+{
+	enum v4l2_buf_type type;
+	int r;
+	guint bytesperline = 0;
+	guint offset = 0;
+	guint out_frame_size = 0;
+
+	GST_INFO_OBJECT (me, "H264DEC CHANGE RESOLUTION %u x %u -> %u x %u",
+					 me->width, me->height, width, height);
+
+	/* 古いサイズのフレームを、全て down stream へ流す	*/
+	if (GST_FLOW_ERROR == gst_acm_h264_dec_drain (me, pending)) {
+		return FALSE;
+	}
+	me->priv->in_out_frame_count = 0;
+
+	/* 表示中のバッファは、古いプールのものなので解放する	*/
+	if (me->priv->displaying_buf) {
+		gst_buffer_unref(me->priv->displaying_buf);
+		me->priv->displaying_buf = NULL;
+	}
+
+	/* CAPTURE 側のみ停止して、バッファプールを破棄	*/
+	if (me->pool_out) {
+		gst_buffer_pool_set_active (GST_BUFFER_POOL_CAST (me->pool_out), FALSE);
+		gst_object_unref (me->pool_out);
+		me->pool_out = NULL;
+	}
+	type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	r = gst_acm_v4l2_ioctl (me->video_fd, VIDIOC_STREAMOFF, &type);
+	if (r < 0) {
+		goto stop_failed;
+	}
+
+	/* 新しいサイズ	*/
+	me->width = width;
+	me->height = height;
+	gst_acm_h264_dec_fixate_out_caps (me);
+	if (me->priv->stride_follows_width || me->frame_stride < me->out_width) {
+		me->frame_stride = me->out_width;
+	}
+
+	/* down stream と再ネゴシエーション	*/
+	if (! gst_acm_h264_dec_set_output_state (me)) {
+		GST_ELEMENT_ERROR (me, CORE, NEGOTIATION, (NULL),
+			("failed src caps negotiate"));
+		return FALSE;
+	}
+
+	/* CAPTURE 側を新しいサイズで作り直して再開	*/
+	gst_acm_h264_dec_get_out_geometry (me, &out_frame_size, &bytesperline, &offset);
+	GST_INFO_OBJECT (me, "out_frame_size:%u, bytesperline:%u, offset:%u",
+					 out_frame_size, bytesperline, offset);
+	if (! gst_acm_h264_dec_set_capture_format (me, bytesperline, offset,
+			&out_frame_size)) {
+		return FALSE;
+	}
+	if (! gst_acm_h264_dec_setup_pool_out (me, out_frame_size)) {
+		return FALSE;
+	}
+	r = gst_acm_v4l2_ioctl (me->video_fd, VIDIOC_STREAMON, &type);
+	if (r < 0) {
+		goto start_failed;
+	}
+
+	return TRUE;
+
+	/* ERRORS */
+stop_failed:
+	{
+		GST_ELEMENT_ERROR (me, STREAM, DECODE, (NULL),
+			("error with STREAMOFF %d (%s)", errno, g_strerror (errno)));
+		return FALSE;
+	}
 start_failed:
 	{
 		GST_ELEMENT_ERROR (me, STREAM, DECODE, (NULL),
 			("error with STREAMON %d (%s)", errno, g_strerror (errno)));
-		ret = FALSE;
-		goto out;
+		return FALSE;
 	}
 }
 
@@ -2041,6 +4150,18 @@ gst_acm_h264_dec_handle_in_frame(GstAcmH264Dec * me,
 	/* 入力データサイズを設定		*/
 	v4l2buf_in->bytesused = map.size;
 	v4l2buf_in->length = map.size;
+
+	/* 出力との対応付けのため、フレーム番号を設定	*/
+	if (frame) {
+		FRAME_NUMBER_TO_TIMEVAL (v4l2buf_in->timestamp,
+								 frame->system_frame_number);
+		me->priv->qbuf_time[frame->system_frame_number % NUM_QBUF_TIME] =
+			gst_util_get_timestamp ();
+	}
+	else {
+		v4l2buf_in->timestamp.tv_sec = 0;
+		v4l2buf_in->timestamp.tv_usec = 0;
+	}
 	
 	/* 入力データを設定		*/
 	v4l2buf_in->m.userptr = (unsigned long)map.data;
@@ -2069,6 +4190,93 @@ qbuf_failed:
 	}
 }
 
+/* 巻き戻し再生用のプールから取得したバッファに、デコード済みデータをコピーする	*/
+static GstFlowReturn
+gst_acm_h264_dec_copy_to_reverse_buf(GstAcmH264Dec * me,
+	GstBuffer *v4l2buf_out, GstBuffer **outbuf)
+{
+	GstFlowReturn ret = GST_FLOW_OK;
+	GstStructure *config;
+	GstBufferPoolAcquireParams params;
+	GstMapInfo map;
+	guint size = gst_buffer_get_size(v4l2buf_out);
+
+	/* 出力サイズが変わった場合や、GOP がプールのバッファ数より長い場合は、
+	 * プールを作り直す
+	 */
+	if (me->priv->reverse_pool) {
+		if (me->priv->reverse_pool_size != size
+			|| me->priv->reverse_pool_max < me->priv->reverse_gop_depth) {
+			gst_buffer_pool_set_active (me->priv->reverse_pool, FALSE);
+			gst_object_unref (me->priv->reverse_pool);
+			me->priv->reverse_pool = NULL;
+		}
+	}
+
+	if (NULL == me->priv->reverse_pool) {
+		GST_INFO_OBJECT (me, "create reverse playback pool (size:%u, max:%u)",
+						 size, me->priv->reverse_gop_depth);
+
+		/* GOP 分のバッファが必要になるので、最大数は GOP の長さとする。
+		 * 一度確保したバッファは、down stream で unref された後、再利用される
+		 */
+		me->priv->reverse_pool = gst_buffer_pool_new ();
+		me->priv->reverse_pool_size = size;
+		me->priv->reverse_pool_max = me->priv->reverse_gop_depth;
+		config = gst_buffer_pool_get_config (me->priv->reverse_pool);
+		gst_buffer_pool_config_set_params (config, me->output_state->caps,
+			size, 0, me->priv->reverse_pool_max);
+		if (! gst_buffer_pool_set_config (me->priv->reverse_pool, config)) {
+			GST_ERROR_OBJECT (me, "failed to set config of reverse pool");
+			ret = GST_FLOW_ERROR;
+			goto out;
+		}
+		if (! gst_buffer_pool_set_active (me->priv->reverse_pool, TRUE)) {
+			GST_ERROR_OBJECT (me, "failed to activate reverse pool");
+			ret = GST_FLOW_ERROR;
+			goto out;
+		}
+	}
+
+	/* GOP の途中で長さが伸びた場合、プールが空になっても、GOP 全体が
+	 * down stream へ送出されるまで戻ってこないので、待たずに allocate する
+	 */
+	params.flags = GST_BUFFER_POOL_ACQUIRE_FLAG_DONTWAIT;
+	ret = gst_buffer_pool_acquire_buffer (me->priv->reverse_pool,
+										  outbuf, &params);
+	if (GST_FLOW_EOS == ret) {
+		GST_DEBUG_OBJECT (me, "reverse pool is empty, allocate a buffer");
+		*outbuf = gst_buffer_new_allocate (NULL, size, NULL);
+		if (NULL == *outbuf) {
+			ret = GST_FLOW_ERROR;
+			goto out;
+		}
+		ret = GST_FLOW_OK;
+	}
+	else if (GST_FLOW_OK != ret) {
+		GST_ERROR_OBJECT (me, "gst_buffer_pool_acquire_buffer() returns %s",
+						  gst_flow_get_name (ret));
+		goto out;
+	}
+
+	if (! gst_buffer_map (*outbuf, &map, GST_MAP_WRITE)) {
+		GST_ERROR_OBJECT (me, "failed to map reverse playback buffer");
+		gst_buffer_unref (*outbuf);
+		*outbuf = NULL;
+		ret = GST_FLOW_ERROR;
+		goto out;
+	}
+	gst_buffer_extract (v4l2buf_out, 0, map.data, size);
+	gst_buffer_unmap (*outbuf, &map);
+
+	/* フラグやメタデータも、gst_buffer_copy() と同様にコピーする	*/
+	gst_buffer_copy_into (*outbuf, v4l2buf_out,
+		GST_BUFFER_COPY_FLAGS | GST_BUFFER_COPY_META, 0, -1);
+
+out:
+	return ret;
+}
+
 static GstFlowReturn
 gst_acm_h264_dec_handle_out_frame(GstAcmH264Dec * me,
 	GstBuffer *v4l2buf_out, gboolean* is_eos)
@@ -2083,6 +4291,8 @@ gst_acm_h264_dec_handle_out_frame(GstAcmH264Dec * me,
 	GstClockTimeDiff deadline;
 #endif
 	GstVideoCodecFrame *frame = NULL;
+	gboolean isMatched = FALSE;
+	guint32 frameNumber;
 
 	/* 出力引数初期化	*/
 	if (NULL != is_eos) {
@@ -2106,35 +4316,21 @@ gst_acm_h264_dec_handle_out_frame(GstAcmH264Dec * me,
 	}
 
 	/* dequeue frame	*/
-	frame = gst_video_decoder_get_oldest_frame(GST_VIDEO_DECODER (me));
+	frame = gst_acm_h264_dec_get_out_frame(me, v4l2buf_out, &isMatched);
 	if (! frame) {
+		if (isMatched) {
+			goto unknown_frame;
+		}
 		goto no_frame;
 	}
-	gst_video_codec_frame_unref(frame);
 
 #if SUPPORT_CODED_FIELD
 #if DBG_LOG_INTERLACED
 	GST_INFO_OBJECT(me, "handle_out_frame (%u)", frame->system_frame_number);
 #endif
-	if (me->priv->is_interlaced) {
-		if (GST_VIDEO_CODEC_FRAME_FLAG_IS_SET(frame,
-				GST_VIDEO_CODEC_FRAME_FLAG_TOP_FIELD)
-			|| GST_VIDEO_CODEC_FRAME_FLAG_IS_SET(frame,
-				GST_VIDEO_CODEC_FRAME_FLAG_BOTTOM_FIELD)) {
-				/* 2入力 1出力なので、drop する		*/
-				GST_INFO_OBJECT(me, "drop frame by field structre (%u)",
-								frame->system_frame_number);
-				gst_video_decoder_drop_frame (GST_VIDEO_DECODER (me), frame);
-
-				/* 次のフレームを取得	*/
-				frame = gst_video_decoder_get_oldest_frame(GST_VIDEO_DECODER (me));
-				if (! frame) {
-					goto no_frame;
-				}
-				gst_video_codec_frame_unref(frame);
-
-				me->priv->in_out_frame_count--;
-			}
+	if (me->priv->is_interlaced && gst_acm_h264_dec_is_single_field(frame)) {
+		/* 2入力 1出力なので、フィールドのペアを 1 フレームにまとめる	*/
+		frame = gst_acm_h264_dec_merge_field_pair(me, frame);
 	}
 #endif
 
@@ -2191,38 +4387,65 @@ gst_acm_h264_dec_handle_out_frame(GstAcmH264Dec * me,
 		}
 		else {
 			/* 巻き戻し再生の際は、GstVideoDecoder 側でキューイングされるので、
-			 * バッファを allocate しないと、デバイスの CAPTURE 側キューが枯渇する
+			 * 別のバッファにコピーしないと、デバイスの CAPTURE 側キューが枯渇する
 			 */
-			frame->output_buffer = gst_buffer_copy(v4l2buf_out);
-			if (NULL == frame->output_buffer) {
-				goto allocate_outbuf_failed;
+			if (GST_VIDEO_CODEC_FRAME_IS_SYNC_POINT (frame)) {
+				me->priv->reverse_gop_frames = 0;
+			}
+			me->priv->reverse_gop_frames++;
+			if (me->priv->reverse_gop_depth < me->priv->reverse_gop_frames) {
+				me->priv->reverse_gop_depth = me->priv->reverse_gop_frames;
 			}
 
 			if (me->priv->using_fb_dmabuf) {
-				/* デバイスへ戻す	*/
-				gst_buffer_unref(v4l2buf_out);
-				v4l2buf_out = NULL;
+				/* dma-buf の場合はメモリを持たないので、メタデータのコピーのみ	*/
+				frame->output_buffer = gst_buffer_copy(v4l2buf_out);
+				if (NULL == frame->output_buffer) {
+					goto allocate_outbuf_failed;
+				}
+			}
+			else {
+				ret = gst_acm_h264_dec_copy_to_reverse_buf(me, v4l2buf_out,
+						&(frame->output_buffer));
+				if (GST_FLOW_OK != ret) {
+					gst_buffer_unref(v4l2buf_out);
+					goto allocate_outbuf_failed;
+				}
 			}
+
+			/* デバイスへ戻す	*/
+			gst_buffer_unref(v4l2buf_out);
+			v4l2buf_out = NULL;
+		}
+
+#if SUPPORT_CODED_FIELD
+		if (me->priv->is_interlaced) {
+			gst_acm_h264_dec_set_field_flags(me, frame);
 		}
+#endif
 
 		/* down stream へ バッファを push	*/
 		if (! me->priv->using_fb_dmabuf) {
 			if (GST_VIDEO_DECODER(me)->input_segment.rate > 0.0) {
 				displayingBuf = gst_buffer_ref(v4l2buf_out);
 			}
-			else {
-				displayingBuf = v4l2buf_out;
-			}
 		}
 
 #if 1	/* 2013-06-05 */
 		/* Bピクチャを含む場合、demux より入力されたバッファは、DTS順であり、PTS順とは異なる
 		 * HWデコーダのVCP1はBピクチャのリオーダリングをした後出力しているので、出力結果の
 		 * 並べ替えは不要。PTSをDTSで置き換える事で送出バッファのタイムスタンプを修正する
+		 * (フレーム番号で対応付けた場合は、フレーム自身の PTS が正しい)
 		 */
-		frame->pts = frame->dts;
-		GST_BUFFER_PTS(frame->input_buffer) = GST_BUFFER_DTS(frame->input_buffer);
+		if (! isMatched) {
+			frame->pts = frame->dts;
+			GST_BUFFER_PTS(frame->input_buffer) = GST_BUFFER_DTS(frame->input_buffer);
+		}
 #endif
+		frameNumber = frame->system_frame_number;
+		if (isMatched) {
+			gst_acm_h264_dec_measure_decode_time (me, frameNumber);
+		}
 		ret = gst_video_decoder_finish_frame (GST_VIDEO_DECODER (me), frame);
 		if (GST_FLOW_OK != ret) {
 			GST_WARNING_OBJECT (me, "gst_video_decoder_finish_frame() returns %s",
@@ -2235,6 +4458,7 @@ gst_acm_h264_dec_handle_out_frame(GstAcmH264Dec * me,
 			
 			goto finish_frame_failed;
 		}
+		gst_acm_h264_dec_count_output (me);
 
 		/* ディスプレイ表示中のバッファは ref して保持し、次のバッファを表示した後、
 		 * unref してデバイスに queue する。
@@ -2248,6 +4472,10 @@ gst_acm_h264_dec_handle_out_frame(GstAcmH264Dec * me,
 			}
 			me->priv->displaying_buf = displayingBuf;
 		}
+
+		if (isMatched) {
+			gst_acm_h264_dec_drop_stale_frames(me, frameNumber);
+		}
 	}
 
 #else	/* DO_PUSH_POOLS_BUF */
@@ -2310,6 +4538,17 @@ out:
 	return ret;
 	
 	/* ERRORS */
+unknown_frame:
+	{
+		/* 既に破棄したフレームの出力なので、デバイスに戻すだけ	*/
+		GST_WARNING_OBJECT (me, "no pending frame for decoded buffer");
+		ret = gst_acm_v4l2_buffer_pool_qbuf (
+			me->pool_out, v4l2buf_out, gst_buffer_get_size(v4l2buf_out));
+		if (GST_FLOW_OK != ret) {
+			goto qbuf_failed;
+		}
+		goto out;
+	}
 no_frame:
 	{
 //		GST_ELEMENT_ERROR (me, STREAM, DECODE, (NULL),
@@ -151,6 +151,24 @@ typedef struct _GstAcmH264Dec {
 	guint32 frame_x_offset;
 	guint32 frame_y_offset;
 
+	/* QoS による入力前のフレームドロップの有効無効フラグ
+	 */
+	gboolean qos;
+
+	/* デバイスのストールと判断するまでのフレーム期間数
+	 * 0 : 無効 (10秒でエラー)
+	 */
+	guint32 watchdog_frames;
+
+	/* IDR ピクチャのみをデコードする (サムネイル生成用) 有効無効フラグ
+	 */
+	gboolean idr_only;
+
+	/* 統計情報を element message で通知する間隔 (ミリ秒)
+	 * 0 : 通知しない
+	 */
+	guint32 stats_interval;
+
 	/*< private >*/
 	GstAcmH264DecPrivate *priv;
 } GstAcmH264Dec;
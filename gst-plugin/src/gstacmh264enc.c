@@ -50,6 +50,9 @@
 #include <gst/video/gstvideometa.h>
 #include <gst/video/gstvideopool.h>
 #include <gst/pbutils/pbutils.h>
+#if GST_CHECK_VERSION(1, 2, 0)
+#include <gst/allocators/gstdmabuf.h>
+#endif
 #include <media/acm-h264enc.h>
 
 #include "gstacmh264enc.h"
@@ -78,6 +81,9 @@ enum {
 /* デバイスに確保するバッファ数	*/
 #define DEFAULT_NUM_BUFFERS_IN			3
 #define DEFAULT_NUM_BUFFERS_OUT			3
+/* zero-latency 時のバッファ数	*/
+#define ZERO_LATENCY_NUM_BUFFERS_IN		2
+#define ZERO_LATENCY_NUM_BUFFERS_OUT	2
 
 /* エンコーダー初期化パラメータのデフォルト値	*/
 #define DEFAULT_VIDEO_DEVICE			"/dev/video0"
@@ -93,10 +99,28 @@ enum {
 #define DEFAULT_B_PIC_MODE				GST_ACMH264ENC_B_PIC_MODE_3_B_PIC
 #define DEFAULT_X_OFFSET				0
 #define DEFAULT_Y_OFFSET				0
+#define DEFAULT_CONFIG_INTERVAL			0
+#define DEFAULT_ZERO_LATENCY			FALSE
 
 /* select() の timeout 時間 */
 #define SELECT_TIMEOUT_MSEC				1000
 
+/* 出力タスクの select() の timeout 時間 (停止要求への応答時間) */
+#define OUTPUT_LOOP_POLL_MSEC			100
+
+/* Bピクチャの PTS 参照用リングの要素数 (2 のべき乗)。
+ * エンコーダ内に滞留するフレーム数より十分大きいこと
+ */
+#define FRAME_RING_SIZE					32
+
+/* SH からのキャプチャ順カウンタは、0x7FFFFFFE で折り返す	*/
+#define CAPTURE_COUNTER_WRAP			0x7FFFFFFF
+
+/* ストリーム中に変更されたプロパティ (VIDIOC_S_CTRL で反映する)	*/
+#define ENC_CTRL_BIT_RATE				(1 << 0)
+#define ENC_CTRL_RATE_CONTROL_MODE		(1 << 1)
+#define ENC_CTRL_MAX_GOP_LENGTH			(1 << 2)
+
 /* デバッグログ出力フラグ		*/
 #define DBG_LOG_PERF_CHAIN				0
 #define DBG_LOG_PERF_SELECT_IN			0
@@ -124,6 +148,23 @@ static double g_time_total_select_out = 0;
 #endif
 
 
+/* OUTPUT 側に QBUF 中の、上流のバッファ（ゼロコピー入力用）	*/
+typedef struct _GstAcmH264EncInRef
+{
+	GstBuffer *buf;
+	GstMapInfo map;
+	gboolean is_mapped;
+} GstAcmH264EncInRef;
+
+/* Bピクチャ含む場合の、PTS 参照用のフレーム情報	*/
+typedef struct _GstAcmH264EncFrameEntry
+{
+	gboolean is_used;
+	guint32 system_frame_number;
+	GstClockTime pts;
+	GstClockTime dts;
+} GstAcmH264EncFrameEntry;
+
 /* private member	*/
 struct _GstAcmH264EncPrivate
 {
@@ -140,11 +181,15 @@ struct _GstAcmH264EncPrivate
 	/* V4L2_BUF_TYPE_VIDEO_OUTPUT 側に入力したフレーム数と、
 	 * V4L2_BUF_TYPE_VIDEO_CAPTURE 側から取り出したフレーム数の差分
 	 */
-	gint in_out_frame_count;
+	volatile gint in_out_frame_count;
 	
 	/* プレエンコード回数	*/
 	gint pre_encode_num;
 
+	/* OUTPUT / CAPTURE 側のバッファ数	*/
+	guint num_buffers_in;
+	guint num_buffers_out;
+
 	/* AUD + SPS + PPS */
 	GstBuffer *spspps_buf;
 	gint sps_len;
@@ -157,11 +202,54 @@ struct _GstAcmH264EncPrivate
 	/* Bピクチャ無し時のプレエンコード用空バッファをQBUF済みフラグ	*/
 	gboolean is_qbufed_null_when_non_bpic;
 
+	/* 次の I ピクチャに SPS/PPS を挿入する (byte-stream 時)	*/
+	gboolean need_spspps;
+	/* 最後に SPS/PPS を挿入したフレームの PTS (config-interval 用)	*/
+	GstClockTime last_spspps_pts;
+
 	/* V4L2_PIX_FMT_H264 or V4L2_PIX_FMT_H264_NO_SC 	*/
 	gint output_format;
 
-	/* list of incoming GstVideoCodecFrame	*/
-	GList *in_frames;
+	/* incoming frames, indexed by system_frame_number % FRAME_RING_SIZE	*/
+	GstAcmH264EncFrameEntry in_frames[FRAME_RING_SIZE];
+
+	/* OUTPUT 側の I/O モード (USERPTR or DMABUF)	*/
+	GstAcmV4l2IOMode in_io_mode;
+	gboolean is_decided_in_io_mode;
+	guint in_buf_size;
+
+	/* エンコーダに設定した入力の Y / UV プレーンのストライドと、
+	 * Y プレーンの行数 (input_height 以上)。
+	 * UV プレーンは、Y プレーンの直後 (in_stride * in_plane_height) に続くこと
+	 */
+	gint in_stride;
+	gint in_plane_height;
+
+	/* DQBUF されるまで保持する上流のバッファ (OUTPUT のインデックス毎)	*/
+	GstAcmH264EncInRef in_refs[GST_ACM_V4L2_MAX_BUFFERS];
+
+	/* 最後に QBUF した DMABUF の fd (サイズ 0 のバッファの QBUF 用)	*/
+	gint in_dmabuf_fd;
+
+	/* CAPTURE 側の DQBUF と finish_frame を行う、src pad のタスク	*/
+	gboolean is_output_task_started;
+	guint output_idle_msec;
+	/* EOS 時、デバイス内のフレームを全て取り出すまで待つ	*/
+	volatile gboolean is_draining;
+	/* タスクの処理結果と、その通知 (GST_OBJECT_LOCK で保護)	*/
+	GstFlowReturn output_flow;
+	GCond drain_cond;
+
+	/* ストリーム中に変更されたプロパティ (GST_OBJECT_LOCK で保護)	*/
+	guint pending_ctrls;
+	/* ドライバが動作中の変更を受け付けず、次の GOP の先頭で
+	 * STREAMOFF → S_CTRL → STREAMON により反映するプロパティ
+	 */
+	guint reconfig_ctrls;
+	/* 現在の GOP 内で入力したフレーム数	*/
+	gint gop_frame_count;
+	/* 再設定後、キャプチャ順カウンタ 0 に対応する system_frame_number	*/
+	guint32 capture_counter_base;
 };
 
 GST_DEBUG_CATEGORY_STATIC (acmh264enc_debug);
@@ -187,6 +275,8 @@ enum
 	PROP_B_PIC_MODE,
 	PROP_X_OFFSET,
 	PROP_Y_OFFSET,
+	PROP_CONFIG_INTERVAL,
+	PROP_ZERO_LATENCY,
 };
 
 /* pad template caps for source and sink pads.	*/
@@ -295,6 +385,8 @@ static GstFlowReturn gst_acm_h264_enc_pre_push (GstVideoEncoder *enc,
 	GstVideoCodecFrame * frame);
 static gboolean gst_acm_h264_enc_sink_event (GstVideoEncoder * enc,
 	GstEvent *event);
+static gboolean gst_acm_h264_enc_propose_allocation (GstVideoEncoder * enc,
+	GstQuery * query);
 /* GstAcmH264Enc class method */
 static gboolean gst_acm_h264_enc_init_encoder (GstAcmH264Enc * me);
 static gboolean gst_acm_h264_enc_cleanup_encoder (GstAcmH264Enc * me);
@@ -303,15 +395,41 @@ static GstFlowReturn gst_acm_h264_enc_handle_in_frame_with_wait(GstAcmH264Enc *
 	GstBuffer *inbuf);
 static GstFlowReturn gst_acm_h264_enc_handle_in_frame(GstAcmH264Enc * me,
 	GstBuffer *v4l2buf_in, GstBuffer *inbuf);
+static void gst_acm_h264_enc_release_in_ref(GstAcmH264Enc * me, guint index);
+static void gst_acm_h264_enc_release_all_in_refs(GstAcmH264Enc * me);
+static gboolean gst_acm_h264_enc_decide_in_io_mode(GstAcmH264Enc * me,
+	GstBuffer *inbuf);
+static gboolean gst_acm_h264_enc_set_in_format(GstAcmH264Enc * me);
+static gboolean gst_acm_h264_enc_get_in_layout(GstAcmH264Enc * me,
+	GstBuffer *inbuf, gint *stride, gint *plane_height);
+static gsize gst_acm_h264_enc_copy_in_frame(GstAcmH264Enc * me,
+	GstBuffer *inbuf, GstBuffer *v4l2buf_in);
 static GstFlowReturn gst_acm_h264_enc_get_spspps(GstAcmH264Enc * me);
-static GstFlowReturn gst_acm_h264_enc_handle_out_frame_with_wait(GstAcmH264Enc * me);
+static GstFlowReturn gst_acm_h264_enc_dqbuf_out(GstAcmH264Enc * me,
+	guint timeout_msec, GstBuffer **v4l2buf_out);
+static GstFlowReturn gst_acm_h264_enc_process_out_buf(GstAcmH264Enc * me,
+	GstBuffer *v4l2buf_out);
+static void gst_acm_h264_enc_output_loop(GstAcmH264Enc * me);
+static void gst_acm_h264_enc_start_output_task(GstAcmH264Enc * me);
+static void gst_acm_h264_enc_stop_output_task(GstAcmH264Enc * me,
+	gboolean has_stream_lock);
+static GstFlowReturn gst_acm_h264_enc_drain(GstAcmH264Enc * me);
+static guint gst_acm_h264_enc_set_ctrls(GstAcmH264Enc * me, guint ctrls);
+static GstFlowReturn gst_acm_h264_enc_update_ctrls(GstAcmH264Enc * me,
+	GstVideoCodecFrame * frame);
+static GstFlowReturn gst_acm_h264_enc_restart_encoder(GstAcmH264Enc * me,
+	GstVideoCodecFrame * frame);
+static GstFlowReturn gst_acm_h264_enc_force_key_frame(GstAcmH264Enc * me,
+	GstVideoCodecFrame * frame);
+static gboolean gst_acm_h264_enc_is_spspps_interval(GstAcmH264Enc * me,
+	GstClockTime pts);
 static GstFlowReturn gst_acm_h264_enc_handle_out_frame(GstAcmH264Enc * me,
 	GstBuffer *v4l2buf_out);
 static GstBuffer* gst_acm_h264_enc_make_codec_data (GstAcmH264Enc * me);
 static void gst_acm_h264_enc_push_frame (GstAcmH264Enc * me,
 	GstVideoCodecFrame * frame);
-static GstVideoCodecFrame *gst_acm_h264_enc_pop_frame (GstAcmH264Enc * me,
-	guint32 frame_number);
+static gboolean gst_acm_h264_enc_pop_frame (GstAcmH264Enc * me,
+	guint32 capture_counter, GstAcmH264EncFrameEntry *entry);
 
 #define gst_acm_h264_enc_parent_class parent_class
 G_DEFINE_TYPE (GstAcmH264Enc, gst_acm_h264_enc, GST_TYPE_VIDEO_ENCODER);
@@ -336,16 +454,25 @@ gst_acm_h264_enc_set_property (GObject * object, guint prop_id,
 		break;
 #endif
 	case PROP_BIT_RATE:
+		GST_OBJECT_LOCK (me);
 		me->bit_rate = g_value_get_int (value);
+		me->priv->pending_ctrls |= ENC_CTRL_BIT_RATE;
+		GST_OBJECT_UNLOCK (me);
 		break;
 	case PROP_MAX_FRAME_SIZE:
 		me->max_frame_size = g_value_get_int (value);
 		break;
 	case PROP_RATE_CONTROL_MODE:
+		GST_OBJECT_LOCK (me);
 		me->rate_control_mode = g_value_get_int (value);
+		me->priv->pending_ctrls |= ENC_CTRL_RATE_CONTROL_MODE;
+		GST_OBJECT_UNLOCK (me);
 		break;
 	case PROP_MAX_GOP_LENGTH:
+		GST_OBJECT_LOCK (me);
 		me->max_GOP_length = g_value_get_int (value);
+		me->priv->pending_ctrls |= ENC_CTRL_MAX_GOP_LENGTH;
+		GST_OBJECT_UNLOCK (me);
 		break;
 	case PROP_B_PIC_MODE:
 		me->B_pic_mode = g_value_get_int (value);
@@ -356,6 +483,12 @@ gst_acm_h264_enc_set_property (GObject * object, guint prop_id,
 	case PROP_Y_OFFSET:
 		me->y_offset = g_value_get_int (value);
 		break;
+	case PROP_CONFIG_INTERVAL:
+		me->config_interval = g_value_get_int (value);
+		break;
+	case PROP_ZERO_LATENCY:
+		me->zero_latency = g_value_get_boolean (value);
+		break;
 	default:
 		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
 		break;
@@ -398,6 +531,12 @@ gst_acm_h264_enc_get_property (GObject * object, guint prop_id,
 	case PROP_Y_OFFSET:
 		g_value_set_int (value, me->y_offset);
 		break;
+	case PROP_CONFIG_INTERVAL:
+		g_value_set_int (value, me->config_interval);
+		break;
+	case PROP_ZERO_LATENCY:
+		g_value_set_boolean (value, me->zero_latency);
+		break;
 	default:
 		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
 		break;
@@ -435,7 +574,8 @@ gst_acm_h264_enc_class_init (GstAcmH264EncClass * klass)
 		g_param_spec_int ("bitrate", "Bitrate (bps)",
 			"Average Bitrate (ABR) in bits/sec. ",
 			GST_ACMH264ENC_BITRATE_MIN, GST_ACMH264ENC_BITRATE_MAX,
-			DEFAULT_BITRATE, G_PARAM_READWRITE | G_PARAM_LAX_VALIDATION));
+			DEFAULT_BITRATE,
+			G_PARAM_READWRITE | G_PARAM_LAX_VALIDATION | GST_PARAM_MUTABLE_PLAYING));
 
 	g_object_class_install_property (gobject_class, PROP_MAX_FRAME_SIZE,
 		g_param_spec_int ("max-frame-size", "Max Frame Size",
@@ -448,13 +588,14 @@ gst_acm_h264_enc_class_init (GstAcmH264EncClass * klass)
 		g_param_spec_int ("rate-control-mode", "Rate control mode",
 			"0:CBR (with skip picture), 1:CDR (with non skip picture), 2:VBR. ",
 			GST_ACMH264ENC_RATE_CONTROL_MODE_CBR_SKIP, GST_ACMH264ENC_RATE_CONTROL_MODE_VBR_NON_SKIP,
-			DEFAULT_RATE_CONTROL_MODE, G_PARAM_READWRITE));
+			DEFAULT_RATE_CONTROL_MODE, G_PARAM_READWRITE | GST_PARAM_MUTABLE_PLAYING));
 
 	g_object_class_install_property (gobject_class, PROP_MAX_GOP_LENGTH,
 		g_param_spec_int ("max-gop-length", "Max GOP length",
 			"Max GOP length.",
 			GST_ACMH264ENC_MAX_GOP_LENGTH_MIN, GST_ACMH264ENC_MAX_GOP_LENGTH_MAX,
-			DEFAULT_MAX_GOP_LENGTH, G_PARAM_READWRITE | G_PARAM_LAX_VALIDATION));
+			DEFAULT_MAX_GOP_LENGTH,
+			G_PARAM_READWRITE | G_PARAM_LAX_VALIDATION | GST_PARAM_MUTABLE_PLAYING));
 
 	g_object_class_install_property (gobject_class, PROP_B_PIC_MODE,
 		g_param_spec_int ("b-pic-mode", "B picture mode",
@@ -474,6 +615,19 @@ gst_acm_h264_enc_class_init (GstAcmH264EncClass * klass)
 			GST_ACMH264ENC_Y_OFFSET_MIN, GST_ACMH264ENC_Y_OFFSET_MAX,
 			DEFAULT_Y_OFFSET, G_PARAM_READWRITE | G_PARAM_LAX_VALIDATION));
 
+	g_object_class_install_property (gobject_class, PROP_CONFIG_INTERVAL,
+		g_param_spec_int ("config-interval", "SPS PPS Send Interval",
+			"Send SPS and PPS Insertion Interval in seconds in byte-stream. "
+			"(-1 = with every I picture, 0 = only the first frame)",
+			GST_ACMH264ENC_CONFIG_INTERVAL_MIN, GST_ACMH264ENC_CONFIG_INTERVAL_MAX,
+			DEFAULT_CONFIG_INTERVAL, G_PARAM_READWRITE | GST_PARAM_MUTABLE_PLAYING));
+
+	g_object_class_install_property (gobject_class, PROP_ZERO_LATENCY,
+		g_param_spec_boolean ("zero-latency", "Zero latency",
+			"Tune for low latency. Disable B picture and minimize the number of "
+			"buffers queued in the encoder.",
+			DEFAULT_ZERO_LATENCY, G_PARAM_READWRITE));
+
 	gst_element_class_add_pad_template (element_class,
 			gst_static_pad_template_get (&src_template_factory));
 	gst_element_class_add_pad_template (element_class,
@@ -497,6 +651,8 @@ gst_acm_h264_enc_class_init (GstAcmH264EncClass * klass)
 	video_encoder_class->finish = GST_DEBUG_FUNCPTR (gst_acm_h264_enc_finish);
 	video_encoder_class->sink_event =
 		GST_DEBUG_FUNCPTR (gst_acm_h264_enc_sink_event);
+	video_encoder_class->propose_allocation =
+		GST_DEBUG_FUNCPTR (gst_acm_h264_enc_propose_allocation);
 }
 
 static void
@@ -523,14 +679,34 @@ gst_acm_h264_enc_init (GstAcmH264Enc * me)
 	me->priv->num_outbuf_dequeued = 0;
 	me->priv->in_out_frame_count = 0;
 	me->priv->pre_encode_num = 0;
+	me->priv->num_buffers_in = DEFAULT_NUM_BUFFERS_IN;
+	me->priv->num_buffers_out = DEFAULT_NUM_BUFFERS_OUT;
 	me->priv->spspps_buf = NULL;
 	me->priv->spspps_size = 0;
 	me->priv->sps_len = 0;
 	me->priv->pps_len = 0;
 	me->priv->is_handled_1stframe_out = FALSE;
 	me->priv->is_qbufed_null_when_non_bpic = FALSE;
+	me->priv->need_spspps = FALSE;
+	me->priv->last_spspps_pts = GST_CLOCK_TIME_NONE;
 	me->priv->output_format = V4L2_PIX_FMT_H264_NO_SC;
-	me->priv->in_frames = NULL;
+	memset (me->priv->in_frames, 0, sizeof (me->priv->in_frames));
+	me->priv->in_io_mode = GST_ACM_V4L2_IO_USERPTR;
+	me->priv->is_decided_in_io_mode = FALSE;
+	me->priv->in_buf_size = 0;
+	me->priv->in_stride = 0;
+	me->priv->in_plane_height = 0;
+	memset (me->priv->in_refs, 0, sizeof (me->priv->in_refs));
+	me->priv->in_dmabuf_fd = -1;
+	me->priv->is_output_task_started = FALSE;
+	me->priv->output_idle_msec = 0;
+	me->priv->is_draining = FALSE;
+	me->priv->output_flow = GST_FLOW_OK;
+	g_cond_init (&me->priv->drain_cond);
+	me->priv->pending_ctrls = 0;
+	me->priv->reconfig_ctrls = 0;
+	me->priv->gop_frame_count = 0;
+	me->priv->capture_counter_base = 0;
 
 	/* property	*/
 	me->videodev = NULL;
@@ -546,6 +722,8 @@ gst_acm_h264_enc_init (GstAcmH264Enc * me)
 	me->B_pic_mode = DEFAULT_B_PIC_MODE;
 	me->x_offset = DEFAULT_X_OFFSET;
 	me->y_offset = DEFAULT_Y_OFFSET;
+	me->config_interval = DEFAULT_CONFIG_INTERVAL;
+	me->zero_latency = DEFAULT_ZERO_LATENCY;
 }
 
 static void
@@ -560,6 +738,7 @@ gst_acm_h264_enc_finalize (GObject * object)
 		g_free(me->videodev);
 		me->videodev = NULL;
 	}
+	g_cond_clear (&me->priv->drain_cond);
 
 	G_OBJECT_CLASS (parent_class)->finalize (object);
 }
@@ -629,14 +808,33 @@ gst_acm_h264_enc_start (GstVideoEncoder * enc)
 	me->priv->num_outbuf_dequeued = 0;
 	me->priv->in_out_frame_count = 0;
 	me->priv->pre_encode_num = 0;
+	me->priv->num_buffers_in = DEFAULT_NUM_BUFFERS_IN;
+	me->priv->num_buffers_out = DEFAULT_NUM_BUFFERS_OUT;
 	me->priv->spspps_buf = NULL;
 	me->priv->spspps_size = 0;
 	me->priv->sps_len = 0;
 	me->priv->pps_len = 0;
 	me->priv->is_handled_1stframe_out = FALSE;
 	me->priv->is_qbufed_null_when_non_bpic = FALSE;
+	me->priv->need_spspps = FALSE;
+	me->priv->last_spspps_pts = GST_CLOCK_TIME_NONE;
 	me->priv->output_format = V4L2_PIX_FMT_H264_NO_SC;
-	me->priv->in_frames = NULL;
+	memset (me->priv->in_frames, 0, sizeof (me->priv->in_frames));
+	me->priv->in_io_mode = GST_ACM_V4L2_IO_USERPTR;
+	me->priv->is_decided_in_io_mode = FALSE;
+	me->priv->in_buf_size = 0;
+	me->priv->in_stride = 0;
+	me->priv->in_plane_height = 0;
+	memset (me->priv->in_refs, 0, sizeof (me->priv->in_refs));
+	me->priv->in_dmabuf_fd = -1;
+	me->priv->is_output_task_started = FALSE;
+	me->priv->output_idle_msec = 0;
+	me->priv->is_draining = FALSE;
+	me->priv->output_flow = GST_FLOW_OK;
+	me->priv->pending_ctrls = 0;
+	me->priv->reconfig_ctrls = 0;
+	me->priv->gop_frame_count = 0;
+	me->priv->capture_counter_base = 0;
 
 	return TRUE;
 }
@@ -648,6 +846,9 @@ gst_acm_h264_enc_stop (GstVideoEncoder * enc)
 
 	GST_INFO_OBJECT (me, "H264ENC STOP");
 
+	/* stop output task	*/
+	gst_acm_h264_enc_stop_output_task (me, FALSE);
+
 	/* cleanup encoder	*/
 	gst_acm_h264_enc_cleanup_encoder (me);
 
@@ -661,18 +862,8 @@ gst_acm_h264_enc_stop (GstVideoEncoder * enc)
 		me->priv->spspps_size = 0;
 	}
 
-	/* cleanup frame list	*/
-	if (me->priv->in_frames) {
-		GST_INFO_OBJECT (me, "LIST length : %u", g_list_length(me->priv->in_frames));
-		g_list_foreach (me->priv->in_frames, (GFunc) gst_video_codec_frame_unref, NULL);
-		g_list_free (me->priv->in_frames);
-		me->priv->in_frames = NULL;
-	}
-#if DBG_LOG_IN_FRAME_LIST
-	else {
-		GST_INFO_OBJECT (me, "LIST is NULL");
-	}
-#endif
+	/* cleanup frame ring	*/
+	memset (me->priv->in_frames, 0, sizeof (me->priv->in_frames));
 
 	return TRUE;
 }
@@ -856,6 +1047,9 @@ gst_acm_h264_enc_set_format (GstVideoEncoder * enc, GstVideoCodecState * state)
 	GST_INFO_OBJECT (me, "H264ENC SET FORMAT - caps: %" GST_PTR_FORMAT, state->caps);
 	GST_INFO_OBJECT (me, "H264ENC SET FORMAT - codec_data: %p", state->codec_data);
 
+	/* デバイスを再初期化するので、出力タスクを止める	*/
+	gst_acm_h264_enc_stop_output_task (me, TRUE);
+
 	/* Save input state to be used as reference for output state */
 	if (me->input_state) {
 		gst_video_codec_state_unref (me->input_state);
@@ -1021,6 +1215,14 @@ gst_acm_h264_enc_set_format (GstVideoEncoder * enc, GstVideoCodecState * state)
 	}
 #endif
 
+	/* zero-latency の場合は、並べ替えによる遅延をなくすため、Bピクチャを使わない */
+	if (me->zero_latency
+		&& GST_ACMH264ENC_B_PIC_MODE_0_B_PIC != me->B_pic_mode) {
+		GST_WARNING_OBJECT (me, "force b-pic-mode to %d, because zero-latency",
+							GST_ACMH264ENC_B_PIC_MODE_0_B_PIC);
+		me->B_pic_mode = GST_ACMH264ENC_B_PIC_MODE_0_B_PIC;
+	}
+
 	/* b-pic-mode > 0 の場合は、rate-control-mode は、1 または 2 のみ設定可能 */
 	if ((me->B_pic_mode > GST_ACMH264ENC_B_PIC_MODE_0_B_PIC)
 		&& (GST_ACMH264ENC_RATE_CONTROL_MODE_CBR_SKIP == me->rate_control_mode)) {
@@ -1092,6 +1294,16 @@ gst_acm_h264_enc_set_format (GstVideoEncoder * enc, GstVideoCodecState * state)
 		break;
 	}
 
+	/* バッファ数の決定	*/
+	if (me->zero_latency) {
+		me->priv->num_buffers_in = ZERO_LATENCY_NUM_BUFFERS_IN;
+		me->priv->num_buffers_out = ZERO_LATENCY_NUM_BUFFERS_OUT;
+	}
+	else {
+		me->priv->num_buffers_in = DEFAULT_NUM_BUFFERS_IN;
+		me->priv->num_buffers_out = DEFAULT_NUM_BUFFERS_OUT;
+	}
+
 	/* initialize HW encoder	*/
 	if (! gst_acm_h264_enc_init_encoder(me)) {
 		goto init_failed;
@@ -1156,9 +1368,15 @@ gst_acm_h264_enc_set_format (GstVideoEncoder * enc, GstVideoCodecState * state)
 	/* set latency */
 	if (vinfo->fps_n) {
 		GstClockTime latency;
+		gint latency_frames;
 
-		/* set latency of 2 frames */
-		latency = gst_util_uint64_scale(GST_SECOND, GST_VIDEO_INFO_FPS_D(vinfo) * 2, GST_VIDEO_INFO_FPS_N (vinfo));
+		/* エンコード中の 1 フレームに加え、Bピクチャの並べ替えと、出力待ちのフレーム分。
+		 * zero-latency でも、デバイスのパイプラインは b-pic-mode=0 と同じで、
+		 * 減るのはバッファ数だけなので、同じ値を報告する
+		 */
+		latency_frames = me->B_pic_mode + 2;
+		latency = gst_util_uint64_scale(GST_SECOND,
+			GST_VIDEO_INFO_FPS_D(vinfo) * latency_frames, GST_VIDEO_INFO_FPS_N (vinfo));
 		
 		GST_INFO_OBJECT (me, "set latency to %" GST_TIME_FORMAT ,
 						 GST_TIME_ARGS (latency));
@@ -1243,6 +1461,14 @@ gst_acm_h264_enc_reset (GstVideoEncoder * enc, gboolean hard)
 
 	GST_INFO_OBJECT (me, "H264ENC RESET %s", hard ? "hard" : "soft");
 
+	/* フラッシュ等で停止した出力タスクは、次のフレーム入力時に再開する	*/
+	GST_OBJECT_LOCK (me);
+	if (GST_FLOW_OK != me->priv->output_flow) {
+		me->priv->output_flow = GST_FLOW_OK;
+		me->priv->is_output_task_started = FALSE;
+	}
+	GST_OBJECT_UNLOCK (me);
+
 	return TRUE;
 }
 
@@ -1304,20 +1530,45 @@ gst_acm_h264_enc_handle_frame (GstVideoEncoder * enc,
 	dump_input_buf(frame->input_buffer);
 #endif
 
-	/* Bピクチャ含む場合の、PTS参照用に、リストに保持	*/
-	if (GST_ACMH264ENC_B_PIC_MODE_0_B_PIC != me->B_pic_mode) {
-		gst_acm_h264_enc_push_frame (me, frame);
+	/* 出力タスクで発生したエラー等を、上流に返す	*/
+	GST_OBJECT_LOCK (me);
+	flowRet = me->priv->output_flow;
+	GST_OBJECT_UNLOCK (me);
+	if (GST_FLOW_OK != flowRet) {
+		GST_DEBUG_OBJECT (me, "output task stopped : %s",
+						  gst_flow_get_name (flowRet));
+		goto out;
+	}
+
+	/* 最初のフレームで、入力の I/O モードを決める	*/
+	if (! me->priv->is_decided_in_io_mode) {
+		if (! gst_acm_h264_enc_decide_in_io_mode(me, frame->input_buffer)) {
+			flowRet = GST_FLOW_ERROR;
+			goto out;
+		}
+	}
+
+	/* ストリーム中に変更されたプロパティを反映する	*/
+	flowRet = gst_acm_h264_enc_update_ctrls(me, frame);
+	if (GST_FLOW_OK != flowRet) {
+		goto out;
 	}
 
-	/* 出力 : プレエンコード分入力した後は、エンコード済みデータができるのを待って取り出す	*/
-	if (me->priv->num_inbuf_queued >= me->priv->pre_encode_num) {
-//		GST_INFO_OBJECT(me, "me->num_inbuf_queued : %d", me->num_inbuf_queued);
-		flowRet = gst_acm_h264_enc_handle_out_frame_with_wait(me);
+	/* force-key-unit イベントで要求されたフレームは、IDR にする	*/
+	if (GST_VIDEO_CODEC_FRAME_IS_FORCE_KEYFRAME (frame)) {
+		flowRet = gst_acm_h264_enc_force_key_frame(me, frame);
 		if (GST_FLOW_OK != flowRet) {
 			goto out;
 		}
 	}
 
+	/* Bピクチャ含む場合の、PTS参照用に、リストに保持	*/
+	if (GST_ACMH264ENC_B_PIC_MODE_0_B_PIC != me->B_pic_mode) {
+		gst_acm_h264_enc_push_frame (me, frame);
+	}
+
+	/* 出力は、src pad のタスクでエンコード済みデータができ次第取り出す	*/
+
 	/* B_pic_mode == 0 の時は、ダミーのプレエンコード用に、空バッファを QBUF する */
 	if (GST_ACMH264ENC_B_PIC_MODE_0_B_PIC == me->B_pic_mode
 		&& ! me->priv->is_qbufed_null_when_non_bpic) {
@@ -1351,7 +1602,7 @@ gst_acm_h264_enc_handle_frame (GstVideoEncoder * enc,
 		if (GST_FLOW_OK != flowRet) {
 			goto out;
 		}
-		me->priv->in_out_frame_count++;
+		g_atomic_int_inc (&me->priv->in_out_frame_count);
 	}
 	else {
 		flowRet = gst_acm_h264_enc_handle_in_frame_with_wait(me,
@@ -1363,6 +1614,12 @@ gst_acm_h264_enc_handle_frame (GstVideoEncoder * enc,
 	if (me->priv->num_inbuf_queued <= me->priv->pre_encode_num) {
 		me->priv->num_inbuf_queued++;
 	}
+	if (me->max_GOP_length > 0
+		&& ++me->priv->gop_frame_count >= me->max_GOP_length) {
+		me->priv->gop_frame_count = 0;
+	}
+
+	gst_acm_h264_enc_start_output_task(me);
 
 out:
 #if DBG_LOG_PERF_CHAIN
@@ -1380,6 +1637,75 @@ no_buffer:
 	}
 }
 
+/* 上流に、OUTPUT 側に USERPTR でそのまま QBUF できるバッファを確保させる	*/
+static gboolean
+gst_acm_h264_enc_propose_allocation (GstVideoEncoder * enc, GstQuery * query)
+{
+	GstAcmH264Enc *me = GST_ACMH264ENC (enc);
+	GstCaps *caps = NULL;
+	gboolean need_pool = FALSE;
+	GstVideoInfo info;
+	GstBufferPool *pool;
+	GstStructure *config;
+	GstAllocationParams params;
+	guint min_buffers;
+
+	gst_query_parse_allocation (query, &caps, &need_pool);
+	if (NULL == caps) {
+		goto no_caps;
+	}
+	if (! gst_video_info_from_caps (&info, caps)) {
+		goto invalid_caps;
+	}
+
+	gst_allocation_params_init (&params);
+	params.align = GST_ACM_V4L2_USERPTR_ALIGN - 1;
+	gst_query_add_allocation_param (query, NULL, &params);
+
+	if (need_pool) {
+		/* QBUF 中のバッファと、Bピクチャの並べ替え待ちのフレーム分	*/
+		min_buffers = me->priv->num_buffers_in + me->priv->pre_encode_num + 1;
+
+		pool = gst_video_buffer_pool_new ();
+		config = gst_buffer_pool_get_config (pool);
+		gst_buffer_pool_config_set_params (config, caps, info.size,
+										   min_buffers, 0);
+		gst_buffer_pool_config_set_allocator (config, NULL, &params);
+		gst_buffer_pool_config_add_option (config,
+										   GST_BUFFER_POOL_OPTION_VIDEO_META);
+		if (! gst_buffer_pool_set_config (pool, config)) {
+			gst_object_unref (pool);
+			goto config_failed;
+		}
+		GST_INFO_OBJECT (me, "propose pool - size:%" G_GSIZE_FORMAT ", min:%u",
+						 info.size, min_buffers);
+
+		gst_query_add_allocation_pool (query, pool, info.size, min_buffers, 0);
+		gst_object_unref (pool);
+	}
+
+	gst_query_add_allocation_meta (query, GST_VIDEO_META_API_TYPE, NULL);
+
+	return TRUE;
+
+	/* ERRORS */
+no_caps:
+	{
+		GST_DEBUG_OBJECT (me, "no caps specified");
+		return FALSE;
+	}
+invalid_caps:
+	{
+		GST_DEBUG_OBJECT (me, "invalid caps specified");
+		return FALSE;
+	}
+config_failed:
+	{
+		GST_ERROR_OBJECT (me, "failed to set pool config");
+		return FALSE;
+	}
+}
+
 static GstFlowReturn
 gst_acm_h264_enc_pre_push (GstVideoEncoder *enc, GstVideoCodecFrame *frame)
 {
@@ -1421,38 +1747,13 @@ gst_acm_h264_enc_sink_event (GstVideoEncoder * enc, GstEvent *event)
 	}
 	case GST_EVENT_EOS:
 	{
-		gint i;
-		gint flush_encode_num = me->B_pic_mode + 1;
-
 		GST_INFO_OBJECT (me, "H264ENC received GST_EVENT_EOS");
 
-		/* 入力側にサイズ0のバッファがqbufされた時点でエンコード終了とみなし、
-		 * フラッシュが開始される。B_pic_modeに応じた数だけサイズ0のバッファを入力する。
-		 * (同じ数だけエンコード結果が格納された出力バッファがdqbufできる。)
-		 */
-		GST_INFO_OBJECT (me, "flush_encode_num : %d", flush_encode_num);
-		for (i = 0; i < flush_encode_num; i++) {
-			flowRet = gst_acm_h264_enc_handle_out_frame_with_wait(me);
-			if (GST_FLOW_OK != flowRet) {
-				goto handle_out_failed;
-			}
-
-			flowRet = gst_acm_h264_enc_qbuf_null_in(me);
-			if (GST_FLOW_OK != flowRet) {
-				GST_ERROR_OBJECT (me, "failed enqueue null buffer");
-				ret = FALSE;
-				goto out;
-			}
-		}
-
-		/* デバイス側に溜まっているデータを取り出して、down stream へ流す	*/
-		GST_INFO_OBJECT (me, "in_out_frame_count : %d",
-						 me->priv->in_out_frame_count);
-		while (me->priv->in_out_frame_count > 0) {
-			flowRet = gst_acm_h264_enc_handle_out_frame_with_wait(me);
-			if (GST_FLOW_OK != flowRet) {
-				goto handle_out_failed;
-			}
+		GST_VIDEO_ENCODER_STREAM_LOCK (me);
+		flowRet = gst_acm_h264_enc_drain (me);
+		GST_VIDEO_ENCODER_STREAM_UNLOCK (me);
+		if (GST_FLOW_OK != flowRet) {
+			goto handle_out_failed;
 		}
 
 		ret = GST_VIDEO_ENCODER_CLASS (parent_class)->sink_event(enc, event);
@@ -1497,20 +1798,30 @@ gst_acm_h264_enc_init_encoder (GstAcmH264Enc * me)
 	GstAcmV4l2InitParam v4l2InitParam;
 	struct v4l2_format fmt;
 	struct v4l2_control ctrl;
-	guint offset;
 	guint in_buf_size, out_buf_size;
 
 	GST_INFO_OBJECT (me, "H264ENC INITIALIZE ACM ENCODER...");
 
+	/* これまでのプロパティの変更は、以下の初期化で反映される	*/
+	GST_OBJECT_LOCK (me);
+	me->priv->pending_ctrls = 0;
+	GST_OBJECT_UNLOCK (me);
+	me->priv->reconfig_ctrls = 0;
+	me->priv->gop_frame_count = 0;
+	me->priv->capture_counter_base = 0;
+
+	/* 入力のストライドと行数は、最初のフレームの GstVideoMeta に合わせて
+	 * 設定し直す
+	 */
+	me->priv->in_stride = me->input_width;
+	me->priv->in_plane_height = me->input_height;
+
 	/* buffer size : YUV420	*/
 	in_buf_size = me->input_width * me->input_height * 3 / 2;
 	out_buf_size = me->output_width * me->input_height * 3 / 2;
 	GST_INFO_OBJECT (me, "in_buf_size:%u, out_buf_size:%u",
 					 in_buf_size, out_buf_size);
 
-	/* offset	*/
-	offset = me->input_width * me->y_offset + me->x_offset;
-
 	/* setup encode parameter		*/
 	GST_INFO_OBJECT (me, "H264ENC INIT PARAM:");
 	GST_INFO_OBJECT (me, " input_width:%d", me->input_width);
@@ -1531,20 +1842,9 @@ gst_acm_h264_enc_init_encoder (GstAcmH264Enc * me)
 	GST_INFO_OBJECT (me, " B_pic_mode:%d", me->B_pic_mode);
 	GST_INFO_OBJECT (me, " x_offset:%d", me->x_offset);
 	GST_INFO_OBJECT (me, " y_offset:%d", me->y_offset);
-	GST_INFO_OBJECT (me, " offset:%d", offset);
 
 	/* Set format for output (encoder input) */
-	memset(&fmt, 0, sizeof(struct v4l2_format));
-	fmt.type 			= V4L2_BUF_TYPE_VIDEO_OUTPUT;
-	fmt.fmt.pix.width	= me->input_width;
-	fmt.fmt.pix.height	= me->input_height;
-	fmt.fmt.pix.pixelformat = me->input_format;
-	fmt.fmt.pix.field	= V4L2_FIELD_NONE;
-	//fmt.fmt.pix.bytesperline = me->input_width * 3 / 2;	/* YUV420 */
-	//fmt.fmt.pix.sizeimage = fmt.fmt.pix.bytesperline * me->input_height;
-	fmt.fmt.pix.priv = offset;
-	r = gst_acm_v4l2_ioctl(me->video_fd, VIDIOC_S_FMT, &fmt);
-	if (r < 0) {
+	if (! gst_acm_h264_enc_set_in_format(me)) {
 		GST_ERROR_OBJECT(me, "failed ioctl - VIDIOC_S_FMT (OUTPUT)");
 		goto set_init_param_failed;
 	}
@@ -1623,13 +1923,19 @@ gst_acm_h264_enc_init_encoder (GstAcmH264Enc * me)
 	}
 
 	/* setup buffer pool	*/
+	/* 入力は USERPTR で開始し、上流のバッファをコピーせずに QBUF する。
+	 * 最初のフレームが DMABUF の場合は、DMABUF に切り替える
+	 */
+	me->priv->in_io_mode = GST_ACM_V4L2_IO_USERPTR;
+	me->priv->is_decided_in_io_mode = FALSE;
+	me->priv->in_buf_size = in_buf_size;
 	if (NULL == me->pool_in) {
 		memset(&v4l2InitParam, 0, sizeof(GstAcmV4l2InitParam));
 		v4l2InitParam.video_fd = me->video_fd;
 		v4l2InitParam.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
-		v4l2InitParam.mode = GST_ACM_V4L2_IO_MMAP;
+		v4l2InitParam.mode = me->priv->in_io_mode;
 		v4l2InitParam.sizeimage = in_buf_size;
-		v4l2InitParam.init_num_buffers = DEFAULT_NUM_BUFFERS_IN;
+		v4l2InitParam.init_num_buffers = me->priv->num_buffers_in;
 		sinkCaps = gst_caps_from_string ("video/x-raw");
 		me->pool_in = gst_acm_v4l2_buffer_pool_new(&v4l2InitParam, sinkCaps);
 		gst_caps_unref(sinkCaps);
@@ -1644,7 +1950,7 @@ gst_acm_h264_enc_init_encoder (GstAcmH264Enc * me)
 		v4l2InitParam.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 		v4l2InitParam.mode = GST_ACM_V4L2_IO_MMAP;
 		v4l2InitParam.sizeimage = out_buf_size;
-		v4l2InitParam.init_num_buffers = DEFAULT_NUM_BUFFERS_OUT;
+		v4l2InitParam.init_num_buffers = me->priv->num_buffers_out;
 		srcCaps = gst_caps_from_string ("video/x-h264");
 		me->pool_out = gst_acm_v4l2_buffer_pool_new(&v4l2InitParam, srcCaps);
 		gst_caps_unref(srcCaps);
@@ -1744,8 +2050,10 @@ gst_acm_h264_enc_cleanup_encoder (GstAcmH264Enc * me)
 		gst_acm_v4l2_buffer_pool_log_buf_status(me->pool_out);
 #endif
 		gst_buffer_pool_set_active (GST_BUFFER_POOL_CAST (me->pool_out), FALSE);
+		GST_OBJECT_LOCK (me);
 		gst_object_unref (me->pool_out);
 		me->pool_out = NULL;
+		GST_OBJECT_UNLOCK (me);
 	}
 
 	/* STREAMOFF */
@@ -1766,6 +2074,9 @@ gst_acm_h264_enc_cleanup_encoder (GstAcmH264Enc * me)
 		GST_DEBUG_OBJECT(me, "STREAMOFF CAPTURE - ret:%d", r);
 	}
 
+	/* STREAMOFF によりドライバから取り除かれた、上流のバッファを解放	*/
+	gst_acm_h264_enc_release_all_in_refs (me);
+
 	me->priv->is_inited_encoder = FALSE;
 
 out:
@@ -1863,7 +2174,10 @@ gst_acm_h264_enc_handle_in_frame_with_wait(GstAcmH264Enc * me, GstBuffer *inbuf)
 		GST_INFO_OBJECT(me, "wait until enable dqbuf (pool_in)");
 		gst_acm_v4l2_buffer_pool_log_buf_status(me->pool_out);
 #endif
-		/* 書き込みができる状態になるまで待ってから書き込む		*/
+		/* 書き込みができる状態になるまで待ってから書き込む。
+		 * 待っている間も出力タスクが finish_frame できるよう、ストリームロックを解放する
+		 */
+		GST_VIDEO_ENCODER_STREAM_UNLOCK (me);
 		do {
 			FD_ZERO(&write_fds);
 			FD_SET(me->video_fd, &write_fds);
@@ -1881,6 +2195,7 @@ gst_acm_h264_enc_handle_in_frame_with_wait(GstAcmH264Enc * me, GstBuffer *inbuf)
 			GST_INFO_OBJECT(me, " total %10.10f", g_time_total_select_in);
 #endif
 		} while (r < 0 && (EINTR == errno || EAGAIN == errno));
+		GST_VIDEO_ENCODER_STREAM_LOCK (me);
 		if (r > 0) {
 			flowRet = gst_acm_v4l2_buffer_pool_dqbuf(me->pool_in, &v4l2buf_in);
 			if (GST_FLOW_OK != flowRet) {
@@ -1901,14 +2216,19 @@ gst_acm_h264_enc_handle_in_frame_with_wait(GstAcmH264Enc * me, GstBuffer *inbuf)
 		goto dqbuf_failed;
 	}
 
+	/* エンコードが終わったので、上流のバッファを返す	*/
+	gst_acm_h264_enc_release_in_ref(me,
+		GST_ACM_V4L2_META_GET (v4l2buf_in)->vbuffer.index);
+
 	flowRet = gst_acm_h264_enc_handle_in_frame(me, v4l2buf_in, inbuf);
 	if (GST_FLOW_OK != flowRet) {
 		goto handle_in_failed;
 	}
 
-	if (gst_buffer_get_size(inbuf) > 0) {
+	if (gst_buffer_get_size(inbuf) > 0
+		|| gst_buffer_get_acm_dmabuf_meta (inbuf)) {
 		/* サイズ 0 のバッファはダミー（プレエンコード or フラッシュ）なのでカウントしない	*/
-		me->priv->in_out_frame_count++;
+		g_atomic_int_inc (&me->priv->in_out_frame_count);
 	}
 
 out:
@@ -1953,290 +2273,1258 @@ handle_in_failed:
 	}
 }
 
-static GstFlowReturn
-gst_acm_h264_enc_handle_in_frame(GstAcmH264Enc * me,
-	GstBuffer *v4l2buf_in, GstBuffer *inbuf)
+/* 入力フレームのレイアウトが、エンコーダに設定した入力のレイアウトと一致するか	*/
+static gboolean
+gst_acm_h264_enc_is_importable_layout(GstAcmH264Enc * me, GstBuffer *inbuf)
 {
-	GstFlowReturn flowRet = GST_FLOW_OK;
-	GstMapInfo map;
-	gsize inputDataSize = 0;
+	GstVideoMeta *vmeta;
+
+	vmeta = gst_buffer_get_video_meta (inbuf);
+	if (NULL == vmeta) {
+		/* メタデータが無ければ、パディングの無いレイアウト	*/
+		return (me->priv->in_stride == me->input_width
+				&& me->priv->in_plane_height == me->input_height);
+	}
+
+	if (vmeta->n_planes != 2
+		|| vmeta->offset[0] != 0
+		|| vmeta->stride[0] != me->priv->in_stride
+		|| vmeta->stride[1] != me->priv->in_stride
+		|| vmeta->offset[1] != (gsize)me->priv->in_stride
+								* me->priv->in_plane_height) {
+		GST_DEBUG_OBJECT (me, "layout mismatch - stride:%d,%d offset:%"
+			G_GSIZE_FORMAT ",%" G_GSIZE_FORMAT, vmeta->stride[0],
+			vmeta->stride[1], vmeta->offset[0], vmeta->offset[1]);
+		return FALSE;
+	}
 
-	GST_DEBUG_OBJECT(me, "inbuf size=%" G_GSIZE_FORMAT, gst_buffer_get_size(inbuf));
+	return TRUE;
+}
 
-	/* 入力データをコピー	*/
-	gst_buffer_map(inbuf, &map, GST_MAP_READ);
-	inputDataSize = map.size;
-	if (0 == inputDataSize) {
-		gst_buffer_resize(v4l2buf_in, 0, 0);
+/* USERPTR でそのまま QBUF できるか調べ、可能ならマップして ref に保持する	*/
+static gboolean
+gst_acm_h264_enc_try_import_userptr(GstAcmH264Enc * me,
+	GstBuffer *inbuf, GstAcmH264EncInRef *ref)
+{
+	if (gst_buffer_n_memory (inbuf) != 1
+		|| ! gst_acm_h264_enc_is_importable_layout (me, inbuf)) {
+		return FALSE;
 	}
-	else {
-		gst_buffer_fill(v4l2buf_in, 0, map.data, map.size);
+
+	if (! gst_buffer_map (inbuf, &ref->map, GST_MAP_READ)) {
+		return FALSE;
+	}
+	if (ref->map.size < me->priv->in_buf_size
+		|| ((guintptr)ref->map.data & (GST_ACM_V4L2_USERPTR_ALIGN - 1)) != 0) {
+		GST_DEBUG_OBJECT (me, "cannot import - data:%p, size:%" G_GSIZE_FORMAT,
+						  ref->map.data, ref->map.size);
+		gst_buffer_unmap (inbuf, &ref->map);
+		return FALSE;
 	}
-	gst_buffer_unmap(inbuf, &map);
-	GST_DEBUG_OBJECT(me, "v4l2buf_in size:%" G_GSIZE_FORMAT ", input_size:%" G_GSIZE_FORMAT,
-			 gst_buffer_get_size(v4l2buf_in), inputDataSize);
 
-	/* enqueue buffer	*/
-	flowRet = gst_acm_v4l2_buffer_pool_qbuf (me->pool_in, v4l2buf_in, inputDataSize);
-	if (GST_FLOW_OK != flowRet) {
-		GST_ERROR_OBJECT (me, "gst_acm_v4l2_buffer_pool_qbuf() returns %s",
-						  gst_flow_get_name (flowRet));
-		goto qbuf_failed;
+	ref->buf = gst_buffer_ref (inbuf);
+	ref->is_mapped = TRUE;
+
+	return TRUE;
+}
+
+/* QBUF 中に保持していた上流のバッファを解放する	*/
+static void
+gst_acm_h264_enc_release_in_ref(GstAcmH264Enc * me, guint index)
+{
+	GstAcmH264EncInRef *ref;
+
+	g_assert (index < GST_ACM_V4L2_MAX_BUFFERS);
+	ref = &(me->priv->in_refs[index]);
+	if (NULL == ref->buf) {
+		return;
 	}
 
-out:
-	return flowRet;
-	
-	/* ERRORS */
-qbuf_failed:
-	{
-		GST_ELEMENT_ERROR (me, STREAM, ENCODE, (NULL),
-			("could not queue buffer %d (%s)", errno, g_strerror (errno)));
-		flowRet = GST_FLOW_ERROR;
-		goto out;
+	if (ref->is_mapped) {
+		gst_buffer_unmap (ref->buf, &ref->map);
+		ref->is_mapped = FALSE;
 	}
+	gst_buffer_unref (ref->buf);
+	ref->buf = NULL;
 }
 
-static GstFlowReturn
-gst_acm_h264_enc_get_spspps(GstAcmH264Enc * me)
+static void
+gst_acm_h264_enc_release_all_in_refs(GstAcmH264Enc * me)
 {
-	GstFlowReturn flowRet = GST_FLOW_OK;
-	GstBuffer *v4l2buf_out = NULL;
-	int r = 0;
-	fd_set read_fds;
-	struct timeval tv;
+	guint i;
 
-	/* 1回目のCAPTURE(出力)側バッファのDQ時にSPS/PPSをセットしたバッファが返る。*/
+	for (i = 0; i < GST_ACM_V4L2_MAX_BUFFERS; i++) {
+		gst_acm_h264_enc_release_in_ref(me, i);
+	}
+}
 
-	/* CAPTURE側から DQBUF するためには、まずOUTPUT側に QBUF する必要がある */
-	flowRet = gst_acm_h264_enc_qbuf_null_in(me);
-	if (GST_FLOW_OK != flowRet) {
-		GST_ERROR_OBJECT (me, "failed enqueue null buffer");
-		goto out;
+/* OUTPUT 側のフォーマットを、in_stride と in_plane_height で設定する。
+ * ドライバは、UV プレーンを bytesperline * height の位置から読むので、
+ * height には Y プレーンの行数 (下端のパディングを含む) を設定する。
+ * エンコードする画像サイズは、CAPTURE 側の output_height で決まる
+ */
+static gboolean
+gst_acm_h264_enc_set_in_format(GstAcmH264Enc * me)
+{
+	struct v4l2_format fmt;
+	guint offset;
+
+	/* offset (x-offset / y-offset による切り出し位置)	*/
+	offset = me->priv->in_stride * me->y_offset + me->x_offset;
+
+	GST_INFO_OBJECT (me, "input format - stride:%d, height:%d, offset:%u",
+					 me->priv->in_stride, me->priv->in_plane_height, offset);
+
+	memset(&fmt, 0, sizeof(struct v4l2_format));
+	fmt.type 			= V4L2_BUF_TYPE_VIDEO_OUTPUT;
+	fmt.fmt.pix.width	= me->input_width;
+	fmt.fmt.pix.height	= me->priv->in_plane_height;
+	fmt.fmt.pix.pixelformat = me->input_format;
+	fmt.fmt.pix.field	= V4L2_FIELD_NONE;
+	fmt.fmt.pix.bytesperline = me->priv->in_stride;
+	fmt.fmt.pix.sizeimage =
+		me->priv->in_stride * me->priv->in_plane_height * 3 / 2;
+	fmt.fmt.pix.priv = offset;
+	if (gst_acm_v4l2_ioctl(me->video_fd, VIDIOC_S_FMT, &fmt) < 0) {
+		return FALSE;
 	}
+	me->priv->in_buf_size =
+		me->priv->in_stride * me->priv->in_plane_height * 3 / 2;
 
-	/* dequeue buffer	*/
-	flowRet = gst_acm_v4l2_buffer_pool_dqbuf (me->pool_out, &v4l2buf_out);
-	if (GST_FLOW_DQBUF_EAGAIN == flowRet) {
-		/* 読み込みできる状態になるまで待ってから読み込む		*/
-		do {
-			FD_ZERO(&read_fds);
-			FD_SET(me->video_fd, &read_fds);
-			tv.tv_sec = 0;
-			tv.tv_usec = SELECT_TIMEOUT_MSEC * 1000;
-			r = select(me->video_fd + 1, &read_fds, NULL, NULL, &tv);
-		} while (r < 0 && (EINTR == errno || EAGAIN == errno));
-		if (r > 0) {
-			flowRet = gst_acm_v4l2_buffer_pool_dqbuf(me->pool_out, &v4l2buf_out);
-			if (GST_FLOW_OK != flowRet) {
-				GST_ERROR_OBJECT (me, "gst_acm_v4l2_buffer_pool_dqbuf() returns %s",
-								  gst_flow_get_name (flowRet));
-				goto dqbuf_failed;
-			}
-		}
-		else if (r < 0) {
-			goto select_failed;
-		}
-		else if (0 == r) {
-			/* timeoutしたらエラー	*/
-			GST_INFO_OBJECT(me, "select() for output is timeout");
-			goto select_timeout;
-		}
+	return TRUE;
+}
+
+/* 入力フレームのストライドと、Y プレーンの行数を取得する。
+ * 行数は UV プレーンの位置から求めるので、下端のパディング
+ * (1080 ライン の画像を 1088 ラインで確保した場合等) も含む。
+ * エンコーダに設定できないレイアウト (UV プレーンが行の途中から始まる等)
+ * の場合は FALSE
+ */
+static gboolean
+gst_acm_h264_enc_get_in_layout(GstAcmH264Enc * me, GstBuffer *inbuf,
+	gint *stride, gint *plane_height)
+{
+	GstVideoMeta *vmeta;
+
+	*stride = me->input_width;
+	*plane_height = me->input_height;
+
+	vmeta = gst_buffer_get_video_meta (inbuf);
+	if (NULL == vmeta) {
+		return TRUE;
 	}
-	else if (GST_FLOW_OK != flowRet) {
-		GST_ERROR_OBJECT (me, "gst_acm_v4l2_buffer_pool_dqbuf() returns %s",
-						  gst_flow_get_name (flowRet));
-		goto dqbuf_failed;
+
+	if (vmeta->n_planes != 2
+		|| vmeta->offset[0] != 0
+		|| vmeta->stride[0] != vmeta->stride[1]
+		|| vmeta->stride[0] < me->input_width
+		|| 0 != vmeta->offset[1] % vmeta->stride[0]
+		|| vmeta->offset[1] / vmeta->stride[0] < me->input_height) {
+		goto not_supported;
+	}
+	/* ストライド（バイト数）は 16 の倍数でなければならない */
+	if (0 != (vmeta->stride[0] * 3 / 2) % 16) {
+		goto not_supported;
+	}
+	/* 入力オフセット = stride * y_offset + x_offset は 32 の倍数であること。
+	 * stride * y_offset / 2 + x_offset も同様に 32 の倍数であること
+	 */
+	if (0 != (vmeta->stride[0] * me->y_offset + me->x_offset) % 32
+		|| 0 != (vmeta->stride[0] * me->y_offset / 2 + me->x_offset) % 32) {
+		goto not_supported;
 	}
 
-	/* SPSPPS の内容をコピー */
-	me->priv->spspps_buf = gst_buffer_copy(v4l2buf_out);
-	me->priv->spspps_size = gst_buffer_get_size(me->priv->spspps_buf);
+	*stride = vmeta->stride[0];
+	*plane_height = vmeta->offset[1] / vmeta->stride[0];
 
-	/* QBUF して戻す	*/
-	flowRet = gst_acm_v4l2_buffer_pool_qbuf (
-		me->pool_out, v4l2buf_out, gst_buffer_get_size(v4l2buf_out));
-	if (GST_FLOW_OK != flowRet) {
-		GST_ERROR_OBJECT (me, "gst_acm_v4l2_buffer_pool_qbuf() returns %s",
-						  gst_flow_get_name (flowRet));
-		goto qbuf_failed;
-	}
+	return TRUE;
 
-	/* SPS/PPS なので、in_out_frame_count は変更しない */
+not_supported:
+	GST_INFO_OBJECT (me, "unsupported layout - stride:%d,%d offset:%"
+		G_GSIZE_FORMAT ",%" G_GSIZE_FORMAT, vmeta->stride[0],
+		vmeta->stride[1], vmeta->offset[0], vmeta->offset[1]);
+	return FALSE;
+}
 
-out:
-	return flowRet;
-	
-	/* ERRORS */
-select_failed:
+/* 入力バッファの DMABUF の fd を返す。DMABUF でなければ -1。
+ * GstAcmDmabufMeta の他に、標準の dmabuf メモリも受け付ける。
+ * *size には、デバイスが読める DMABUF のサイズを返す (不明な場合は 0)
+ */
+static gint
+gst_acm_h264_enc_get_in_dmabuf_fd(GstBuffer *inbuf, gsize *size)
+{
+	GstAcmDmabufMeta *dmabufmeta;
+	off_t end;
+#if GST_CHECK_VERSION(1, 2, 0)
+	GstMemory *mem;
+	gsize maxsize;
+#endif
+
+	*size = 0;
+
+	dmabufmeta = gst_buffer_get_acm_dmabuf_meta (inbuf);
+	if (dmabufmeta) {
+		/* メタデータはサイズを持たないので、DMABUF 自体のサイズを問い合わせる	*/
+		end = lseek (dmabufmeta->fd, 0, SEEK_END);
+		if (end > 0) {
+			*size = end;
+			lseek (dmabufmeta->fd, 0, SEEK_SET);
+		}
+		return dmabufmeta->fd;
+	}
+
+#if GST_CHECK_VERSION(1, 2, 0)
+	/* fd の先頭からフレームが始まる、1 つのメモリだけをインポートする	*/
+	if (1 == gst_buffer_n_memory (inbuf)) {
+		mem = gst_buffer_peek_memory (inbuf, 0);
+		if (gst_is_dmabuf_memory (mem) && 0 == mem->offset) {
+			gst_memory_get_sizes (mem, NULL, &maxsize);
+			*size = maxsize;
+			return gst_dmabuf_memory_get_fd (mem);
+		}
+	}
+#endif
+
+	return -1;
+}
+
+/* 入力フレームを、エンコーダに設定したレイアウトに詰め直してコピーする。
+ * メタデータの無いフレームは、パディングの無いレイアウト
+ * (ストライドは input_width) として扱う
+ */
+static gsize
+gst_acm_h264_enc_copy_in_frame(GstAcmH264Enc * me, GstBuffer *inbuf,
+	GstBuffer *v4l2buf_in)
+{
+	GstVideoMeta *vmeta;
+	GstMapInfo src, dst;
+	gint plane, row, rows;
+	gint nPlanes;
+	gint srcStride[2];
+	gsize srcOffset[2];
+	gsize src_offset, dst_offset;
+	gsize size;
+
+	if (gst_acm_h264_enc_is_importable_layout (me, inbuf)) {
+		/* レイアウトが同じなので、そのままコピー	*/
+		gst_buffer_map(inbuf, &src, GST_MAP_READ);
+		size = MIN (src.size, me->priv->in_buf_size);
+		gst_buffer_fill(v4l2buf_in, 0, src.data, size);
+		gst_buffer_unmap(inbuf, &src);
+
+		return size;
+	}
+
+	vmeta = gst_buffer_get_video_meta (inbuf);
+	if (vmeta) {
+		nPlanes = MIN (vmeta->n_planes, 2);
+		for (plane = 0; plane < nPlanes; plane++) {
+			srcStride[plane] = vmeta->stride[plane];
+			srcOffset[plane] = vmeta->offset[plane];
+		}
+	}
+	else {
+		nPlanes = 2;
+		srcStride[0] = srcStride[1] = me->input_width;
+		srcOffset[0] = 0;
+		srcOffset[1] = (gsize)me->input_width * me->input_height;
+	}
+
+	gst_buffer_map(inbuf, &src, GST_MAP_READ);
+	gst_buffer_map(v4l2buf_in, &dst, GST_MAP_WRITE);
+	for (plane = 0; plane < nPlanes; plane++) {
+		rows = (0 == plane) ? me->input_height : me->input_height / 2;
+		dst_offset = (0 == plane) ? 0
+			: (gsize)me->priv->in_stride * me->priv->in_plane_height;
+		for (row = 0; row < rows; row++) {
+			src_offset = srcOffset[plane] + (gsize)srcStride[plane] * row;
+			if (src_offset + me->input_width > src.size) {
+				break;
+			}
+			memcpy (dst.data + dst_offset + (gsize)me->priv->in_stride * row,
+					src.data + src_offset, me->input_width);
+		}
+	}
+	gst_buffer_unmap(v4l2buf_in, &dst);
+	gst_buffer_unmap(inbuf, &src);
+
+	return me->priv->in_buf_size;
+}
+
+/* 最初のフレームで、入力の I/O モードとレイアウトを決める。
+ * V4L2 では、キュー毎にメモリの種類とフォーマットが固定されるため、
+ * 変更する場合は STREAMOFF して作り直す
+ */
+static gboolean
+gst_acm_h264_enc_decide_in_io_mode(GstAcmH264Enc * me, GstBuffer *inbuf)
+{
+	gint dmabufFd;
+	gsize dmabufSize;
+	GstAcmV4l2InitParam v4l2InitParam;
+	GstCaps *sinkCaps;
+	struct v4l2_requestbuffers breq;
+	enum v4l2_buf_type type;
+	GstAcmV4l2IOMode io_mode = GST_ACM_V4L2_IO_USERPTR;
+	gboolean is_programmable;
+	gint stride;
+	gint planeHeight;
+	int r;
+
+	me->priv->is_decided_in_io_mode = TRUE;
+
+	/* 行末がパディングされた入力は、ストライドをエンコーダに設定して、
+	 * 詰め直すことなく入力する
+	 */
+	is_programmable = gst_acm_h264_enc_get_in_layout (me, inbuf,
+						&stride, &planeHeight);
+
+	dmabufFd = gst_acm_h264_enc_get_in_dmabuf_fd (inbuf, &dmabufSize);
+	if (-1 != dmabufFd) {
+		if (is_programmable) {
+			io_mode = GST_ACM_V4L2_IO_DMABUF;
+		}
+		/* CPU からアクセスできれば、USERPTR (コピー) のまま続ける	*/
+		else if (gst_buffer_get_size (inbuf) < me->priv->in_buf_size) {
+			goto not_importable;
+		}
+	}
+
+	if (io_mode == me->priv->in_io_mode
+		&& stride == me->priv->in_stride
+		&& planeHeight == me->priv->in_plane_height) {
+		GST_INFO_OBJECT (me, "input io mode : USERPTR");
+		return TRUE;
+	}
+
+	GST_INFO_OBJECT (me, "input io mode : %s, stride:%d, height:%d",
+					 GST_ACM_V4L2_IO_DMABUF == io_mode ? "DMABUF" : "USERPTR",
+					 stride, planeHeight);
+
+	type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+	r = gst_acm_v4l2_ioctl (me->video_fd, VIDIOC_STREAMOFF, &type);
+	if (r < 0) {
+		goto streamoff_failed;
+	}
+	gst_acm_h264_enc_release_all_in_refs (me);
+
+	gst_buffer_pool_set_active (GST_BUFFER_POOL_CAST (me->pool_in), FALSE);
+	gst_object_unref (me->pool_in);
+	me->pool_in = NULL;
+	me->priv->num_inbuf_acquired = 0;
+
+	memset (&breq, 0, sizeof (struct v4l2_requestbuffers));
+	breq.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+	breq.count = 0;
+	breq.memory = V4L2_MEMORY_USERPTR;
+	if (gst_acm_v4l2_ioctl (me->video_fd, VIDIOC_REQBUFS, &breq) < 0) {
+		goto reqbufs_failed;
+	}
+
+	if (stride != me->priv->in_stride
+		|| planeHeight != me->priv->in_plane_height) {
+		me->priv->in_stride = stride;
+		me->priv->in_plane_height = planeHeight;
+		if (! gst_acm_h264_enc_set_in_format (me)) {
+			GST_WARNING_OBJECT (me, "failed ioctl - VIDIOC_S_FMT (OUTPUT) %d (%s), "
+								"fall back to copy", errno, g_strerror (errno));
+
+			/* 詰め直してコピーする	*/
+			me->priv->in_stride = me->input_width;
+			me->priv->in_plane_height = me->input_height;
+			if (! gst_acm_h264_enc_set_in_format (me)) {
+				goto set_format_failed;
+			}
+			if (GST_ACM_V4L2_IO_DMABUF == io_mode) {
+				if (gst_buffer_get_size (inbuf) < me->priv->in_buf_size) {
+					goto not_importable;
+				}
+				io_mode = GST_ACM_V4L2_IO_USERPTR;
+			}
+		}
+	}
+
+	/* デバイスが DMABUF の終端を越えて読まないよう、サイズが足りなければコピーする	*/
+	if (GST_ACM_V4L2_IO_DMABUF == io_mode
+		&& dmabufSize < me->priv->in_buf_size) {
+		GST_WARNING_OBJECT (me, "dmabuf size %" G_GSIZE_FORMAT
+							" is smaller than %u, fall back to copy",
+							dmabufSize, me->priv->in_buf_size);
+		if (gst_buffer_get_size (inbuf) < me->priv->in_buf_size) {
+			goto not_importable;
+		}
+		io_mode = GST_ACM_V4L2_IO_USERPTR;
+	}
+
+	me->priv->in_io_mode = io_mode;
+	if (-1 != dmabufFd) {
+		me->priv->in_dmabuf_fd = dmabufFd;
+	}
+
+	memset(&v4l2InitParam, 0, sizeof(GstAcmV4l2InitParam));
+	v4l2InitParam.video_fd = me->video_fd;
+	v4l2InitParam.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+	v4l2InitParam.mode = me->priv->in_io_mode;
+	v4l2InitParam.sizeimage = me->priv->in_buf_size;
+	v4l2InitParam.init_num_buffers = me->priv->num_buffers_in;
+	sinkCaps = gst_caps_from_string ("video/x-raw");
+	me->pool_in = gst_acm_v4l2_buffer_pool_new(&v4l2InitParam, sinkCaps);
+	gst_caps_unref(sinkCaps);
+	if (! me->pool_in) {
+		goto buffer_pool_new_failed;
+	}
+	gst_buffer_pool_set_active (GST_BUFFER_POOL_CAST(me->pool_in), TRUE);
+
+	r = gst_acm_v4l2_ioctl (me->video_fd, VIDIOC_STREAMON, &type);
+	if (r < 0) {
+		goto streamon_failed;
+	}
+
+	return TRUE;
+
+	/* ERRORS */
+not_importable:
+	{
+		GST_ELEMENT_ERROR (me, STREAM, FORMAT, (NULL),
+			("dmabuf input with unsupported layout"));
+		return FALSE;
+	}
+streamoff_failed:
+	{
+		GST_ELEMENT_ERROR (me, STREAM, ENCODE, (NULL),
+			("error with STREAMOFF %d (%s)", errno, g_strerror (errno)));
+		return FALSE;
+	}
+reqbufs_failed:
+	{
+		GST_ELEMENT_ERROR (me, RESOURCE, FAILED, (NULL),
+			("error with REQBUFS %d (%s)", errno, g_strerror (errno)));
+		return FALSE;
+	}
+set_format_failed:
+	{
+		GST_ELEMENT_ERROR (me, STREAM, ENCODE, (NULL),
+			("error with S_FMT %d (%s)", errno, g_strerror (errno)));
+		return FALSE;
+	}
+buffer_pool_new_failed:
+	{
+		GST_ELEMENT_ERROR (me, RESOURCE, FAILED, (NULL),
+			("could not create input pool"));
+		return FALSE;
+	}
+streamon_failed:
+	{
+		GST_ELEMENT_ERROR (me, STREAM, ENCODE, (NULL),
+			("error with STREAMON %d (%s)", errno, g_strerror (errno)));
+		return FALSE;
+	}
+}
+
+static GstFlowReturn
+gst_acm_h264_enc_handle_in_frame(GstAcmH264Enc * me,
+	GstBuffer *v4l2buf_in, GstBuffer *inbuf)
+{
+	GstFlowReturn flowRet = GST_FLOW_OK;
+	GstAcmV4l2Meta *meta;
+	GstAcmH264EncInRef *ref;
+	gsize inputDataSize = 0;
+
+	GST_DEBUG_OBJECT(me, "inbuf size=%" G_GSIZE_FORMAT, gst_buffer_get_size(inbuf));
+
+	meta = GST_ACM_V4L2_META_GET (v4l2buf_in);
+	g_assert (meta != NULL);
+	gst_acm_h264_enc_release_in_ref(me, meta->vbuffer.index);
+	ref = &(me->priv->in_refs[meta->vbuffer.index]);
+
+	if (GST_ACM_V4L2_IO_DMABUF == me->priv->in_io_mode) {
+		gsize dmabufSize;
+		gint dmabufFd = gst_acm_h264_enc_get_in_dmabuf_fd (inbuf, &dmabufSize);
+
+		if (-1 != dmabufFd) {
+			if (! gst_acm_h264_enc_is_importable_layout (me, inbuf)
+				|| dmabufSize < me->priv->in_buf_size) {
+				goto not_importable;
+			}
+			/* DQBUF されるまで、上流のバッファを保持する	*/
+			ref->buf = gst_buffer_ref (inbuf);
+			me->priv->in_dmabuf_fd = dmabufFd;
+			inputDataSize = me->priv->in_buf_size;
+		}
+		else if (0 != gst_buffer_get_size(inbuf)) {
+			goto not_importable;
+		}
+		/* サイズ 0 のバッファは、直前の fd で QBUF する	*/
+		meta->vbuffer.m.fd = me->priv->in_dmabuf_fd;
+		meta->vbuffer.length = me->priv->in_buf_size;
+	}
+	else if (0 == gst_buffer_get_size(inbuf)) {
+		if (gst_buffer_get_acm_dmabuf_meta (inbuf)) {
+			/* CPU からアクセスできない DMABUF は、途中からは受け付けられない	*/
+			goto not_importable;
+		}
+		meta->vbuffer.m.userptr = (unsigned long)meta->mem;
+		meta->vbuffer.length = me->priv->in_buf_size;
+	}
+	else if (gst_acm_h264_enc_try_import_userptr (me, inbuf, ref)) {
+		/* ゼロコピー : 上流のバッファをそのまま QBUF する	*/
+		inputDataSize = ref->map.size;
+		meta->vbuffer.m.userptr = (unsigned long)ref->map.data;
+		meta->vbuffer.length = ref->map.size;
+	}
+	else {
+		/* アライメントやレイアウトが合わない場合のみ、入力データをコピー	*/
+		GST_LOG_OBJECT (me, "copy input frame");
+		inputDataSize = gst_acm_h264_enc_copy_in_frame (me, inbuf, v4l2buf_in);
+		meta->vbuffer.m.userptr = (unsigned long)meta->mem;
+		meta->vbuffer.length = me->priv->in_buf_size;
+	}
+	GST_DEBUG_OBJECT(me, "v4l2buf_in index:%u, input_size:%" G_GSIZE_FORMAT,
+			 meta->vbuffer.index, inputDataSize);
+
+	/* enqueue buffer	*/
+	flowRet = gst_acm_v4l2_buffer_pool_qbuf (me->pool_in, v4l2buf_in, inputDataSize);
+	if (GST_FLOW_OK != flowRet) {
+		GST_ERROR_OBJECT (me, "gst_acm_v4l2_buffer_pool_qbuf() returns %s",
+						  gst_flow_get_name (flowRet));
+		gst_acm_h264_enc_release_in_ref(me, meta->vbuffer.index);
+		goto qbuf_failed;
+	}
+
+out:
+	return flowRet;
+	
+	/* ERRORS */
+not_importable:
+	{
+		GST_ELEMENT_ERROR (me, STREAM, FORMAT, (NULL),
+			("input buffer cannot be imported as dmabuf"));
+		flowRet = GST_FLOW_ERROR;
+		goto out;
+	}
+qbuf_failed:
+	{
+		GST_ELEMENT_ERROR (me, STREAM, ENCODE, (NULL),
+			("could not queue buffer %d (%s)", errno, g_strerror (errno)));
+		flowRet = GST_FLOW_ERROR;
+		goto out;
+	}
+}
+
+static GstFlowReturn
+gst_acm_h264_enc_get_spspps(GstAcmH264Enc * me)
+{
+	GstFlowReturn flowRet = GST_FLOW_OK;
+	GstBuffer *v4l2buf_out = NULL;
+	int r = 0;
+	fd_set read_fds;
+	struct timeval tv;
+
+	/* 1回目のCAPTURE(出力)側バッファのDQ時にSPS/PPSをセットしたバッファが返る。*/
+
+	/* CAPTURE側から DQBUF するためには、まずOUTPUT側に QBUF する必要がある */
+	flowRet = gst_acm_h264_enc_qbuf_null_in(me);
+	if (GST_FLOW_OK != flowRet) {
+		GST_ERROR_OBJECT (me, "failed enqueue null buffer");
+		goto out;
+	}
+
+	/* dequeue buffer	*/
+	flowRet = gst_acm_v4l2_buffer_pool_dqbuf (me->pool_out, &v4l2buf_out);
+	if (GST_FLOW_DQBUF_EAGAIN == flowRet) {
+		/* 読み込みできる状態になるまで待ってから読み込む		*/
+		do {
+			FD_ZERO(&read_fds);
+			FD_SET(me->video_fd, &read_fds);
+			tv.tv_sec = 0;
+			tv.tv_usec = SELECT_TIMEOUT_MSEC * 1000;
+			r = select(me->video_fd + 1, &read_fds, NULL, NULL, &tv);
+		} while (r < 0 && (EINTR == errno || EAGAIN == errno));
+		if (r > 0) {
+			flowRet = gst_acm_v4l2_buffer_pool_dqbuf(me->pool_out, &v4l2buf_out);
+			if (GST_FLOW_OK != flowRet) {
+				GST_ERROR_OBJECT (me, "gst_acm_v4l2_buffer_pool_dqbuf() returns %s",
+								  gst_flow_get_name (flowRet));
+				goto dqbuf_failed;
+			}
+		}
+		else if (r < 0) {
+			goto select_failed;
+		}
+		else if (0 == r) {
+			/* timeoutしたらエラー	*/
+			GST_INFO_OBJECT(me, "select() for output is timeout");
+			goto select_timeout;
+		}
+	}
+	else if (GST_FLOW_OK != flowRet) {
+		GST_ERROR_OBJECT (me, "gst_acm_v4l2_buffer_pool_dqbuf() returns %s",
+						  gst_flow_get_name (flowRet));
+		goto dqbuf_failed;
+	}
+
+	/* SPSPPS の内容をコピー */
+	me->priv->spspps_buf = gst_buffer_copy(v4l2buf_out);
+	me->priv->spspps_size = gst_buffer_get_size(me->priv->spspps_buf);
+
+	/* QBUF して戻す	*/
+	flowRet = gst_acm_v4l2_buffer_pool_qbuf (
+		me->pool_out, v4l2buf_out, gst_buffer_get_size(v4l2buf_out));
+	if (GST_FLOW_OK != flowRet) {
+		GST_ERROR_OBJECT (me, "gst_acm_v4l2_buffer_pool_qbuf() returns %s",
+						  gst_flow_get_name (flowRet));
+		goto qbuf_failed;
+	}
+
+	/* SPS/PPS なので、in_out_frame_count は変更しない */
+
+out:
+	return flowRet;
+	
+	/* ERRORS */
+select_failed:
+	{
+		GST_ELEMENT_ERROR (me, STREAM, ENCODE, (NULL),
+			("error with select() %d (%s)", errno, g_strerror (errno)));
+		flowRet = GST_FLOW_ERROR;
+		goto out;
+	}
+select_timeout:
+	{
+		GST_ERROR_OBJECT (me, "pool_in - buffers:%d, queued:%d",
+						  me->pool_in->num_buffers, me->pool_in->num_queued);
+		gst_acm_v4l2_buffer_pool_log_buf_status(me->pool_in);
+		
+		GST_ERROR_OBJECT (me, "pool_out - buffers:%d, queued:%d",
+						  me->pool_out->num_buffers, me->pool_out->num_queued);
+		gst_acm_v4l2_buffer_pool_log_buf_status(me->pool_out);
+		
+		GST_ELEMENT_ERROR (me, STREAM, ENCODE, (NULL),
+			("timeout with select()"));
+		flowRet = GST_FLOW_ERROR;
+		goto out;
+	}
+dqbuf_failed:
+	{
+		GST_ELEMENT_ERROR (me, STREAM, ENCODE, (NULL),
+			("could not dequeue buffer. %d (%s)", errno, g_strerror (errno)));
+		flowRet = GST_FLOW_ERROR;
+		goto out;
+	}
+qbuf_failed:
+	{
+		GST_ELEMENT_ERROR (me, STREAM, ENCODE, (NULL),
+			("could not queue buffer. %d (%s)", errno, g_strerror (errno)));
+		flowRet = GST_FLOW_ERROR;
+		goto out;
+	}
+}
+
+/* CAPTURE 側から DQBUF する。timeout_msec 以内に取り出せなければ、
+ * GST_FLOW_DQBUF_EAGAIN を返す
+ */
+static GstFlowReturn
+gst_acm_h264_enc_dqbuf_out(GstAcmH264Enc * me, guint timeout_msec,
+	GstBuffer **v4l2buf_out)
+{
+	GstFlowReturn flowRet = GST_FLOW_OK;
+	int r = 0;
+	fd_set read_fds;
+	struct timeval tv;
+#if DBG_MEASURE_PERF_SELECT_OUT
+	double time_start, time_end;
+#endif
+
+	/* dequeue buffer	*/
+	flowRet = gst_acm_v4l2_buffer_pool_dqbuf (me->pool_out, v4l2buf_out);
+	if (GST_FLOW_DQBUF_EAGAIN == flowRet) {
+		
+		/* 読み込みできる状態になるまで待ってから読み込む		*/
+#if DBG_LOG_PERF_SELECT_OUT
+		GST_INFO_OBJECT(me, "wait until enable dqbuf (pool_out)");
+		gst_acm_v4l2_buffer_pool_log_buf_status(me->pool_out);
+#endif
+		do {
+			FD_ZERO(&read_fds);
+			FD_SET(me->video_fd, &read_fds);
+			tv.tv_sec = timeout_msec / 1000;
+			tv.tv_usec = (timeout_msec % 1000) * 1000;
+#if DBG_MEASURE_PERF_SELECT_OUT
+			time_start = gettimeofday_sec();
+#endif
+			r = select(me->video_fd + 1, &read_fds, NULL, NULL, &tv);
+#if DBG_MEASURE_PERF_SELECT_OUT
+			time_end = gettimeofday_sec();
+			GST_INFO_OBJECT(me, " select() out : %10.10f", time_end - time_start);
+			g_time_total_select_out += (time_end - time_start);
+			GST_INFO_OBJECT(me, " total %10.10f", g_time_total_select_out);
+#endif
+		} while (r < 0 && (EINTR == errno || EAGAIN == errno));
+		if (r > 0) {
+			flowRet = gst_acm_v4l2_buffer_pool_dqbuf(me->pool_out, v4l2buf_out);
+			if (GST_FLOW_OK != flowRet) {
+				GST_ERROR_OBJECT (me, "gst_acm_v4l2_buffer_pool_dqbuf() returns %s",
+								  gst_flow_get_name (flowRet));
+				goto dqbuf_failed;
+			}
+		}
+		else if (r < 0) {
+			goto select_failed;
+		}
+		else if (0 == r) {
+			/* timeout の判断は呼び出し元で行う	*/
+			flowRet = GST_FLOW_DQBUF_EAGAIN;
+		}
+	}
+	else if (GST_FLOW_OK != flowRet) {
+		GST_ERROR_OBJECT (me, "gst_acm_v4l2_buffer_pool_dqbuf() returns %s",
+						  gst_flow_get_name (flowRet));
+		goto dqbuf_failed;
+	}
+
+out:
+	return flowRet;
+
+	/* ERRORS */
+select_failed:
 	{
 		GST_ELEMENT_ERROR (me, STREAM, ENCODE, (NULL),
 			("error with select() %d (%s)", errno, g_strerror (errno)));
 		flowRet = GST_FLOW_ERROR;
 		goto out;
 	}
-select_timeout:
-	{
-		GST_ERROR_OBJECT (me, "pool_in - buffers:%d, queued:%d",
-						  me->pool_in->num_buffers, me->pool_in->num_queued);
-		gst_acm_v4l2_buffer_pool_log_buf_status(me->pool_in);
-		
-		GST_ERROR_OBJECT (me, "pool_out - buffers:%d, queued:%d",
-						  me->pool_out->num_buffers, me->pool_out->num_queued);
-		gst_acm_v4l2_buffer_pool_log_buf_status(me->pool_out);
-		
-		GST_ELEMENT_ERROR (me, STREAM, ENCODE, (NULL),
-			("timeout with select()"));
-		flowRet = GST_FLOW_ERROR;
-		goto out;
+dqbuf_failed:
+	{
+		GST_ELEMENT_ERROR (me, STREAM, ENCODE, (NULL),
+			("could not dequeue buffer. %d (%s)", errno, g_strerror (errno)));
+		flowRet = GST_FLOW_ERROR;
+		goto out;
+	}
+qbuf_failed:
+	{
+		GST_ELEMENT_ERROR (me, STREAM, ENCODE, (NULL),
+			("could not queue buffer. %d (%s)", errno, g_strerror (errno)));
+		flowRet = GST_FLOW_ERROR;
+		goto out;
+	}
+}
+
+/* DQBUF したバッファを処理する。ストリームロックを保持して呼ぶこと	*/
+static GstFlowReturn
+gst_acm_h264_enc_process_out_buf(GstAcmH264Enc * me, GstBuffer *v4l2buf_out)
+{
+	GstFlowReturn flowRet = GST_FLOW_OK;
+
+	/* プレエンコード時、B_pic_modeに応じた回数だけ、出力側のバッファがサイズ0でdqbufされる。
+	 * このバッファは無視して、qbuf して戻す。
+	 */
+	if (me->priv->num_outbuf_dequeued < me->priv->pre_encode_num) {
+		GST_DEBUG_OBJECT(me,
+			"skip finish frame - num_outbuf_dequeued : %d, pre_encode_num : %d",
+			me->priv->num_outbuf_dequeued, me->priv->pre_encode_num);
+		g_assert (0 == gst_buffer_get_size(v4l2buf_out));
+		
+		flowRet = gst_acm_v4l2_buffer_pool_qbuf (
+			me->pool_out, v4l2buf_out, gst_buffer_get_size(v4l2buf_out));
+		if (GST_FLOW_OK != flowRet) {
+			GST_ERROR_OBJECT (me, "gst_acm_v4l2_buffer_pool_qbuf() returns %s",
+							  gst_flow_get_name (flowRet));
+			goto qbuf_failed;
+		}
+		
+		me->priv->num_outbuf_dequeued++;
+		
+		goto out;
+	}
+
+	/* g_assert (0 != gst_buffer_get_size(v4l2buf_out));
+	 * ピクチャスキップが発生したときに、出力側のバッファサイズが0になる事がある
+	 */
+	flowRet = gst_acm_h264_enc_handle_out_frame(me, v4l2buf_out);
+	if (GST_FLOW_OK != flowRet) {
+		if (GST_FLOW_FLUSHING == flowRet) {
+			GST_DEBUG_OBJECT(me, "FLUSHING - continue.");
+			
+			/* エラーとせず、m2mデバイスへのデータ入力は行う	*/
+			goto out;
+		}
+		goto handle_out_failed;
+	}
+
+	/* ピクチャスキップ発生時の 0 サイズバッファもカウントする。
+	 * 入力したフレーム数 == サイズ 0 のフレーム数 + サイズ 非 0 のフレーム数
+	 */
+	g_atomic_int_add (&me->priv->in_out_frame_count, -1);
+
+out:
+	return flowRet;
+
+	/* ERRORS */
+qbuf_failed:
+	{
+		GST_ELEMENT_ERROR (me, STREAM, ENCODE, (NULL),
+			("could not queue buffer. %d (%s)", errno, g_strerror (errno)));
+		flowRet = GST_FLOW_ERROR;
+		goto out;
+	}
+handle_out_failed:
+	{
+		if (GST_FLOW_NOT_LINKED == flowRet || GST_FLOW_FLUSHING == flowRet) {
+			GST_WARNING_OBJECT (me, "failed handle out - not link or flushing");
+			goto out;
+		}
+		
+		GST_ELEMENT_ERROR (me, STREAM, ENCODE, (NULL),
+			("failed handle out"));
+		flowRet = GST_FLOW_ERROR;
+		goto out;
+	}
+}
+
+/* src pad のタスク : エンコード済みデータができ次第取り出し、down stream へ流す。
+ * 上流のストリーミングスレッドは、入力の QBUF のみを行う
+ */
+static void
+gst_acm_h264_enc_output_loop(GstAcmH264Enc * me)
+{
+	GstFlowReturn flowRet = GST_FLOW_OK;
+	GstBuffer *v4l2buf_out = NULL;
+	gint max_pending;
+
+	flowRet = gst_acm_h264_enc_dqbuf_out(me, OUTPUT_LOOP_POLL_MSEC, &v4l2buf_out);
+	if (GST_FLOW_DQBUF_EAGAIN == flowRet) {
+		/* 並べ替えのためにデバイス内に留まるフレーム数を超えて、
+		 * 出力されないフレームがある場合はエラー
+		 */
+		max_pending = me->priv->is_draining ? 0 : me->priv->pre_encode_num;
+		if (g_atomic_int_get (&me->priv->in_out_frame_count) > max_pending) {
+			me->priv->output_idle_msec += OUTPUT_LOOP_POLL_MSEC;
+			if (me->priv->output_idle_msec >= SELECT_TIMEOUT_MSEC) {
+				goto select_timeout;
+			}
+		}
+		return;
+	}
+	else if (GST_FLOW_OK != flowRet) {
+		goto pause;
+	}
+	me->priv->output_idle_msec = 0;
+
+	GST_VIDEO_ENCODER_STREAM_LOCK (me);
+	flowRet = gst_acm_h264_enc_process_out_buf(me, v4l2buf_out);
+	GST_VIDEO_ENCODER_STREAM_UNLOCK (me);
+
+	GST_OBJECT_LOCK (me);
+	g_cond_broadcast (&me->priv->drain_cond);
+	GST_OBJECT_UNLOCK (me);
+
+	if (GST_FLOW_OK != flowRet) {
+		goto pause;
+	}
+
+	return;
+
+	/* ERRORS */
+select_timeout:
+	{
+		GST_ERROR_OBJECT (me, "select() for output is timeout");
+		GST_ERROR_OBJECT (me, "pool_in - buffers:%d, queued:%d",
+						  me->pool_in->num_buffers, me->pool_in->num_queued);
+		gst_acm_v4l2_buffer_pool_log_buf_status(me->pool_in);
+		
+		GST_ERROR_OBJECT (me, "pool_out - buffers:%d, queued:%d",
+						  me->pool_out->num_buffers, me->pool_out->num_queued);
+		gst_acm_v4l2_buffer_pool_log_buf_status(me->pool_out);
+		
+		GST_ELEMENT_ERROR (me, STREAM, ENCODE, (NULL),
+			("timeout with select()"));
+		flowRet = GST_FLOW_ERROR;
+		goto pause;
+	}
+pause:
+	{
+		GST_INFO_OBJECT (me, "pausing output task, reason %s",
+						 gst_flow_get_name (flowRet));
+		GST_OBJECT_LOCK (me);
+		me->priv->output_flow = flowRet;
+		g_cond_broadcast (&me->priv->drain_cond);
+		GST_OBJECT_UNLOCK (me);
+
+		gst_pad_pause_task (GST_VIDEO_ENCODER_SRC_PAD (me));
+	}
+}
+
+static void
+gst_acm_h264_enc_start_output_task(GstAcmH264Enc * me)
+{
+	if (me->priv->is_output_task_started) {
+		return;
+	}
+
+	GST_INFO_OBJECT (me, "start output task");
+	me->priv->output_idle_msec = 0;
+	me->priv->is_output_task_started = TRUE;
+#if GST_CHECK_VERSION(1, 2, 0)
+	gst_pad_start_task (GST_VIDEO_ENCODER_SRC_PAD (me),
+		(GstTaskFunction) gst_acm_h264_enc_output_loop, me, NULL);
+#else
+	gst_pad_start_task (GST_VIDEO_ENCODER_SRC_PAD (me),
+		(GstTaskFunction) gst_acm_h264_enc_output_loop, me);
+#endif
+}
+
+/* 出力タスクを停止する。タスクはストリームロックを取るので、
+ * 呼び出し元が保持している場合は、停止を待つ間だけ解放する
+ */
+static void
+gst_acm_h264_enc_stop_output_task(GstAcmH264Enc * me, gboolean has_stream_lock)
+{
+	if (! me->priv->is_output_task_started) {
+		return;
+	}
+
+	GST_INFO_OBJECT (me, "stop output task");
+	if (has_stream_lock) {
+		GST_VIDEO_ENCODER_STREAM_UNLOCK (me);
+	}
+	gst_pad_stop_task (GST_VIDEO_ENCODER_SRC_PAD (me));
+	if (has_stream_lock) {
+		GST_VIDEO_ENCODER_STREAM_LOCK (me);
+	}
+	me->priv->is_output_task_started = FALSE;
+
+	GST_OBJECT_LOCK (me);
+	me->priv->output_flow = GST_FLOW_OK;
+	GST_OBJECT_UNLOCK (me);
+}
+
+/* デバイス内のフレームを全て取り出し、出力タスクを停止する。
+ * ストリームロックを保持して呼ぶこと
+ */
+static GstFlowReturn
+gst_acm_h264_enc_drain(GstAcmH264Enc * me)
+{
+	GstFlowReturn flowRet = GST_FLOW_OK;
+	gint i;
+	gint flush_encode_num = me->B_pic_mode + 1;
+
+	if (! me->priv->is_output_task_started) {
+		/* エンコード中のフレームは無い	*/
+		return GST_FLOW_OK;
+	}
+
+	/* 入力側にサイズ0のバッファがqbufされた時点でエンコード終了とみなし、
+	 * フラッシュが開始される。B_pic_modeに応じた数だけサイズ0のバッファを入力する。
+	 * (同じ数だけエンコード結果が格納された出力バッファがdqbufできる。)
+	 */
+	GST_INFO_OBJECT (me, "flush_encode_num : %d", flush_encode_num);
+	me->priv->is_draining = TRUE;
+	for (i = 0; i < flush_encode_num; i++) {
+		flowRet = gst_acm_h264_enc_qbuf_null_in(me);
+		if (GST_FLOW_OK != flowRet) {
+			GST_ERROR_OBJECT (me, "failed enqueue null buffer");
+			break;
+		}
+	}
+
+	/* デバイス側に溜まっているデータを、出力タスクが down stream へ流し終わるのを待つ	*/
+	GST_INFO_OBJECT (me, "in_out_frame_count : %d",
+					 g_atomic_int_get (&me->priv->in_out_frame_count));
+	GST_VIDEO_ENCODER_STREAM_UNLOCK (me);
+	GST_OBJECT_LOCK (me);
+	while (GST_FLOW_OK == flowRet
+		   && GST_FLOW_OK == me->priv->output_flow
+		   && g_atomic_int_get (&me->priv->in_out_frame_count) > 0) {
+		g_cond_wait (&me->priv->drain_cond, GST_OBJECT_GET_LOCK (me));
+	}
+	if (GST_FLOW_OK == flowRet) {
+		flowRet = me->priv->output_flow;
+	}
+	GST_OBJECT_UNLOCK (me);
+
+	gst_acm_h264_enc_stop_output_task (me, FALSE);
+	GST_VIDEO_ENCODER_STREAM_LOCK (me);
+	me->priv->is_draining = FALSE;
+
+	return flowRet;
+}
+
+/* エンコードパラメータを VIDIOC_S_CTRL で設定する。
+ * ドライバが受け付けなかったパラメータを返す
+ */
+static guint
+gst_acm_h264_enc_set_ctrls(GstAcmH264Enc * me, guint ctrls)
+{
+	struct v4l2_control ctrl;
+	guint rejected = 0;
+
+	if (ctrls & ENC_CTRL_BIT_RATE) {
+		/* bit_rate */
+		ctrl.id = V4L2_CID_TARGET_BIT_RATE;
+		ctrl.value = me->bit_rate;
+		if (gst_acm_v4l2_ioctl(me->video_fd, VIDIOC_S_CTRL, &ctrl) < 0) {
+			GST_WARNING_OBJECT(me, "failed ioctl - V4L2_CID_TARGET_BIT_RATE (%s)",
+							   g_strerror (errno));
+			rejected |= ENC_CTRL_BIT_RATE;
+		}
+		else {
+			/* max_frame_size */
+			ctrl.id = V4L2_CID_MAX_FRAME_SIZE;
+			ctrl.value = me->max_frame_size;
+			if (gst_acm_v4l2_ioctl(me->video_fd, VIDIOC_S_CTRL, &ctrl) < 0) {
+				GST_WARNING_OBJECT(me, "failed ioctl - V4L2_CID_MAX_FRAME_SIZE (%s)",
+								   g_strerror (errno));
+				rejected |= ENC_CTRL_BIT_RATE;
+			}
+		}
+	}
+	if (ctrls & ENC_CTRL_RATE_CONTROL_MODE) {
+		/* rate_control_mode */
+		ctrl.id = V4L2_CID_RATE_CONTROL_MODE;
+		ctrl.value = me->rate_control_mode;
+		if (gst_acm_v4l2_ioctl(me->video_fd, VIDIOC_S_CTRL, &ctrl) < 0) {
+			GST_WARNING_OBJECT(me, "failed ioctl - V4L2_CID_RATE_CONTROL_MODE (%s)",
+							   g_strerror (errno));
+			rejected |= ENC_CTRL_RATE_CONTROL_MODE;
+		}
+	}
+	if (ctrls & ENC_CTRL_MAX_GOP_LENGTH) {
+		/* max_GOP_length */
+		ctrl.id = V4L2_CID_MAX_GOP_LENGTH;
+		ctrl.value = me->max_GOP_length;
+		if (gst_acm_v4l2_ioctl(me->video_fd, VIDIOC_S_CTRL, &ctrl) < 0) {
+			GST_WARNING_OBJECT(me, "failed ioctl - V4L2_CID_MAX_GOP_LENGTH (%s)",
+							   g_strerror (errno));
+			rejected |= ENC_CTRL_MAX_GOP_LENGTH;
+		}
+	}
+
+	return rejected;
+}
+
+/* ストリーム中に変更されたプロパティを反映する。
+ * まず VIDIOC_S_CTRL を試み、ドライバが動作中の変更を受け付けない場合は、
+ * 次の GOP の先頭でドレインしてから設定し直す
+ */
+static GstFlowReturn
+gst_acm_h264_enc_update_ctrls(GstAcmH264Enc * me, GstVideoCodecFrame * frame)
+{
+	guint ctrls;
+
+	GST_OBJECT_LOCK (me);
+	ctrls = me->priv->pending_ctrls;
+	me->priv->pending_ctrls = 0;
+	GST_OBJECT_UNLOCK (me);
+
+	if (0 != ctrls) {
+		GST_INFO_OBJECT (me, "update ctrls : 0x%x (bit_rate:%d, "
+						 "rate_control_mode:%d, max_GOP_length:%d)", ctrls,
+						 me->bit_rate, me->rate_control_mode, me->max_GOP_length);
+
+		/* set_format() と同じパラメータのチェック	*/
+		if ((ctrls & ENC_CTRL_BIT_RATE)
+			&& me->max_frame_size < (me->bit_rate / 8) /* byte */) {
+			GST_WARNING_OBJECT (me,
+				"max-frame-size: %u is less than bitrate: %u (%u byte), force to %u",
+				me->max_frame_size, me->bit_rate, me->bit_rate / 8, (me->bit_rate / 8));
+			me->max_frame_size = (me->bit_rate / 8); /* byte */
+		}
+		if ((ctrls & ENC_CTRL_RATE_CONTROL_MODE)
+			&& (me->B_pic_mode > GST_ACMH264ENC_B_PIC_MODE_0_B_PIC)
+			&& (GST_ACMH264ENC_RATE_CONTROL_MODE_CBR_SKIP == me->rate_control_mode)) {
+			GST_WARNING_OBJECT (me,
+				"force rate-control-mode to %d, because (b-pic-mode > 0)",
+				GST_ACMH264ENC_RATE_CONTROL_MODE_CBR_NON_SKIP);
+			me->rate_control_mode = GST_ACMH264ENC_RATE_CONTROL_MODE_CBR_NON_SKIP;
+		}
+		if ((ctrls & ENC_CTRL_MAX_GOP_LENGTH)
+			&& me->max_GOP_length <= me->B_pic_mode
+			&& ! (0 == me->max_GOP_length
+				  && GST_ACMH264ENC_B_PIC_MODE_0_B_PIC == me->B_pic_mode)) {
+			GST_WARNING_OBJECT (me,
+				"max-gop-length: %u must be greater than b-pic-mode: %u, force to %u",
+				me->max_GOP_length, me->B_pic_mode, me->B_pic_mode + 1);
+			me->max_GOP_length = me->B_pic_mode + 1;
+		}
+
+		if (0 == me->priv->reconfig_ctrls) {
+			me->priv->reconfig_ctrls = gst_acm_h264_enc_set_ctrls(me, ctrls);
+		}
+		else {
+			/* 既に再設定待ち	*/
+			me->priv->reconfig_ctrls |= ctrls;
+		}
+		if (me->priv->reconfig_ctrls) {
+			GST_INFO_OBJECT (me, "reconfigure at next GOP : 0x%x",
+							 me->priv->reconfig_ctrls);
+		}
+	}
+
+	/* GOP の先頭で再設定する (先頭のみ I ピクチャの場合は、直ちに行う)	*/
+	if (me->priv->reconfig_ctrls
+		&& (0 == me->priv->gop_frame_count || 0 == me->max_GOP_length)) {
+		return gst_acm_h264_enc_restart_encoder(me, frame);
+	}
+
+	return GST_FLOW_OK;
+}
+
+/* config-interval に従い、この I ピクチャに SPS/PPS を挿入するかどうか	*/
+static gboolean
+gst_acm_h264_enc_is_spspps_interval(GstAcmH264Enc * me, GstClockTime pts)
+{
+	gint interval = me->config_interval;
+
+	if (interval < 0) {
+		/* 全ての I ピクチャ	*/
+		return TRUE;
+	}
+	if (0 == interval) {
+		return FALSE;
 	}
-dqbuf_failed:
-	{
-		GST_ELEMENT_ERROR (me, STREAM, ENCODE, (NULL),
-			("could not dequeue buffer. %d (%s)", errno, g_strerror (errno)));
-		flowRet = GST_FLOW_ERROR;
-		goto out;
+	if (! GST_CLOCK_TIME_IS_VALID (pts)
+		|| ! GST_CLOCK_TIME_IS_VALID (me->priv->last_spspps_pts)) {
+		return TRUE;
 	}
-qbuf_failed:
-	{
-		GST_ELEMENT_ERROR (me, STREAM, ENCODE, (NULL),
-			("could not queue buffer. %d (%s)", errno, g_strerror (errno)));
-		flowRet = GST_FLOW_ERROR;
-		goto out;
+	if (pts < me->priv->last_spspps_pts) {
+		/* PTS が戻った (シーク等)	*/
+		return TRUE;
 	}
+
+	return (pts - me->priv->last_spspps_pts >= interval * GST_SECOND);
 }
 
+/* 指定のフレームを IDR としてエンコードさせる。
+ * ドライバが IDR の要求に対応していない場合は、STREAMON し直して
+ * 新しいストリームの先頭 (IDR) とする
+ */
 static GstFlowReturn
-gst_acm_h264_enc_handle_out_frame_with_wait(GstAcmH264Enc * me)
+gst_acm_h264_enc_force_key_frame(GstAcmH264Enc * me, GstVideoCodecFrame * frame)
 {
-	GstFlowReturn flowRet = GST_FLOW_OK;
-	GstBuffer *v4l2buf_out = NULL;
-	int r = 0;
-	fd_set read_fds;
-	struct timeval tv;
-#if DBG_MEASURE_PERF_SELECT_OUT
-	double time_start, time_end;
+#ifdef V4L2_CID_MPEG_VIDEO_FORCE_KEY_FRAME
+	struct v4l2_control ctrl;
 #endif
 
-	/* dequeue buffer	*/
-	flowRet = gst_acm_v4l2_buffer_pool_dqbuf (me->pool_out, &v4l2buf_out);
-	if (GST_FLOW_DQBUF_EAGAIN == flowRet) {
-		
-		/* 読み込みできる状態になるまで待ってから読み込む		*/
-#if DBG_LOG_PERF_SELECT_OUT
-		GST_INFO_OBJECT(me, "wait until enable dqbuf (pool_out)");
-		gst_acm_v4l2_buffer_pool_log_buf_status(me->pool_out);
-#endif
-		do {
-			FD_ZERO(&read_fds);
-			FD_SET(me->video_fd, &read_fds);
-			tv.tv_sec = 0;
-			tv.tv_usec = SELECT_TIMEOUT_MSEC * 1000;
-#if DBG_MEASURE_PERF_SELECT_OUT
-			time_start = gettimeofday_sec();
-#endif
-			r = select(me->video_fd + 1, &read_fds, NULL, NULL, &tv);
-#if DBG_MEASURE_PERF_SELECT_OUT
-			time_end = gettimeofday_sec();
-			GST_INFO_OBJECT(me, " select() out : %10.10f", time_end - time_start);
-			g_time_total_select_out += (time_end - time_start);
-			GST_INFO_OBJECT(me, " total %10.10f", g_time_total_select_out);
-#endif
-		} while (r < 0 && (EINTR == errno || EAGAIN == errno));
-		if (r > 0) {
-			flowRet = gst_acm_v4l2_buffer_pool_dqbuf(me->pool_out, &v4l2buf_out);
-			if (GST_FLOW_OK != flowRet) {
-				GST_ERROR_OBJECT (me, "gst_acm_v4l2_buffer_pool_dqbuf() returns %s",
-								  gst_flow_get_name (flowRet));
-				goto dqbuf_failed;
-			}
-		}
-		else if (r < 0) {
-			goto select_failed;
-		}
-		else if (0 == r) {
-			/* timeoutしたらエラー	*/
-			GST_INFO_OBJECT(me, "select() for output is timeout");
-			goto select_timeout;
-		}
+	GST_INFO_OBJECT (me, "force key frame (frame:%u, all-headers:%d)",
+					 frame->system_frame_number,
+					 GST_VIDEO_CODEC_FRAME_IS_FORCE_KEYFRAME_HEADERS (frame) ? 1 : 0);
+
+	/* avc の場合、SPS/PPS は codec_data で渡している	*/
+	if (GST_VIDEO_CODEC_FRAME_IS_FORCE_KEYFRAME_HEADERS (frame)
+		&& V4L2_PIX_FMT_H264 == me->priv->output_format) {
+		me->priv->need_spspps = TRUE;
 	}
-	else if (GST_FLOW_OK != flowRet) {
-		GST_ERROR_OBJECT (me, "gst_acm_v4l2_buffer_pool_dqbuf() returns %s",
-						  gst_flow_get_name (flowRet));
-		goto dqbuf_failed;
+
+	/* 先頭のフレームは、必ず IDR になる	*/
+	if (! me->priv->is_output_task_started) {
+		return GST_FLOW_OK;
 	}
 
-	/* プレエンコード時、B_pic_modeに応じた回数だけ、出力側のバッファがサイズ0でdqbufされる。
-	 * このバッファは無視して、qbuf して戻す。
-	 */
-	if (me->priv->num_outbuf_dequeued < me->priv->pre_encode_num) {
-		GST_DEBUG_OBJECT(me,
-			"skip finish frame - num_outbuf_dequeued : %d, pre_encode_num : %d",
-			me->priv->num_outbuf_dequeued, me->priv->pre_encode_num);
-		g_assert (0 == gst_buffer_get_size(v4l2buf_out));
-		
-		flowRet = gst_acm_v4l2_buffer_pool_qbuf (
-			me->pool_out, v4l2buf_out, gst_buffer_get_size(v4l2buf_out));
-		if (GST_FLOW_OK != flowRet) {
-			GST_ERROR_OBJECT (me, "gst_acm_v4l2_buffer_pool_qbuf() returns %s",
-							  gst_flow_get_name (flowRet));
-			goto qbuf_failed;
-		}
-		
-		me->priv->num_outbuf_dequeued++;
-		
+#ifdef V4L2_CID_MPEG_VIDEO_FORCE_KEY_FRAME
+	ctrl.id = V4L2_CID_MPEG_VIDEO_FORCE_KEY_FRAME;
+	ctrl.value = 1;
+	if (gst_acm_v4l2_ioctl(me->video_fd, VIDIOC_S_CTRL, &ctrl) >= 0) {
+		me->priv->gop_frame_count = 0;
+		return GST_FLOW_OK;
+	}
+	GST_DEBUG_OBJECT (me, "V4L2_CID_MPEG_VIDEO_FORCE_KEY_FRAME is not supported (%s)",
+					  g_strerror (errno));
+#endif
+
+	return gst_acm_h264_enc_restart_encoder(me, frame);
+}
+
+/* ドレインした後、バッファプールは保持したまま STREAMOFF して
+ * エンコードパラメータを設定し直し、STREAMON する
+ */
+static GstFlowReturn
+gst_acm_h264_enc_restart_encoder(GstAcmH264Enc * me, GstVideoCodecFrame * frame)
+{
+	GstFlowReturn flowRet = GST_FLOW_OK;
+	enum v4l2_buf_type type;
+	int r = 0;
+
+	GST_INFO_OBJECT (me, "H264ENC RECONFIGURE (frame:%u, ctrls:0x%x)",
+					 frame->system_frame_number, me->priv->reconfig_ctrls);
+
+	flowRet = gst_acm_h264_enc_drain(me);
+	if (GST_FLOW_OK != flowRet) {
 		goto out;
 	}
 
-	/* g_assert (0 != gst_buffer_get_size(v4l2buf_out));
-	 * ピクチャスキップが発生したときに、出力側のバッファサイズが0になる事がある
-	 */
-	flowRet = gst_acm_h264_enc_handle_out_frame(me, v4l2buf_out);
+	/* STREAMOFF */
+	type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+	r = gst_acm_v4l2_ioctl (me->video_fd, VIDIOC_STREAMOFF, &type);
+	if (r < 0) {
+		goto stop_failed;
+	}
+	type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	r = gst_acm_v4l2_ioctl (me->video_fd, VIDIOC_STREAMOFF, &type);
+	if (r < 0) {
+		goto stop_failed;
+	}
+
+	/* OUTPUT 側のバッファは全て空いたので、先頭から使い直す	*/
+	gst_acm_h264_enc_release_all_in_refs (me);
+	gst_acm_v4l2_buffer_pool_reclaim_all (me->pool_in);
+	me->priv->num_inbuf_acquired = 0;
+
+	if (0 != gst_acm_h264_enc_set_ctrls(me, me->priv->reconfig_ctrls)) {
+		goto set_ctrl_failed;
+	}
+	me->priv->reconfig_ctrls = 0;
+
+	/* CAPTURE 側のバッファを回収して、再度 QBUF	*/
+	flowRet = gst_acm_v4l2_buffer_pool_requeue_all (me->pool_out);
 	if (GST_FLOW_OK != flowRet) {
-		if (GST_FLOW_FLUSHING == flowRet) {
-			GST_DEBUG_OBJECT(me, "FLUSHING - continue.");
-			
-			/* エラーとせず、m2mデバイスへのデータ入力は行う	*/
-			goto out;
-		}
-		goto handle_out_failed;
+		goto qbuf_failed;
 	}
 
-	/* ピクチャスキップ発生時の 0 サイズバッファもカウントする。
-	 * 入力したフレーム数 == サイズ 0 のフレーム数 + サイズ 非 0 のフレーム数
-	 */
-	me->priv->in_out_frame_count--;
+	/* STREAMON */
+	type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	r = gst_acm_v4l2_ioctl (me->video_fd, VIDIOC_STREAMON, &type);
+	if (r < 0) {
+		goto start_failed;
+	}
+	type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+	r = gst_acm_v4l2_ioctl (me->video_fd, VIDIOC_STREAMON, &type);
+	if (r < 0) {
+		goto start_failed;
+	}
+
+	/* 新しいストリームとして、プレエンコードからやり直す	*/
+	g_atomic_int_set (&me->priv->in_out_frame_count, 0);
+	me->priv->num_inbuf_queued = 0;
+	me->priv->num_outbuf_dequeued = 0;
+	me->priv->is_handled_1stframe_out = FALSE;
+	me->priv->is_qbufed_null_when_non_bpic = FALSE;
+	me->priv->need_spspps = FALSE;
+	me->priv->last_spspps_pts = GST_CLOCK_TIME_NONE;
+	me->priv->gop_frame_count = 0;
+	me->priv->capture_counter_base = frame->system_frame_number;
+	memset (me->priv->in_frames, 0, sizeof (me->priv->in_frames));
+
+	/* パラメータに応じて変わる SPS/PPS を取得し直す	*/
+	if (me->priv->spspps_buf) {
+		gst_buffer_unref (me->priv->spspps_buf);
+		me->priv->spspps_buf = NULL;
+	}
+	flowRet = gst_acm_h264_enc_get_spspps(me);
 
 out:
 	return flowRet;
 
 	/* ERRORS */
-select_failed:
-	{
-		GST_ELEMENT_ERROR (me, STREAM, ENCODE, (NULL),
-			("error with select() %d (%s)", errno, g_strerror (errno)));
-		flowRet = GST_FLOW_ERROR;
-		goto out;
-	}
-select_timeout:
+stop_failed:
 	{
-		GST_ERROR_OBJECT (me, "pool_in - buffers:%d, queued:%d",
-						  me->pool_in->num_buffers, me->pool_in->num_queued);
-		gst_acm_v4l2_buffer_pool_log_buf_status(me->pool_in);
-		
-		GST_ERROR_OBJECT (me, "pool_out - buffers:%d, queued:%d",
-						  me->pool_out->num_buffers, me->pool_out->num_queued);
-		gst_acm_v4l2_buffer_pool_log_buf_status(me->pool_out);
-		
 		GST_ELEMENT_ERROR (me, STREAM, ENCODE, (NULL),
-			("timeout with select()"));
+			("error with STREAMOFF %d (%s)", errno, g_strerror (errno)));
 		flowRet = GST_FLOW_ERROR;
 		goto out;
 	}
-dqbuf_failed:
+set_ctrl_failed:
 	{
 		GST_ELEMENT_ERROR (me, STREAM, ENCODE, (NULL),
-			("could not dequeue buffer. %d (%s)", errno, g_strerror (errno)));
+			("Failed to set encoder param.(%s)", g_strerror (errno)));
 		flowRet = GST_FLOW_ERROR;
 		goto out;
 	}
@@ -2247,15 +3535,10 @@ qbuf_failed:
 		flowRet = GST_FLOW_ERROR;
 		goto out;
 	}
-handle_out_failed:
+start_failed:
 	{
-		if (GST_FLOW_NOT_LINKED == flowRet || GST_FLOW_FLUSHING == flowRet) {
-			GST_WARNING_OBJECT (me, "failed handle out - not link or flushing");
-			goto out;
-		}
-		
 		GST_ELEMENT_ERROR (me, STREAM, ENCODE, (NULL),
-			("failed handle out"));
+			("error with STREAMON %d (%s)", errno, g_strerror (errno)));
 		flowRet = GST_FLOW_ERROR;
 		goto out;
 	}
@@ -2270,9 +3553,13 @@ gst_acm_h264_enc_handle_out_frame(GstAcmH264Enc * me,
 	gint pictureType = -1;
 	gsize encodedSize = 0;
 	gsize outputSize = 0;
+	gsize outputOffset = 0;
+	gboolean isLent = FALSE;
+	gboolean isInsertSpsPps = FALSE;
+	GstBufferPoolAcquireParams acquireParam;
 	GstVideoCodecFrame *frame = NULL;
 	unsigned long captCounter = 0;
-	GstVideoCodecFrame *pts_frame = NULL;	// Bピクチャがある場合の PTS 取得用
+	GstAcmH264EncFrameEntry pts_entry;	// Bピクチャがある場合の PTS 取得用
 #if DBG_MEASURE_PERF_FINISH_FRAME
 	static double interval_time_start = 0, interval_time_end = 0;
 	double time_start = 0, time_end = 0;
@@ -2333,8 +3620,7 @@ gst_acm_h264_enc_handle_out_frame(GstAcmH264Enc * me,
 	/* PTS	*/
 	if (GST_ACMH264ENC_B_PIC_MODE_0_B_PIC != me->B_pic_mode) {
 		captCounter = get_capture_counter(me, v4l2buf_out);
-		pts_frame = gst_acm_h264_enc_pop_frame(me, captCounter);
-		if (NULL == pts_frame) {
+		if (! gst_acm_h264_enc_pop_frame(me, captCounter, &pts_entry)) {
 			GST_ERROR_OBJECT (me, "failed get frame by capture counter %lu (0x%lx)",
 					  captCounter, captCounter);
 
@@ -2350,130 +3636,117 @@ gst_acm_h264_enc_handle_out_frame(GstAcmH264Enc * me,
 		GST_INFO_OBJECT (me, "oldest PTS:%" GST_TIME_FORMAT,
 						 GST_TIME_ARGS( frame->pts ));
 		GST_INFO_OBJECT (me, "capt   DTS:%" GST_TIME_FORMAT,
-						 GST_TIME_ARGS( pts_frame->dts ));
+						 GST_TIME_ARGS( pts_entry.dts ));
 		GST_INFO_OBJECT (me, "capt   PTS:%" GST_TIME_FORMAT,
-						 GST_TIME_ARGS( pts_frame->pts ));
+						 GST_TIME_ARGS( pts_entry.pts ));
 #endif
 		/* gst_video_encoder_finish_frame() での実装により、DTS を明示的にセットする必要有り */
 		frame->dts = frame->abidata.ABI.ts;
-		frame->pts = pts_frame->pts;
-		g_assert(1 == pts_frame->ref_count);
-		gst_video_codec_frame_unref(pts_frame);
-		pts_frame = NULL;
+		frame->pts = pts_entry.pts;
 	}
 
-	/* 出力バッファをアロケート	*/
+	/* 出力データの範囲を決める。
+	 * AVC の場合は AUD を除き、SLICE のスタートコードを NALU サイズで書き換える
+	 */
+	gst_buffer_map (v4l2buf_out, &map, GST_MAP_READWRITE);
 	switch (me->priv->output_format) {
 	case V4L2_PIX_FMT_H264_NO_SC:
 		if (! me->priv->is_handled_1stframe_out) {
 			// SLICE only -> SLICE only (start code -> NALU size)
-			outputSize = encodedSize;
+			outputOffset = 0;
 		}
 		else {
 			// AUD + SLICE -> SLICE only (start code -> NALU size)
-			outputSize = encodedSize - AUD_NAL_SIZE;
+			outputOffset = AUD_NAL_SIZE;
 		}
+		outputSize = encodedSize - outputOffset;
+		GST_WRITE_UINT32_BE (map.data + outputOffset,
+							 (outputSize - sizeof(unsigned long)));
 		break;
 	case V4L2_PIX_FMT_H264:
+		// SLICE only -> AUD-SPS-PPS-SLICE, AUD + SLICE -> AUD + SLICE
+		outputOffset = 0;
 		if (! me->priv->is_handled_1stframe_out) {
-			// SLICE only -> AUD-SPS-PPS-SLICE
-			g_assert(NULL != me->priv->spspps_buf);
-			outputSize = me->priv->spspps_size + encodedSize;
+			isInsertSpsPps = TRUE;
 		}
-		else {
-			// AUD + SLICE -> AUD + SLICE
-			outputSize = encodedSize;
+		else if (PICTURE_TYPE_I == pictureType
+				 && (me->priv->need_spspps
+					 || gst_acm_h264_enc_is_spspps_interval(me, frame->pts))) {
+			// AUD + SLICE -> AUD-SPS-PPS-SLICE (AUD は SPS/PPS 側のものを使う)
+			isInsertSpsPps = TRUE;
+			outputOffset = AUD_NAL_SIZE;
 		}
+		outputSize = encodedSize - outputOffset;
 		break;
 	default:
 		g_assert_not_reached ();
 		break;
 	}
-#if 0	/* for debug	*/
-	GST_INFO_OBJECT(me, "encoded=%lu, output=%lu", encodedSize, outputSize);
-#endif
-	flowRet = gst_video_encoder_allocate_output_frame (
-		GST_VIDEO_ENCODER (me), frame, outputSize);
-	if (GST_FLOW_OK != flowRet) {
-		GST_ERROR_OBJECT (me, "gst_video_encoder_allocate_output_frame() returns %s",
-						  gst_flow_get_name (flowRet));
-		goto failed_allocate_output_frame;
-	}
-
-	/* エンコード済みデータをコピー	*/
-	gst_buffer_map (v4l2buf_out, &map, GST_MAP_READ);
-	GST_DEBUG_OBJECT(me, "copy buf size=%" G_GSIZE_FORMAT, map.size);
-	if (! me->priv->is_handled_1stframe_out) {
-		// SLICE only
-		if (V4L2_PIX_FMT_H264_NO_SC == me->priv->output_format) {
-			GstMapInfo dstMap;
-
-			gst_buffer_fill(frame->output_buffer, 0, map.data, map.size);
-			/* スタートコードを、NALU サイズで書き換える	*/
-			gst_buffer_map (frame->output_buffer, &dstMap, GST_MAP_WRITE);
-			GST_WRITE_UINT32_BE (dstMap.data, (outputSize - sizeof(unsigned long)));
-			gst_buffer_unmap (frame->output_buffer, &dstMap);
-		}
-		else if (V4L2_PIX_FMT_H264 == me->priv->output_format) {
-			/* 初回フレームには、SPS/PPSを挿入する必要あり
-			 * NAL 構成を AUD-SPS-PPS-SLICE にする
-			 */
-			GstMapInfo dstMap;
-			GstMapInfo spsppsMap;
-
-			gst_buffer_map (frame->output_buffer, &dstMap, GST_MAP_WRITE);
-			gst_buffer_map (me->priv->spspps_buf, &spsppsMap, GST_MAP_READ);
-			GST_INFO_OBJECT(me, "insert SPS/PPS to frame");
-			g_assert(me->priv->spspps_size == spsppsMap.size);
-
-			/* SPS/PPS コピー */
-			memcpy(dstMap.data, spsppsMap.data, spsppsMap.size);
-			/* フレームデータ コピー */
-			memcpy(dstMap.data + me->priv->spspps_size, map.data, map.size);
-			
-			gst_buffer_unmap (frame->output_buffer, &dstMap);
-			gst_buffer_unmap (me->priv->spspps_buf, &spsppsMap);
-		}
 
-		me->priv->is_handled_1stframe_out = TRUE;
+	frame->output_buffer = gst_buffer_new ();
+	if (isInsertSpsPps) {
+		/* 初回フレームと、要求された IDR には、SPS/PPSを挿入する必要あり
+		 * NAL 構成を AUD-SPS-PPS-SLICE にする
+		 */
+		GST_INFO_OBJECT(me, "insert SPS/PPS to frame");
+		g_assert(NULL != me->priv->spspps_buf);
+		gst_buffer_append_memory (frame->output_buffer,
+			gst_buffer_get_all_memory (me->priv->spspps_buf));
+		me->priv->need_spspps = FALSE;
+		me->priv->last_spspps_pts = frame->pts;
+	}
+	me->priv->is_handled_1stframe_out = TRUE;
+
+	/* ドライバに残るバッファがなくならないよう、最後の 1 つはコピーして QBUF する。
+	 * gst_buffer_unref() により、デバイスに QBUF されるようにするため、
+	 * GstBufferPool::priv::outstanding をインクリメントしておく (デコーダと同じ)。
+	 * そうしないと、pool の deactivate の際、buffer の解放が行われない
+	 */
+	if (0 < me->pool_out->num_queued) {
+		acquireParam.flags = GST_BUFFER_POOL_ACQUIRE_FLAG_LAST;
+		isLent = (GST_FLOW_OK == gst_buffer_pool_acquire_buffer (
+			GST_BUFFER_POOL_CAST(me->pool_out), &v4l2buf_out, &acquireParam));
+	}
+
+	if (isLent) {
+		/* CAPTURE 側のバッファを ref したメモリを下流に渡し、
+		 * 解放時に unref されて QBUF される
+		 */
+		gst_buffer_append_memory (frame->output_buffer,
+			gst_memory_new_wrapped (GST_MEMORY_FLAG_READONLY,
+				map.data, map.maxsize, outputOffset, outputSize, v4l2buf_out,
+				(GDestroyNotify) gst_buffer_unref));
+		gst_buffer_unmap (v4l2buf_out, &map);
 	}
 	else {
-		// AUD + SLICE
-		if (V4L2_PIX_FMT_H264_NO_SC == me->priv->output_format) {
-			GstMapInfo dstMap;
+		GstMemory *mem;
+		GstMapInfo dstMap;
 
-			/* AUD は除き、 SLICE の スタートコードを、NAL サイズで書き換える	*/
-			gst_buffer_fill(frame->output_buffer, 0,
-				map.data + AUD_NAL_SIZE, map.size - AUD_NAL_SIZE);
+		GST_DEBUG_OBJECT(me, "copy buf size=%" G_GSIZE_FORMAT, outputSize);
+		mem = gst_allocator_alloc (NULL, outputSize, NULL);
+		gst_memory_map (mem, &dstMap, GST_MAP_WRITE);
+		memcpy (dstMap.data, map.data + outputOffset, outputSize);
+		gst_memory_unmap (mem, &dstMap);
+		gst_buffer_append_memory (frame->output_buffer, mem);
+		gst_buffer_unmap (v4l2buf_out, &map);
 
-			gst_buffer_map (frame->output_buffer, &dstMap, GST_MAP_WRITE);
-			GST_WRITE_UINT32_BE (dstMap.data, (outputSize - sizeof(unsigned long)));
-			gst_buffer_unmap (frame->output_buffer, &dstMap);
-		}
-		else if (V4L2_PIX_FMT_H264 == me->priv->output_format) {
-			/* AUD + SLICE の NAL構成をそのままコピー	*/
-			gst_buffer_fill(frame->output_buffer, 0, map.data, map.size);
+		/* enqueue buffer	*/
+		flowRet = gst_acm_v4l2_buffer_pool_qbuf (
+				me->pool_out, v4l2buf_out, gst_buffer_get_size(v4l2buf_out));
+		if (GST_FLOW_OK != flowRet) {
+			GST_ERROR_OBJECT (me, "gst_acm_v4l2_buffer_pool_qbuf() returns %s",
+							  gst_flow_get_name (flowRet));
+			goto qbuf_failed;
 		}
 	}
-	gst_buffer_unmap (v4l2buf_out, &map);
-	gst_buffer_resize(frame->output_buffer, 0, outputSize);
 
-	GST_DEBUG_OBJECT(me, "outbuf size=%" G_GSIZE_FORMAT,
-			 gst_buffer_get_size(frame->output_buffer));
+	GST_DEBUG_OBJECT(me, "outbuf size=%" G_GSIZE_FORMAT ", lent:%d",
+			 gst_buffer_get_size(frame->output_buffer), isLent);
 
 #if DBG_DUMP_OUT_BUF	/* for debug	*/
 	dump_output_buf(frame->output_buffer);
 #endif
 
-	/* enqueue buffer	*/
-	flowRet = gst_acm_v4l2_buffer_pool_qbuf (
-			me->pool_out, v4l2buf_out, gst_buffer_get_size(v4l2buf_out));
-	if (GST_FLOW_OK != flowRet) {
-		GST_ERROR_OBJECT (me, "gst_acm_v4l2_buffer_pool_qbuf() returns %s",
-						  gst_flow_get_name (flowRet));
-		goto qbuf_failed;
-	}
-
 	/* down stream へ バッファを push	*/
 #if DBG_LOG_PERF_PUSH
 	GST_INFO_OBJECT (me, "H264ENC-PUSH finish_frame START");
@@ -2517,13 +3790,6 @@ no_frame_by_capture_counter:
 		flowRet = GST_FLOW_ERROR;
 		goto out;
 	}
-failed_allocate_output_frame:
-	{
-		GST_ELEMENT_ERROR (me, STREAM, ENCODE, (NULL),
-			("could not allocate output buffer."));
-		flowRet = GST_FLOW_ERROR;
-		goto out;
-	}
 qbuf_failed:
 	{
 		GST_ELEMENT_ERROR (me, STREAM, ENCODE, (NULL),
@@ -2551,77 +3817,57 @@ finish_frame_failed:
 static void
 gst_acm_h264_enc_push_frame (GstAcmH264Enc * me, GstVideoCodecFrame * frame)
 {
-	GstVideoCodecFrame *cp_frame;
-
-	/* frame のコピーを作成	*/
-	cp_frame = g_slice_new0 (GstVideoCodecFrame);
-	g_assert(NULL != cp_frame);
-	cp_frame->ref_count = 1;
-	cp_frame->system_frame_number = frame->system_frame_number;
-	cp_frame->presentation_frame_number = frame->presentation_frame_number;
-	cp_frame->pts = frame->pts;
-	cp_frame->dts = frame->dts;
-	cp_frame->duration = frame->duration;
-	cp_frame->abidata.ABI.ts = frame->abidata.ABI.ts;
-
-	/* リストに追加		*/
-	me->priv->in_frames = g_list_append (me->priv->in_frames, cp_frame);
+	GstAcmH264EncFrameEntry *entry;
+
+	entry = &(me->priv->in_frames[
+				frame->system_frame_number & (FRAME_RING_SIZE - 1)]);
+	if (entry->is_used) {
+		/* ピクチャスキップ等で取り出されなかったフレームは、上書きする	*/
+		GST_DEBUG_OBJECT (me, "overwrite unused frame : %u",
+						  entry->system_frame_number);
+	}
+
+	entry->is_used = TRUE;
+	entry->system_frame_number = frame->system_frame_number;
+	entry->pts = frame->pts;
+	entry->dts = frame->dts;
 #if DBG_LOG_IN_FRAME_LIST
-	GST_INFO_OBJECT(me, "LIST APPEND frame : %lu", cp_frame->system_frame_number);
+	GST_INFO_OBJECT(me, "RING PUSH frame : %u", entry->system_frame_number);
 #endif
 }
 
-static GstVideoCodecFrame *
-gst_acm_h264_enc_pop_frame (GstAcmH264Enc * me, guint32 frame_number)
+static gboolean
+gst_acm_h264_enc_pop_frame (GstAcmH264Enc * me, guint32 capture_counter,
+	GstAcmH264EncFrameEntry *entry)
 {
-	GstVideoCodecFrame *frame = NULL;
-	GList *link;
-	GList *g;
-	GstVideoCodecFrame *tmp = NULL;
-	
-	GST_DEBUG_OBJECT (me, "frame_number : %u", frame_number);
-	
-	/* 該当フレームを検索	*/
-	for (g = me->priv->in_frames; g; g = g->next) {
-		tmp = g->data;
-		
-		if (tmp->system_frame_number == frame_number) {
-			frame = tmp;
-			break;
-		}
-	}
-	
-	/* 見つからなければ、キャプチャ順カウンタの折り返しを考慮して検索	*/
-	if (NULL == frame) {
-		GST_WARNING_OBJECT (me, "failed get frame by capture counter %u (0x%x)",
-				    frame_number, frame_number);
-		// SH からのキャプチャ順カウンタは、0x7FFFFFFE で折り返す
-		frame_number += 0x7FFFFFFF;
-		GST_WARNING_OBJECT (me, "try get frame by capture counter %u (0x%x)",
-				    frame_number, frame_number);
-		
-		for (g = me->priv->in_frames; g; g = g->next) {
-			tmp = g->data;
-			
-			if (tmp->system_frame_number == frame_number) {
-				frame = tmp;
-				break;
-			}
+	GstAcmH264EncFrameEntry *tmp;
+	guint32 frame_number;
+
+	GST_DEBUG_OBJECT (me, "capture_counter : %u", capture_counter);
+
+	/* キャプチャ順カウンタが折り返していなければ、frame_number と一致する。
+	 * 折り返した後は、CAPTURE_COUNTER_WRAP を足したものが frame_number になる。
+	 * (再設定で STREAMON し直した後は、カウンタは 0 から数え直される)
+	 */
+	frame_number = me->priv->capture_counter_base + capture_counter;
+	tmp = &(me->priv->in_frames[frame_number & (FRAME_RING_SIZE - 1)]);
+	if (! tmp->is_used || tmp->system_frame_number != frame_number) {
+		frame_number += CAPTURE_COUNTER_WRAP;
+		GST_DEBUG_OBJECT (me, "try get frame by capture counter %u (0x%x)",
+						  frame_number, frame_number);
+		tmp = &(me->priv->in_frames[frame_number & (FRAME_RING_SIZE - 1)]);
+		if (! tmp->is_used || tmp->system_frame_number != frame_number) {
+			return FALSE;
 		}
 	}
-	
-	/* 見つかったらリストから取り出し		*/
-	if (frame) {
-		link = g_list_find (me->priv->in_frames, frame);
-		if (link) {
+
 #if DBG_LOG_IN_FRAME_LIST
-			GST_INFO_OBJECT(me, "LIST POP frame : %lu", frame->system_frame_number);
+	GST_INFO_OBJECT(me, "RING POP frame : %u", tmp->system_frame_number);
 #endif
-			me->priv->in_frames = g_list_delete_link (me->priv->in_frames, link);
-		}
-	}
-	
-	return frame;
+	*entry = *tmp;
+	tmp->is_used = FALSE;
+
+	return TRUE;
 }
 
 static gboolean
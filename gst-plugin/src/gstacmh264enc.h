@@ -88,6 +88,10 @@ enum {
 #define GST_ACMH264ENC_MAX_GOP_LENGTH_MIN		0
 #define GST_ACMH264ENC_MAX_GOP_LENGTH_MAX		120
 
+/* SPS/PPS の挿入間隔 (秒)。-1 は全ての I ピクチャ、0 は先頭のみ	*/
+#define GST_ACMH264ENC_CONFIG_INTERVAL_MIN		-1
+#define GST_ACMH264ENC_CONFIG_INTERVAL_MAX		3600
+
 /* Bピクチャモード		*/
 enum {
 	GST_ACMH264ENC_B_PIC_MODE_UNKNOWN = -1,
@@ -139,6 +143,8 @@ typedef struct _GstAcmH264Enc {
 	gint B_pic_mode;				/* property */
 	gint32 x_offset;				/* property */
 	gint32 y_offset;				/* property */
+	gint config_interval;			/* property */
+	gboolean zero_latency;			/* property */
 
 	/*< private >*/
 	GstAcmH264EncPrivate *priv;
@@ -135,6 +135,7 @@ gst_acm_v4l2_buffer_pool_free_buffer (GstBufferPool * bpool, GstBuffer * buffer)
 		pool->buffers[index] = NULL;
 		break;
 	}
+	case GST_ACM_V4L2_IO_USERPTR:
 	case GST_ACM_V4L2_IO_DMABUF:
 	{
 		GstAcmV4l2Meta *meta;
@@ -224,6 +225,47 @@ gst_acm_v4l2_buffer_pool_alloc_buffer (GstBufferPool * bpool, GstBuffer ** buffe
 		
 		break;
 	}
+	case GST_ACM_V4L2_IO_USERPTR:
+	{
+		GstAllocationParams params = pool->params;
+		GstMapInfo map;
+
+		/* コピーが必要な場合に使う、アライメントを揃えたバッファを確保しておく。
+		 * 上流のバッファをそのまま渡す場合は、QBUF 前に m.userptr を差し替える
+		 */
+		params.align |= GST_ACM_V4L2_USERPTR_ALIGN - 1;
+		newbuf = gst_buffer_new_allocate (pool->allocator,
+					pool->init_param.sizeimage, &params);
+		if (NULL == newbuf) {
+			goto alloc_failed;
+		}
+		meta = GST_ACM_V4L2_META_ADD (newbuf);
+
+		index = pool->num_allocated;
+
+		GST_DEBUG_OBJECT (pool, "%s: - CREATING BUFFER index:%u, %p",
+						 TYPE_STR(pool->init_param.type), index, newbuf);
+
+		meta->vbuffer.index = index;
+		meta->vbuffer.type = pool->init_param.type;
+		meta->vbuffer.memory = V4L2_MEMORY_USERPTR;
+
+		GST_INFO_OBJECT (pool, "%s: - VIDIOC_QUERYBUF", TYPE_STR(pool->init_param.type));
+		if (gst_acm_v4l2_ioctl (pool->init_param.video_fd,
+						VIDIOC_QUERYBUF, &meta->vbuffer) < 0) {
+			goto querybuf_failed;
+		}
+
+		/* システムメモリなので、マップしたアドレスはバッファの解放まで有効	*/
+		gst_buffer_map (newbuf, &map, GST_MAP_WRITE);
+		meta->mem = map.data;
+		gst_buffer_unmap (newbuf, &map);
+
+		meta->vbuffer.m.userptr = (unsigned long)meta->mem;
+		meta->vbuffer.length = pool->init_param.sizeimage;
+
+		break;
+	}
 	case GST_ACM_V4L2_IO_DMABUF:
 	{
 		newbuf = gst_buffer_new ();
@@ -254,6 +296,11 @@ gst_acm_v4l2_buffer_pool_alloc_buffer (GstBufferPool * bpool, GstBuffer ** buffe
 		GST_INFO_OBJECT (pool, "  length:    %u", meta->vbuffer.length);
 #endif
 
+		/* インポート用（fd は QBUF 毎に指定される）の場合は、何もしない	*/
+		if (index >= pool->init_param.num_fb_dmabuf) {
+			break;
+		}
+
 		/* DMABUFのfdをメタデータとして保存		*/
 		if (! gst_buffer_add_acm_dmabuf_meta (newbuf,
 				pool->init_param.fb_dmabuf_fd[index],
@@ -301,6 +348,12 @@ mmap_failed:
 		errno = errnosave;
 		return GST_FLOW_ERROR;
 	}
+alloc_failed:
+	{
+		GST_ERROR_OBJECT (pool,
+			"%s: - Failed to allocate buffer", TYPE_STR(pool->init_param.type));
+		return GST_FLOW_ERROR;
+	}
 add_dmabuf_meta_failed:
 	{
 		GST_ERROR_OBJECT (pool,
@@ -343,6 +396,7 @@ gst_acm_v4l2_buffer_pool_set_config (GstBufferPool * bpool, GstStructure * confi
 		copy_threshold = 0;
 		break;
 	case GST_ACM_V4L2_IO_MMAP:
+	case GST_ACM_V4L2_IO_USERPTR:
 	{
 		/* request a reasonable number of buffers when no max specified. We will
 		 * copy when we run out of buffers */
@@ -358,7 +412,8 @@ gst_acm_v4l2_buffer_pool_set_config (GstBufferPool * bpool, GstStructure * confi
 		memset (&breq, 0, sizeof (struct v4l2_requestbuffers));
 		breq.type = pool->init_param.type;
 		breq.count = num_buffers;
-		breq.memory = V4L2_MEMORY_MMAP;
+		breq.memory = (GST_ACM_V4L2_IO_USERPTR == pool->init_param.mode)
+			? V4L2_MEMORY_USERPTR : V4L2_MEMORY_MMAP;
 		
 		GST_INFO_OBJECT (pool, "%s: - VIDIOC_REQBUFS. count:%u",
 			TYPE_STR(pool->init_param.type), num_buffers);
@@ -633,6 +688,63 @@ queue_failed:
 	}
 }
 
+/* VIDIOC_STREAMOFF によりドライバから取り除かれたバッファを、再度 enqueue する。
+ * down stream が保持しているバッファは、解放された際に enqueue される
+ */
+GstFlowReturn
+gst_acm_v4l2_buffer_pool_requeue_all (GstAcmV4l2BufferPool * pool)
+{
+	GstFlowReturn ret = GST_FLOW_OK;
+	GstBuffer *buf;
+	guint n;
+
+	GST_DEBUG_OBJECT (pool, "%s: - requeue all buffers", TYPE_STR(pool->init_param.type));
+
+	for (n = 0; n < pool->num_allocated; n++) {
+		buf = pool->buffers[n];
+		if (NULL == buf) {
+			continue;
+		}
+
+		pool->buffers[n] = NULL;
+		pool->num_queued--;
+
+		ret = gst_acm_v4l2_buffer_pool_qbuf (pool, buf, gst_buffer_get_size(buf));
+		if (GST_FLOW_OK != ret) {
+			break;
+		}
+	}
+	pool->next_qbuf_index = 0;
+
+	return ret;
+}
+
+/* VIDIOC_STREAMOFF によりドライバから取り除かれた OUTPUT 側のバッファを、
+ * 再度 enqueue せずに空きバッファとしてプールに戻す
+ */
+void
+gst_acm_v4l2_buffer_pool_reclaim_all (GstAcmV4l2BufferPool * pool)
+{
+	GstBuffer *buf;
+	guint n;
+
+	GST_DEBUG_OBJECT (pool, "%s: - reclaim all buffers", TYPE_STR(pool->init_param.type));
+
+	for (n = 0; n < pool->num_allocated; n++) {
+		buf = pool->buffers[n];
+		if (NULL == buf) {
+			continue;
+		}
+
+		pool->buffers[n] = NULL;
+		pool->num_queued--;
+
+		/* release_buffer() で free list に戻る	*/
+		gst_buffer_unref (buf);
+	}
+	pool->next_qbuf_index = 0;
+}
+
 /* select() の代わりに、VIDIOC_DQBUF 可能かどうかをチェックする	*/
 gboolean
 gst_acm_v4l2_buffer_pool_is_ready_to_dqbuf(GstAcmV4l2BufferPool * pool)
@@ -647,6 +759,9 @@ gst_acm_v4l2_buffer_pool_is_ready_to_dqbuf(GstAcmV4l2BufferPool * pool)
 	case GST_ACM_V4L2_IO_MMAP:
 		vbuffer.memory = V4L2_MEMORY_MMAP;
 		break;
+	case GST_ACM_V4L2_IO_USERPTR:
+		vbuffer.memory = V4L2_MEMORY_USERPTR;
+		break;
 	case GST_ACM_V4L2_IO_DMABUF:
 		vbuffer.memory = V4L2_MEMORY_DMABUF;
 		break;
@@ -720,6 +835,9 @@ gst_acm_v4l2_buffer_pool_dqbuf_ex (GstAcmV4l2BufferPool * pool, GstBuffer ** buf
 	case GST_ACM_V4L2_IO_MMAP:
 		vbuffer.memory = V4L2_MEMORY_MMAP;
 		break;
+	case GST_ACM_V4L2_IO_USERPTR:
+		vbuffer.memory = V4L2_MEMORY_USERPTR;
+		break;
 	case GST_ACM_V4L2_IO_DMABUF:
 		vbuffer.memory = V4L2_MEMORY_DMABUF;
 		break;
@@ -838,6 +956,10 @@ gst_acm_v4l2_buffer_pool_dqbuf_ex (GstAcmV4l2BufferPool * pool, GstBuffer ** buf
 		if (GST_ACM_V4L2_IO_DMABUF == pool->init_param.mode) {
 			/* バッファ自体は使わないので、何もしない	*/
 		}
+		else if (GST_ACM_V4L2_IO_USERPTR == pool->init_param.mode) {
+			/* length は上流のバッファのサイズの場合があるので、確保したサイズに戻す	*/
+			gst_buffer_resize (outbuf, 0, pool->init_param.sizeimage);
+		}
 		else {
 			/* 入力データサイズから、バッファの最大サイズに戻す	*/
 			gst_buffer_resize (outbuf, 0, vbuffer.length);
@@ -1030,6 +1152,7 @@ gst_acm_v4l2_buffer_pool_acquire_buffer (GstBufferPool * bpool, GstBuffer ** buf
 			break;
 			
 		case GST_ACM_V4L2_IO_MMAP:
+		case GST_ACM_V4L2_IO_USERPTR:
 			/* get a free unqueued buffer */
 			ret = GST_BUFFER_POOL_CLASS (parent_class)->acquire_buffer (
 					bpool, buffer, params);
@@ -1106,6 +1229,7 @@ gst_acm_v4l2_buffer_pool_release_buffer (GstBufferPool * bpool, GstBuffer * buff
 			break;
 			
 		case GST_ACM_V4L2_IO_MMAP:
+		case GST_ACM_V4L2_IO_USERPTR:
 		{
 			GstAcmV4l2Meta *meta;
 			
@@ -1294,6 +1418,9 @@ gst_acm_v4l2_buffer_pool_log_buf_status(GstAcmV4l2BufferPool* pool)
 		case GST_ACM_V4L2_IO_MMAP:
 			vbuffer.memory = V4L2_MEMORY_MMAP;
 			break;
+		case GST_ACM_V4L2_IO_USERPTR:
+			vbuffer.memory = V4L2_MEMORY_USERPTR;
+			break;
 		case GST_ACM_V4L2_IO_DMABUF:
 			vbuffer.memory = V4L2_MEMORY_DMABUF;
 			break;
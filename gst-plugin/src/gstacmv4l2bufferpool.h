@@ -49,6 +49,9 @@ G_BEGIN_DECLS
 #define GST_ACM_V4L2_MAX_BUFFERS 16
 #define GST_ACM_V4L2_MIN_BUFFERS 1
 
+/* USERPTR で QBUF するアドレスのアライメント（バイト）	*/
+#define GST_ACM_V4L2_USERPTR_ALIGN	32
+
 /* VIDIOC_DQBUF で、EAGAIN をエラー扱いしない	*/
 #define USE_GST_FLOW_DQBUF_EAGAIN	1
 #if USE_GST_FLOW_DQBUF_EAGAIN
@@ -128,6 +131,12 @@ GstFlowReturn		gst_acm_v4l2_buffer_pool_acquire_buffer(
 GstFlowReturn		gst_acm_v4l2_buffer_pool_qbuf(
 						GstAcmV4l2BufferPool * pool, GstBuffer * buf, gsize size);
 
+GstFlowReturn		gst_acm_v4l2_buffer_pool_requeue_all(
+						GstAcmV4l2BufferPool * pool);
+
+void				gst_acm_v4l2_buffer_pool_reclaim_all(
+						GstAcmV4l2BufferPool * pool);
+
 gboolean 			gst_acm_v4l2_buffer_pool_is_ready_to_dqbuf(
 						GstAcmV4l2BufferPool * pool);
 
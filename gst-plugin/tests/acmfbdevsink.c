@@ -21,9 +21,19 @@
  */
 
 #include <unistd.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/fb.h>
 
 #include <gst/check/gstcheck.h>
 
+#include "../src/gstacmdmabufmeta.h"
+
 static GstStaticPadTemplate srctemplate = GST_STATIC_PAD_TEMPLATE ("src",
     GST_PAD_SRC,
     GST_PAD_ALWAYS,
@@ -54,12 +64,232 @@ cleanup_acmfbdevsink (GstElement * sink)
 }
 
 
+/* スタブのフレームバッファ
+ * 通常のファイルをデバイスとして開かせ、そのファイルへの ioctl を
+ * ここで処理する (テストのバイナリは -export-dynamic でリンクし、
+ * プラグインからの ioctl() を置き換える)
+ */
+#define STUB_FB_XRES		320
+#define STUB_FB_YRES		240
+#define STUB_FB_BPP			32
+
+static gchar *stub_fb_path = NULL;
+static dev_t stub_fb_dev;
+static ino_t stub_fb_ino;
+static GMutex stub_fb_lock;
+static gint stub_fb_pan_count = 0;
+static gint stub_fb_pan_index = -1;
+
+static gboolean
+is_stub_fb(int fd)
+{
+	struct stat sb;
+
+	if (NULL == stub_fb_path || 0 != fstat (fd, &sb)) {
+		return FALSE;
+	}
+	return (sb.st_dev == stub_fb_dev && sb.st_ino == stub_fb_ino);
+}
+
+int
+ioctl (int fd, unsigned long request, ...)
+{
+	va_list ap;
+	void *arg;
+
+	va_start (ap, request);
+	arg = va_arg (ap, void *);
+	va_end (ap);
+
+	if (! is_stub_fb (fd)) {
+		return syscall (SYS_ioctl, fd, request, arg);
+	}
+
+	switch (request) {
+	case FBIOGET_FSCREENINFO:
+	{
+		struct fb_fix_screeninfo *fix = arg;
+
+		memset (fix, 0, sizeof (struct fb_fix_screeninfo));
+		fix->line_length = STUB_FB_XRES * STUB_FB_BPP / 8;
+		fix->smem_len = fix->line_length * STUB_FB_YRES * NUM_FB_DMABUF;
+		return 0;
+	}
+	case FBIOGET_VSCREENINFO:
+	{
+		struct fb_var_screeninfo *var = arg;
+
+		memset (var, 0, sizeof (struct fb_var_screeninfo));
+		var->xres = var->xres_virtual = STUB_FB_XRES;
+		var->yres = STUB_FB_YRES;
+		var->yres_virtual = STUB_FB_YRES * NUM_FB_DMABUF;
+		var->bits_per_pixel = STUB_FB_BPP;
+		var->red.offset = 16;
+		var->red.length = 8;
+		var->green.offset = 8;
+		var->green.length = 8;
+		var->blue.offset = 0;
+		var->blue.length = 8;
+		return 0;
+	}
+	case FBIOPAN_DISPLAY:
+	{
+		struct fb_var_screeninfo *var = arg;
+
+		g_mutex_lock (&stub_fb_lock);
+		stub_fb_pan_count++;
+		stub_fb_pan_index = var->yoffset / var->yres;
+		g_mutex_unlock (&stub_fb_lock);
+		return 0;
+	}
+	case FBIOGET_DMABUF:
+	{
+		struct fb_dmabuf_export *exp = arg;
+
+		exp->fd = dup (fd);
+		return (exp->fd < 0) ? -1 : 0;
+	}
+	case FBIOPUT_VSCREENINFO:
+	case FBIO_WAITFORVSYNC:
+	case FBIOBLANK:
+		return 0;
+	default:
+		errno = ENOTTY;
+		return -1;
+	}
+}
+
+static void
+setup_stub_fb (void)
+{
+	struct stat sb;
+	int fd;
+
+	fd = g_file_open_tmp ("acmfbdevsink-XXXXXX", &stub_fb_path, NULL);
+	fail_unless (fd >= 0);
+	fail_unless (0 == ftruncate (fd, STUB_FB_XRES * STUB_FB_BPP / 8
+								 * STUB_FB_YRES * NUM_FB_DMABUF));
+	fail_unless (0 == fstat (fd, &sb));
+	stub_fb_dev = sb.st_dev;
+	stub_fb_ino = sb.st_ino;
+	close (fd);
+
+	stub_fb_pan_count = 0;
+	stub_fb_pan_index = -1;
+}
+
+static void
+teardown_stub_fb (void)
+{
+	unlink (stub_fb_path);
+	g_free (stub_fb_path);
+	stub_fb_path = NULL;
+}
+
+/* 1 つのタイルのバッファを、DMABUF のインデックスを付けて描画させる */
+static void
+push_tile (GstPad *pad, gint index)
+{
+	GstBuffer *buf;
+
+	buf = gst_buffer_new ();
+	gst_buffer_add_acm_dmabuf_meta (buf, -1, index);
+	fail_unless (gst_pad_push (pad, buf) == GST_FLOW_OK);
+}
+
+static GstElement *
+setup_mosaic_tile (GstPad **pad)
+{
+	GstElement *tile;
+	GstCaps *caps;
+	GstSegment segment;
+
+	tile = gst_check_setup_element ("acmfbdevsink");
+	g_object_set (G_OBJECT (tile),
+				  "device", stub_fb_path,
+				  "mosaic-group", "wall",
+				  NULL);
+	*pad = gst_check_setup_src_pad (tile, &srctemplate);
+	gst_pad_set_active (*pad, TRUE);
+
+	fail_unless (gst_element_set_state (tile, GST_STATE_PLAYING)
+				 != GST_STATE_CHANGE_FAILURE);
+
+	fail_unless (gst_pad_push_event (*pad,
+		gst_event_new_stream_start ("acmfbdevsink-mosaic")));
+	caps = gst_caps_from_string ("video/x-raw, format = (string) RGBx, "
+		"width = (int) 160, height = (int) 120, framerate = (fraction) 30/1");
+	fail_unless (gst_pad_set_caps (*pad, caps));
+	gst_caps_unref (caps);
+	gst_segment_init (&segment, GST_FORMAT_TIME);
+	fail_unless (gst_pad_push_event (*pad, gst_event_new_segment (&segment)));
+
+	return tile;
+}
+
+static void
+cleanup_mosaic_tile (GstElement *tile)
+{
+	gst_element_set_state (tile, GST_STATE_NULL);
+	gst_check_teardown_src_pad (tile);
+	gst_check_teardown_element (tile);
+}
+
+GST_START_TEST (test_mosaic_render)
+{
+	GstElement *tileA, *tileB;
+	GstPad *padA, *padB;
+	gint panCount;
+
+	setup_stub_fb ();
+	tileA = setup_mosaic_tile (&padA);
+	tileB = setup_mosaic_tile (&padB);
+	/* 最初の sink が行う、ブランクスクリーンの PAN は数えない */
+	panCount = stub_fb_pan_count;
+
+	/* 最初の PAN は、全ての sink のタイルが揃うまで待つ */
+	push_tile (padA, 1);
+	fail_unless_equals_int (stub_fb_pan_count, panCount);
+	push_tile (padB, 1);
+	fail_unless_equals_int (stub_fb_pan_count, panCount + 1);
+	fail_unless_equals_int (stub_fb_pan_index, 1);
+
+	/* 片方だけでは PAN しない */
+	push_tile (padA, 2);
+	fail_unless_equals_int (stub_fb_pan_count, panCount + 1);
+
+	/* タイルを描画しなくなった sink (30 リフレッシュ = 0.5 秒) は待たない */
+	g_usleep (G_USEC_PER_SEC);
+	push_tile (padA, 3);
+	fail_unless_equals_int (stub_fb_pan_count, panCount + 2);
+	fail_unless_equals_int (stub_fb_pan_index, 3);
+
+	/* 描画を再開した sink は、再び待つ */
+	push_tile (padB, 0);
+	fail_unless_equals_int (stub_fb_pan_count, panCount + 2);
+	push_tile (padA, 0);
+	fail_unless_equals_int (stub_fb_pan_count, panCount + 3);
+	fail_unless_equals_int (stub_fb_pan_index, 0);
+
+	/* EOS の sink は待たない */
+	fail_unless (gst_pad_push_event (padB, gst_event_new_eos ()));
+	push_tile (padA, 1);
+	fail_unless_equals_int (stub_fb_pan_count, panCount + 4);
+	fail_unless_equals_int (stub_fb_pan_index, 1);
+
+	cleanup_mosaic_tile (tileA);
+	cleanup_mosaic_tile (tileB);
+	teardown_stub_fb ();
+}
+GST_END_TEST;
+
 GST_START_TEST (test_properties)
 {
 	GstElement *sink;
 	gchar *device = NULL;
 	gboolean use_dmabuf;
 	gboolean enable_vsync;
+	gchar *mosaic_group = NULL;
 
 	sink = setup_acmfbdevsink ();
 
@@ -95,6 +325,13 @@ GST_START_TEST (test_properties)
 	g_object_get (sink, "enable-vsync", &enable_vsync, NULL);
 	fail_unless_equals_int (enable_vsync, 0);
 
+	g_object_get (sink, "mosaic-group", &mosaic_group, NULL);
+	fail_unless (mosaic_group == NULL);
+	g_object_set (G_OBJECT (sink), "mosaic-group", "wall", NULL);
+	g_object_get (sink, "mosaic-group", &mosaic_group, NULL);
+	fail_unless (g_str_equal (mosaic_group, "wall"));
+	g_free (mosaic_group);
+
 	cleanup_acmfbdevsink (sink);
 }
 GST_END_TEST;
@@ -110,6 +347,7 @@ acmfbdevsink_suite (void)
 	suite_add_tcase (s, tc_chain);
 	tcase_set_timeout (tc_chain, 20);
 	tcase_add_test (tc_chain, test_properties);
+	tcase_add_test (tc_chain, test_mosaic_render);
 	
 	return s;
 }
@@ -32,6 +32,7 @@
 
 #include <gst/check/gstcheck.h>
 #include <gst/audio/audio.h>
+#include <gst/video/video.h>
 
 
 /* 入力データの種類	*/
@@ -57,6 +58,12 @@ static GstPad *mysrcpad, *mysinkpad;
 	"height  = (int)240, " \
 	"framerate = (fraction)30/1"
 
+#define BS_CAPS_STRING "video/x-h264, " \
+	"stream-format = (string) byte-stream, alignment = (string) au, " \
+	"width  = (int)320, " \
+	"height  = (int)240, " \
+	"framerate = (fraction)30/1"
+
 
 static GstStaticPadTemplate sinktemplate = GST_STATIC_PAD_TEMPLATE ("sink",
 	GST_PAD_SINK,
@@ -68,6 +75,11 @@ static GstStaticPadTemplate srctemplate = GST_STATIC_PAD_TEMPLATE ("src",
 	GST_PAD_ALWAYS,
 	GST_STATIC_CAPS (AVC_CAPS_STRING));
 
+static GstStaticPadTemplate bs_srctemplate = GST_STATIC_PAD_TEMPLATE ("src",
+	GST_PAD_SRC,
+	GST_PAD_ALWAYS,
+	GST_STATIC_CAPS (BS_CAPS_STRING));
+
 
 
 /* push するバッファ数 */
@@ -95,14 +107,15 @@ get_data(char *file, size_t *size, void **p)
 }
 
 static GstElement *
-setup_acmh264dec ()
+setup_acmh264dec (gint in_type)
 {
 	GstElement *acmh264dec;
 	
 	g_print ("setup_acmh264dec\n");
 	acmh264dec = gst_check_setup_element ("acmh264dec");
 	g_print ("pass : gst_check_setup_element()\n");
-	mysrcpad = gst_check_setup_src_pad (acmh264dec, &srctemplate);
+	mysrcpad = gst_check_setup_src_pad (acmh264dec,
+		(BS_NAL == in_type) ? &bs_srctemplate : &srctemplate);
 	g_print ("pass : gst_check_setup_src_pad()\n");
 	mysinkpad = gst_check_setup_sink_pad (acmh264dec, &sinktemplate);
 	g_print ("pass : gst_check_setup_sink_pad()\n");
@@ -135,6 +148,10 @@ GST_START_TEST (test_properties)
 	gint 	stride;
 	gint 	x_offset;
 	gint 	y_offset;
+	gboolean qos;
+	guint watchdog_frames;
+	gboolean idr_only;
+	GstStructure *stats = NULL;
 
 	acmh264dec = setup_acmh264dec (AVC_AU);
 	
@@ -145,6 +162,9 @@ GST_START_TEST (test_properties)
 				  "stride",			2048,
 				  "x-offset",		20,
 				  "y-offset",		30,
+				  "qos",			FALSE,
+				  "watchdog-frames",	15,
+				  "idr-only",		TRUE,
 				  NULL);
 	g_object_get (acmh264dec,
 				  "device", 		&device,
@@ -153,6 +173,9 @@ GST_START_TEST (test_properties)
 				  "stride",			&stride,
 				  "x-offset",		&x_offset,
 				  "y-offset",		&y_offset,
+				  "qos",			&qos,
+				  "watchdog-frames",	&watchdog_frames,
+				  "idr-only",		&idr_only,
 				  NULL);
 	fail_unless (g_str_equal (device, "/dev/video1"));
 	fail_unless_equals_int (buf_pic_cnt, 5);
@@ -160,6 +183,9 @@ GST_START_TEST (test_properties)
 	fail_unless_equals_int (stride, 2048);
 	fail_unless_equals_int (x_offset, 20);
 	fail_unless_equals_int (y_offset, 30);
+	fail_unless (qos == FALSE);
+	fail_unless_equals_int (watchdog_frames, 15);
+	fail_unless (idr_only == TRUE);
 	g_free (device);
 	device = NULL;
 
@@ -171,6 +197,9 @@ GST_START_TEST (test_properties)
 				  "stride",			240,
 				  "x-offset",		100,
 				  "y-offset",		200,
+				  "qos",			TRUE,
+				  "watchdog-frames",	0,
+				  "idr-only",		FALSE,
 				  NULL);
 	g_object_get (acmh264dec,
 				  "device", 		&device,
@@ -179,6 +208,9 @@ GST_START_TEST (test_properties)
 				  "stride",			&stride,
 				  "x-offset",		&x_offset,
 				  "y-offset",		&y_offset,
+				  "qos",			&qos,
+				  "watchdog-frames",	&watchdog_frames,
+				  "idr-only",		&idr_only,
 				  NULL);
 	fail_unless (g_str_equal (device, "/dev/video2"));
 	fail_unless_equals_int (buf_pic_cnt, 8);
@@ -186,9 +218,26 @@ GST_START_TEST (test_properties)
 	fail_unless_equals_int (stride, 240);
 	fail_unless_equals_int (x_offset, 100);
 	fail_unless_equals_int (y_offset, 200);
+	fail_unless (qos == TRUE);
+	fail_unless_equals_int (watchdog_frames, 0);
+	fail_unless (idr_only == FALSE);
 	g_free (device);
 	device = NULL;
 
+	/* read only properties */
+	g_object_get (acmh264dec,
+				  "stats",			&stats,
+				  NULL);
+	fail_unless (stats != NULL);
+	fail_unless (gst_structure_has_field (stats, "output-format"));
+	fail_unless (gst_structure_has_field (stats, "bandwidth"));
+	fail_unless (gst_structure_has_field (stats, "fps"));
+	fail_unless (gst_structure_has_field (stats, "decode-latency-peak"));
+	fail_unless (gst_structure_has_field (stats, "dropped-qos"));
+	fail_unless (gst_structure_has_field (stats, "frames-in-device"));
+	gst_structure_free (stats);
+	stats = NULL;
+
 	cleanup_acmh264dec (acmh264dec);
 }
 GST_END_TEST;
@@ -259,7 +308,7 @@ GST_START_TEST (test_decode_mp4)
 						 NULL);
 	gst_buffer_unref (codec_buf);
 
-	acmh264dec = setup_acmh264dec ();
+	acmh264dec = setup_acmh264dec (AVC_AU);
 	fail_unless (gst_element_set_state (acmh264dec, GST_STATE_PLAYING)
 				 == GST_STATE_CHANGE_SUCCESS, "could not set to playing");
 	
@@ -376,7 +425,7 @@ GST_START_TEST (test_decode_ts)
 						 NULL);
 	gst_buffer_unref (codec_buf);
 	
-	acmh264dec = setup_acmh264dec ();
+	acmh264dec = setup_acmh264dec (AVC_AU);
 	fail_unless (gst_element_set_state (acmh264dec, GST_STATE_PLAYING)
 				 == GST_STATE_CHANGE_SUCCESS, "could not set to playing");
 	
@@ -427,6 +476,551 @@ GST_START_TEST (test_decode_ts)
 }
 GST_END_TEST;
 
+static GstFlowReturn
+test_decode_bs_chain(GstPad * pad, GstObject * parent, GstBuffer * buf)
+{
+	size_t size;
+	void *p;
+	char file[PATH_MAX];
+	static gint nOutputBuffers = 0;
+	GstBuffer *outbuffer;
+	GstMapInfo map;
+	GstFlowReturn ret;
+
+	ret = g_base_chain(pad, parent, buf);
+
+	/* 出力されたバッファのチェック (mp4 と同じデコード結果になる) */
+	if (g_list_length (buffers) > 0) {
+		++nOutputBuffers;
+
+		outbuffer = GST_BUFFER (buffers->data);
+		fail_if (outbuffer == NULL);
+		fail_unless (GST_IS_BUFFER (outbuffer));
+
+		sprintf(file, "data/h264/mp4/rgb_%03d.data", nOutputBuffers);
+		g_print("%s\n", file);
+
+		get_data(file, &size, &p);
+
+		fail_unless (gst_buffer_get_size (outbuffer) == size);
+		gst_buffer_map (outbuffer, &map, GST_MAP_READ);
+		fail_unless (0 == memcmp(p, map.data, size));
+		gst_buffer_unmap (outbuffer, &map);
+
+		fail_unless (0 == munmap(p, size));
+
+		buffers = g_list_remove (buffers, outbuffer);
+
+		ASSERT_BUFFER_REFCOUNT (outbuffer, "outbuffer", 2);
+		gst_buffer_unref (outbuffer);
+		outbuffer = NULL;
+	}
+
+	return ret;
+}
+
+/* avc のデータ (サイズ情報 + NAL) を、byte-stream (スタートコード + NAL) に
+ * 変換して、outbuf の offset 以降に書き込む。書き込んだサイズを返す
+ */
+static gsize
+avc_to_byte_stream(const guint8 *data, gsize size, guint nal_length_size,
+	GstBuffer *outbuf, gsize offset)
+{
+	static const guint8 start_code[] = { 0x00, 0x00, 0x00, 0x01 };
+	gsize pos = 0;
+	gsize written = 0;
+	guint32 len;
+	guint i;
+
+	while (pos + nal_length_size <= size) {
+		len = 0;
+		for (i = 0; i < nal_length_size; i++) {
+			len = (len << 8) | data[pos + i];
+		}
+		pos += nal_length_size;
+		fail_unless (pos + len <= size);
+
+		gst_buffer_fill (outbuf, offset + written, start_code,
+						 sizeof (start_code));
+		written += sizeof (start_code);
+		gst_buffer_fill (outbuf, offset + written, data + pos, len);
+		written += len;
+		pos += len;
+	}
+
+	return written;
+}
+
+GST_START_TEST (test_decode_bs)
+{
+	GstCaps *caps;
+
+	GstElement *acmh264dec;
+	size_t size;
+	void *p;
+	char file[PATH_MAX];
+	const guint8 *codec_data;
+	guint8 spspps[256];
+	gsize spspps_size = 0;
+	guint nal_length_size;
+	guint num;
+	guint len;
+	guint i;
+	guint j;
+	gsize pos;
+	GstBuffer *inbuffer;
+	gint nInputBuffers = 0;
+
+	/* codec_data (avcC) から SPS/PPS を取り出し、スタートコードを付ける */
+	sprintf(file, "data/h264/mp4/_codec_data.data");
+	g_print("%s\n", file);
+	get_data(file, &size, &p);
+	codec_data = p;
+	nal_length_size = (codec_data[4] & 0x03) + 1;
+	pos = 5;
+	/* SPS の数、SPS、PPS の数、PPS の順	*/
+	for (j = 0; j < 2; j++) {
+		num = codec_data[pos++];
+		if (0 == j) {
+			num &= 0x1f;
+		}
+		for (i = 0; i < num; i++) {
+			len = (codec_data[pos] << 8) | codec_data[pos + 1];
+			pos += 2;
+			fail_unless (spspps_size + 4 + len <= sizeof (spspps));
+			spspps[spspps_size++] = 0x00;
+			spspps[spspps_size++] = 0x00;
+			spspps[spspps_size++] = 0x00;
+			spspps[spspps_size++] = 0x01;
+			memcpy (spspps + spspps_size, codec_data + pos, len);
+			spspps_size += len;
+			pos += len;
+		}
+	}
+	fail_unless (0 == munmap(p, size));
+
+	caps = gst_caps_from_string (BS_CAPS_STRING);
+
+	acmh264dec = setup_acmh264dec (BS_NAL);
+	fail_unless (gst_element_set_state (acmh264dec, GST_STATE_PLAYING)
+				 == GST_STATE_CHANGE_SUCCESS, "could not set to playing");
+
+	/* byte-stream でネゴシエーションできる */
+	fail_unless (gst_pad_set_caps (mysrcpad, caps));
+
+	g_base_chain = GST_PAD_CHAINFUNC (mysinkpad);
+	gst_pad_set_chain_function (mysinkpad,
+		GST_DEBUG_FUNCPTR (test_decode_bs_chain));
+
+	while (TRUE) {
+		/* バッファの入力 */
+		if (++nInputBuffers < PUSH_BUFFERS) {
+			sprintf(file, "data/h264/mp4/h264_%03d.data", nInputBuffers);
+			g_print("%s\n", file);
+
+			get_data(file, &size, &p);
+
+			/* スタートコード (4 バイト) は、サイズ情報より長い場合がある */
+			inbuffer = gst_buffer_new_and_alloc (spspps_size + size * 4);
+			pos = 0;
+			if (1 == nInputBuffers) {
+				gst_buffer_fill (inbuffer, 0, spspps, spspps_size);
+				pos = spspps_size;
+			}
+			pos += avc_to_byte_stream (p, size, nal_length_size, inbuffer, pos);
+			gst_buffer_set_size (inbuffer, pos);
+
+			fail_unless (0 == munmap(p, size));
+
+			GST_BUFFER_TIMESTAMP (inbuffer) = 0;
+			ASSERT_BUFFER_REFCOUNT (inbuffer, "inbuffer", 1);
+
+			fail_unless (gst_pad_push (mysrcpad, inbuffer) == GST_FLOW_OK);
+		}
+
+
+		if (nInputBuffers == PUSH_BUFFERS) {
+			/* EOS イベント送信 */
+			fail_unless (gst_pad_push_event (mysrcpad,
+				gst_event_new_eos ()) == TRUE);
+
+			break;
+		}
+	}
+
+	/* クリーンアップ	*/
+	g_print("cleanup...\n");
+	cleanup_acmh264dec (acmh264dec);
+	g_list_free (buffers);
+	buffers = NULL;
+
+	gst_caps_unref (caps);
+}
+GST_END_TEST;
+
+/* インターレース (フィールド構造) の byte-stream の push するバッファ数
+ * (フィールド単位)
+ */
+#define PUSH_FIELDS	20
+
+static gint g_interlaced_out_buffers = 0;
+
+static GstFlowReturn
+test_decode_bs_interlaced_chain(GstPad * pad, GstObject * parent, GstBuffer * buf)
+{
+	GstBuffer *outbuffer;
+	GstMapInfo map;
+	GstFlowReturn ret;
+	const gsize rowSize = 320 * 3;
+
+	ret = g_base_chain(pad, parent, buf);
+
+	/* 2 フィールドを 1 フレームにして出力する */
+	if (g_list_length (buffers) > 0) {
+		++g_interlaced_out_buffers;
+
+		outbuffer = GST_BUFFER (buffers->data);
+		fail_if (outbuffer == NULL);
+		fail_unless (GST_IS_BUFFER (outbuffer));
+		fail_unless (GST_BUFFER_FLAG_IS_SET (outbuffer,
+			GST_VIDEO_BUFFER_FLAG_INTERLACED));
+
+		/* トップ、ボトムのフィールドは輝度が異なるので、隣接する行は一致しない */
+		fail_unless (gst_buffer_get_size (outbuffer) == rowSize * 240);
+		gst_buffer_map (outbuffer, &map, GST_MAP_READ);
+		fail_unless (0 != memcmp(map.data, map.data + rowSize, rowSize));
+		fail_unless (0 == memcmp(map.data, map.data + rowSize * 2, rowSize));
+		gst_buffer_unmap (outbuffer, &map);
+
+		buffers = g_list_remove (buffers, outbuffer);
+
+		ASSERT_BUFFER_REFCOUNT (outbuffer, "outbuffer", 2);
+		gst_buffer_unref (outbuffer);
+		outbuffer = NULL;
+	}
+
+	return ret;
+}
+
+GST_START_TEST (test_decode_bs_interlaced)
+{
+	GstCaps *caps;
+	GstCaps *outcaps;
+	GstStructure *structure;
+
+	GstElement *acmh264dec;
+	size_t size;
+	void *p;
+	char file[PATH_MAX];
+	GstBuffer *inbuffer;
+	gint nInputBuffers = 0;
+
+	/* codec_data は無く、SPS (frame_mbs_only_flag = 0) はストリーム内にある */
+	caps = gst_caps_from_string (BS_CAPS_STRING);
+
+	acmh264dec = setup_acmh264dec (BS_NAL);
+	fail_unless (gst_element_set_state (acmh264dec, GST_STATE_PLAYING)
+				 == GST_STATE_CHANGE_SUCCESS, "could not set to playing");
+
+	fail_unless (gst_pad_set_caps (mysrcpad, caps));
+
+	g_base_chain = GST_PAD_CHAINFUNC (mysinkpad);
+	gst_pad_set_chain_function (mysinkpad,
+		GST_DEBUG_FUNCPTR (test_decode_bs_interlaced_chain));
+	g_interlaced_out_buffers = 0;
+
+	while (++nInputBuffers <= PUSH_FIELDS) {
+		sprintf(file, "data/h264/bs_interlaced/h264_%03d.data", nInputBuffers);
+		g_print("%s\n", file);
+
+		get_data(file, &size, &p);
+
+		inbuffer = gst_buffer_new_and_alloc (size);
+		gst_buffer_fill (inbuffer, 0, p, size);
+
+		fail_unless (0 == munmap(p, size));
+
+		GST_BUFFER_TIMESTAMP (inbuffer) = 0;
+		ASSERT_BUFFER_REFCOUNT (inbuffer, "inbuffer", 1);
+
+		fail_unless (gst_pad_push (mysrcpad, inbuffer) == GST_FLOW_OK);
+	}
+
+	/* EOS イベント送信 */
+	fail_unless (gst_pad_push_event (mysrcpad, gst_event_new_eos ()) == TRUE);
+
+	/* 最初のフレームの SPS で、インターレースとしてネゴシエーションしている */
+	outcaps = gst_pad_get_current_caps (mysinkpad);
+	fail_unless (outcaps != NULL);
+	structure = gst_caps_get_structure (outcaps, 0);
+	fail_unless (g_str_equal (gst_structure_get_string (structure,
+		"interlace-mode"), "mixed"));
+	gst_caps_unref (outcaps);
+
+	/* フィールド数の半分のフレームが出力される */
+	fail_unless_equals_int (g_interlaced_out_buffers, PUSH_FIELDS / 2);
+
+	/* クリーンアップ	*/
+	g_print("cleanup...\n");
+	cleanup_acmh264dec (acmh264dec);
+	g_list_free (buffers);
+	buffers = NULL;
+
+	gst_caps_unref (caps);
+}
+GST_END_TEST;
+
+/* 出力されたフレームの数と、最後に出力されたフレーム。
+ * g_expected_outputs が NULL でなければ、n 番目の出力を
+ * data/h264/mp4/rgb_<g_expected_outputs[n]>.data と比較する
+ */
+static gint g_num_outputs = 0;
+static GstBuffer *g_last_output = NULL;
+static const gint *g_expected_outputs = NULL;
+
+static GstFlowReturn
+test_decode_count_chain(GstPad * pad, GstObject * parent, GstBuffer * buf)
+{
+	size_t size;
+	void *p;
+	char file[PATH_MAX];
+	GstBuffer *outbuffer;
+	GstMapInfo map;
+	GstFlowReturn ret;
+
+	ret = g_base_chain(pad, parent, buf);
+
+	while (g_list_length (buffers) > 0) {
+		outbuffer = GST_BUFFER (buffers->data);
+		fail_if (outbuffer == NULL);
+		fail_unless (GST_IS_BUFFER (outbuffer));
+		buffers = g_list_remove (buffers, outbuffer);
+
+		if (g_expected_outputs) {
+			fail_unless (g_expected_outputs[g_num_outputs] > 0);
+			sprintf(file, "data/h264/mp4/rgb_%03d.data",
+					g_expected_outputs[g_num_outputs]);
+			g_print("%s\n", file);
+
+			get_data(file, &size, &p);
+
+			fail_unless (gst_buffer_get_size (outbuffer) == size);
+			gst_buffer_map (outbuffer, &map, GST_MAP_READ);
+			fail_unless (0 == memcmp(p, map.data, size));
+			gst_buffer_unmap (outbuffer, &map);
+
+			fail_unless (0 == munmap(p, size));
+		}
+		++g_num_outputs;
+
+		if (g_last_output) {
+			gst_buffer_unref (g_last_output);
+		}
+		g_last_output = gst_buffer_copy (outbuffer);
+		gst_buffer_unref (outbuffer);
+	}
+
+	return ret;
+}
+
+/* data/h264/mp4 のデコーダを PLAYING にして、出力を数える chain を設定する */
+static GstElement *
+setup_decode_mp4 (void)
+{
+	GstElement *acmh264dec;
+	GstCaps *caps;
+	size_t size;
+	void *p;
+	GstBuffer *codec_buf;
+
+	get_data("data/h264/mp4/_codec_data.data", &size, &p);
+	codec_buf = gst_buffer_new_and_alloc (size);
+	gst_buffer_fill (codec_buf, 0, p, size);
+	fail_unless (0 == munmap(p, size));
+
+	caps = gst_caps_from_string (AVC_CAPS_STRING);
+	gst_caps_set_simple (caps, "codec_data", GST_TYPE_BUFFER, codec_buf,
+						 NULL);
+	gst_buffer_unref (codec_buf);
+
+	acmh264dec = setup_acmh264dec (AVC_AU);
+	fail_unless (gst_element_set_state (acmh264dec, GST_STATE_PLAYING)
+				 == GST_STATE_CHANGE_SUCCESS, "could not set to playing");
+
+	fail_unless (gst_pad_set_caps (mysrcpad, caps));
+	gst_caps_unref (caps);
+
+	g_base_chain = GST_PAD_CHAINFUNC (mysinkpad);
+	gst_pad_set_chain_function (mysinkpad,
+		GST_DEBUG_FUNCPTR (test_decode_count_chain));
+	g_num_outputs = 0;
+	g_expected_outputs = NULL;
+
+	return acmh264dec;
+}
+
+static void
+cleanup_decode_mp4 (GstElement * acmh264dec)
+{
+	g_print("cleanup...\n");
+	cleanup_acmh264dec (acmh264dec);
+	g_list_free (buffers);
+	buffers = NULL;
+	if (g_last_output) {
+		gst_buffer_unref (g_last_output);
+		g_last_output = NULL;
+	}
+	g_expected_outputs = NULL;
+}
+
+/* data/h264/mp4 の num 番目のフレームを、30 fps の timestamp で push する。
+ * corrupt が TRUE なら、スライスの NAL ヘッダ以降を壊す
+ */
+static void
+push_mp4_frame (gint num, gboolean corrupt)
+{
+	size_t size;
+	void *p;
+	char file[PATH_MAX];
+	GstBuffer *inbuffer;
+	GstMapInfo map;
+	gsize pos;
+	gsize len;
+	gsize i;
+
+	sprintf(file, "data/h264/mp4/h264_%03d.data", num);
+	g_print("%s%s\n", file, corrupt ? " (corrupt)" : "");
+
+	get_data(file, &size, &p);
+	inbuffer = gst_buffer_new_and_alloc (size);
+	gst_buffer_fill (inbuffer, 0, p, size);
+	fail_unless (0 == munmap(p, size));
+
+	if (corrupt) {
+		/* サイズ情報 (4 バイト) と NAL ヘッダは残す */
+		fail_unless (gst_buffer_map (inbuffer, &map, GST_MAP_WRITE));
+		for (pos = 0; pos + 5 <= map.size; pos += 4 + len) {
+			len = GST_READ_UINT32_BE (map.data + pos);
+			if (1 != (map.data[pos + 4] & 0x1f)) {
+				continue;
+			}
+			for (i = pos + 5; i < pos + 4 + len && i < map.size; i++) {
+				map.data[i] = (guint8)(i * 0x9d + num);
+			}
+		}
+		gst_buffer_unmap (inbuffer, &map);
+	}
+
+	GST_BUFFER_PTS (inbuffer) = gst_util_uint64_scale (num - 1, GST_SECOND, 30);
+	GST_BUFFER_DURATION (inbuffer) = gst_util_uint64_scale (1, GST_SECOND, 30);
+	ASSERT_BUFFER_REFCOUNT (inbuffer, "inbuffer", 1);
+
+	fail_unless (gst_pad_push (mysrcpad, inbuffer) == GST_FLOW_OK);
+}
+
+static guint64
+get_stats_uint64 (GstElement * acmh264dec, const gchar * field)
+{
+	GstStructure *stats = NULL;
+	guint64 value = 0;
+
+	g_object_get (acmh264dec, "stats", &stats, NULL);
+	fail_unless (stats != NULL);
+	fail_unless (gst_structure_get_uint64 (stats, field, &value));
+	gst_structure_free (stats);
+
+	return value;
+}
+
+GST_START_TEST (test_decode_watchdog)
+{
+	GstElement *acmh264dec;
+	size_t size;
+	void *p;
+	GstMapInfo map;
+	gint nInputBuffers;
+
+	acmh264dec = setup_decode_mp4 ();
+	/* 0.5 秒 (15 フレーム) 進まなければ、デバイスをリセットする */
+	g_object_set (acmh264dec, "watchdog-frames", 15, NULL);
+
+	/* 2 番目の IDR ピクチャ (34) までのスライスを壊し、デバイスを止める。
+	 * エラーにならずに、次の IDR ピクチャからデコードを再開すること
+	 */
+	for (nInputBuffers = 1; nInputBuffers < PUSH_BUFFERS; nInputBuffers++) {
+		push_mp4_frame (nInputBuffers, 1 < nInputBuffers && nInputBuffers < 34);
+	}
+	fail_unless (gst_pad_push_event (mysrcpad, gst_event_new_eos ()) == TRUE);
+
+	g_print("outputs:%d, dropped-resync:%" G_GUINT64_FORMAT "\n", g_num_outputs,
+			get_stats_uint64 (acmh264dec, "dropped-resync"));
+
+	/* 再開した後のフレームは、全て正しくデコードされる */
+	fail_unless (g_num_outputs >= PUSH_BUFFERS - 34);
+	fail_unless (g_last_output != NULL);
+	get_data("data/h264/mp4/rgb_099.data", &size, &p);
+	fail_unless (gst_buffer_get_size (g_last_output) == size);
+	gst_buffer_map (g_last_output, &map, GST_MAP_READ);
+	fail_unless (0 == memcmp(p, map.data, size));
+	gst_buffer_unmap (g_last_output, &map);
+	fail_unless (0 == munmap(p, size));
+
+	cleanup_decode_mp4 (acmh264dec);
+}
+GST_END_TEST;
+
+GST_START_TEST (test_decode_qos)
+{
+	GstElement *acmh264dec;
+	gint nInputBuffers;
+
+	acmh264dec = setup_decode_mp4 ();
+
+	for (nInputBuffers = 1; nInputBuffers < PUSH_BUFFERS; nInputBuffers++) {
+		/* down stream から、10 秒遅れている QoS イベントを送る */
+		if (10 == nInputBuffers) {
+			fail_unless (gst_pad_push_event (mysinkpad,
+				gst_event_new_qos (GST_QOS_TYPE_UNDERFLOW, 2.0,
+					10 * GST_SECOND, gst_util_uint64_scale (9, GST_SECOND, 30))));
+		}
+		push_mp4_frame (nInputBuffers, FALSE);
+	}
+	fail_unless (gst_pad_push_event (mysrcpad, gst_event_new_eos ()) == TRUE);
+
+	g_print("outputs:%d, dropped-qos:%" G_GUINT64_FORMAT "\n", g_num_outputs,
+			get_stats_uint64 (acmh264dec, "dropped-qos"));
+
+	/* 間に合わないフレームは、デバイスに入力せずに破棄する */
+	fail_unless (get_stats_uint64 (acmh264dec, "dropped-qos") > 0);
+	fail_unless (g_num_outputs < PUSH_BUFFERS - 1);
+
+	cleanup_decode_mp4 (acmh264dec);
+}
+GST_END_TEST;
+
+GST_START_TEST (test_decode_idr_only)
+{
+	GstElement *acmh264dec;
+	gint nInputBuffers;
+	/* data/h264/mp4 の IDR ピクチャ */
+	static const gint idrFrames[] = { 1, 34, 67, 0 };
+
+	acmh264dec = setup_decode_mp4 ();
+	g_object_set (acmh264dec, "idr-only", TRUE, NULL);
+	g_expected_outputs = idrFrames;
+
+	for (nInputBuffers = 1; nInputBuffers < PUSH_BUFFERS; nInputBuffers++) {
+		push_mp4_frame (nInputBuffers, FALSE);
+	}
+	fail_unless (gst_pad_push_event (mysrcpad, gst_event_new_eos ()) == TRUE);
+
+	/* IDR ピクチャだけが、全てのフレームを入力した場合と同じ画像で出力される */
+	fail_unless_equals_int (g_num_outputs, 3);
+
+	cleanup_decode_mp4 (acmh264dec);
+}
+GST_END_TEST;
+
 static Suite *
 acmh264dec_suite (void)
 {
@@ -439,6 +1033,11 @@ acmh264dec_suite (void)
 	tcase_add_test (tc_chain, test_properties);
 	tcase_add_test (tc_chain, test_decode_mp4);
 	tcase_add_test (tc_chain, test_decode_ts);
+	tcase_add_test (tc_chain, test_decode_bs);
+	tcase_add_test (tc_chain, test_decode_bs_interlaced);
+	tcase_add_test (tc_chain, test_decode_watchdog);
+	tcase_add_test (tc_chain, test_decode_qos);
+	tcase_add_test (tc_chain, test_decode_idr_only);
 
 	return s;
 }
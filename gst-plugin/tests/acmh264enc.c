@@ -765,6 +765,171 @@ GST_START_TEST (test_property_comb_offset)
 }
 GST_END_TEST;
 
+/* ストリーム中に変更できるプロパティ	*/
+GST_START_TEST (test_property_mutable_playing)
+{
+	GstElement *acmh264enc;
+	GObjectClass *klass;
+	const gchar *names[] = { "bitrate", "rate-control-mode", "max-gop-length" };
+	guint i;
+
+	acmh264enc = setup_acmh264enc (&sinktemplate_avc);
+	klass = G_OBJECT_GET_CLASS (acmh264enc);
+	for (i = 0; i < G_N_ELEMENTS (names); i++) {
+		GParamSpec *pspec = g_object_class_find_property (klass, names[i]);
+
+		fail_unless (pspec != NULL);
+		fail_unless (pspec->flags & GST_PARAM_MUTABLE_PLAYING);
+	}
+	cleanup_acmh264enc (acmh264enc);
+}
+GST_END_TEST;
+
+/* SPS/PPS の挿入間隔	*/
+GST_START_TEST (test_property_config_interval)
+{
+	GstElement *acmh264enc;
+	gint config_interval;
+
+	acmh264enc = setup_acmh264enc (&sinktemplate_bs);
+
+	g_object_get (acmh264enc, "config-interval", &config_interval, NULL);
+	fail_unless_equals_int (config_interval, 0);
+
+	g_object_set (acmh264enc, "config-interval", -1, NULL);
+	g_object_get (acmh264enc, "config-interval", &config_interval, NULL);
+	fail_unless_equals_int (config_interval, -1);
+
+	g_object_set (acmh264enc, "config-interval", 2, NULL);
+	g_object_get (acmh264enc, "config-interval", &config_interval, NULL);
+	fail_unless_equals_int (config_interval, 2);
+
+	cleanup_acmh264enc (acmh264enc);
+}
+GST_END_TEST;
+
+/* 低遅延モード	*/
+GST_START_TEST (test_property_zero_latency)
+{
+	GstElement *acmh264enc;
+	gboolean zero_latency;
+
+	acmh264enc = setup_acmh264enc (&sinktemplate_avc);
+
+	g_object_get (acmh264enc, "zero-latency", &zero_latency, NULL);
+	fail_unless (! zero_latency);
+
+	g_object_set (acmh264enc, "zero-latency", TRUE, NULL);
+	g_object_get (acmh264enc, "zero-latency", &zero_latency, NULL);
+	fail_unless (zero_latency);
+
+	cleanup_acmh264enc (acmh264enc);
+}
+GST_END_TEST;
+
+/* PLAYING 中の max-gop-length の変更が、次の GOP の先頭から反映されること。
+ * 変更の記録と、デバイスへの反映 (S_CTRL / 再設定) は、デバイス上でしか
+ * 確認できないため、出力の I ピクチャで確認する
+ */
+#define MUTABLE_GOP_LENGTH		15
+#define MUTABLE_PUSH_BUFFERS	(MUTABLE_GOP_LENGTH * 4)
+
+static void
+push_input_range(gint first, gint last, char* data_path)
+{
+	size_t size;
+	void *p;
+	int fd;
+	char file[PATH_MAX];
+	GstBuffer *inbuffer;
+	gint i;
+
+	for (i = first; i <= last; i++) {
+		sprintf(file, data_path, i);
+		get_data(file, &size, &p, &fd);
+
+		inbuffer = gst_buffer_new_and_alloc (size);
+		gst_buffer_fill (inbuffer, 0, p, size);
+
+		fail_unless (0 == munmap(p, size));
+		close(fd);
+
+		GST_BUFFER_TIMESTAMP (inbuffer) =
+			gst_util_uint64_scale (i - 1, GST_SECOND, 30);
+		ASSERT_BUFFER_REFCOUNT (inbuffer, "inbuffer", 1);
+
+		fail_unless (gst_pad_push (mysrcpad, inbuffer) == GST_FLOW_OK);
+	}
+}
+
+GST_START_TEST (test_property_change_playing)
+{
+	GstElement *acmh264enc;
+	GstCaps *srccaps;
+	GstBuffer *outbuffer;
+	gint max_GOP_length;
+	int i, num_buffers, nDeltaBefore = 0;
+
+	/* setup */
+	acmh264enc = setup_acmh264enc (&sinktemplate_avc);
+	g_object_set (acmh264enc,
+				  "b-pic-mode",				0,
+				  "max-gop-length",			MUTABLE_GOP_LENGTH,
+				  NULL);
+	fail_unless (gst_element_set_state (acmh264enc, GST_STATE_PLAYING)
+				 == GST_STATE_CHANGE_SUCCESS, "could not set to playing");
+
+	srccaps = gst_caps_from_string (VIDEO_CAPS_STRING);
+	gst_pad_set_caps (mysrcpad, srccaps);
+
+	/* 前半は GOP 長 15	*/
+	push_input_range (1, MUTABLE_PUSH_BUFFERS / 2,
+					  "data/h264_enc/input01/yuv_%03d.data");
+
+	/* 後半は全て I ピクチャ	*/
+	g_object_set (acmh264enc, "max-gop-length", 1, NULL);
+	g_object_get (acmh264enc, "max-gop-length", &max_GOP_length, NULL);
+	fail_unless_equals_int (max_GOP_length, 1);
+	push_input_range (MUTABLE_PUSH_BUFFERS / 2 + 1, MUTABLE_PUSH_BUFFERS,
+					  "data/h264_enc/input01/yuv_%03d.data");
+
+	fail_unless (gst_pad_push_event (mysrcpad, gst_event_new_eos ()) == TRUE);
+
+	num_buffers = g_list_length (buffers);
+	fail_unless_equals_int (num_buffers, MUTABLE_PUSH_BUFFERS);
+
+	for (i = 0; i < num_buffers; i++) {
+		outbuffer = GST_BUFFER (buffers->data);
+		fail_if (outbuffer == NULL);
+		buffers = g_list_remove (buffers, outbuffer);
+
+		if (i < MUTABLE_GOP_LENGTH) {
+			/* 変更前の GOP には P ピクチャがある	*/
+			if (GST_BUFFER_FLAG_IS_SET (outbuffer, GST_BUFFER_FLAG_DELTA_UNIT)) {
+				nDeltaBefore++;
+			}
+		}
+		else if (i >= MUTABLE_PUSH_BUFFERS - MUTABLE_GOP_LENGTH) {
+			/* 次の GOP の先頭までに、変更が反映されている	*/
+			fail_if (GST_BUFFER_FLAG_IS_SET (outbuffer, GST_BUFFER_FLAG_DELTA_UNIT),
+					 "frame %d is not a key frame", i);
+		}
+
+		ASSERT_BUFFER_REFCOUNT (outbuffer, "outbuffer", 1);
+		gst_buffer_unref (outbuffer);
+	}
+	fail_unless (nDeltaBefore > 0);
+
+	/* cleanup */
+	cleanup_acmh264enc (acmh264enc);
+	gst_caps_unref (srccaps);
+	if (buffers) {
+		g_list_free (buffers);
+		buffers = NULL;
+	}
+}
+GST_END_TEST;
+
 /* check caps	*/
 GST_START_TEST (test_check_caps)
 {
@@ -1402,6 +1567,10 @@ acmh264enc_suite (void)
 	tcase_add_test (tc_chain, test_property_comb_gop);
 	tcase_add_test (tc_chain, test_property_comb_input_size);
 	tcase_add_test (tc_chain, test_property_comb_offset);
+	tcase_add_test (tc_chain, test_property_mutable_playing);
+	tcase_add_test (tc_chain, test_property_change_playing);
+	tcase_add_test (tc_chain, test_property_config_interval);
+	tcase_add_test (tc_chain, test_property_zero_latency);
 
 	tcase_add_test (tc_chain, test_check_caps);
 